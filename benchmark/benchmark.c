@@ -34,6 +34,8 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 
 size_t filter_pkt(bpf_ctx_t *, bpf_args_t *);
@@ -48,6 +50,11 @@ test_fun(bpfjit_function_t fun, const uint8_t *pkt,
 /*
  * From bpf(4): This filter accepts only IP packets between host
  * 128.3.112.15 and 128.3.112.35.
+ *
+ * The longest path reads one halfword and two words. Reading them byte
+ * by byte (bpfjit built with -DBPFJIT_NO_UNALIGNED_LOADS) takes 4+10+10
+ * instructions, unaligned loads on x86 take 2+2+2 instructions. Compare
+ * ns/packet printed by "-j" for both builds.
  */
 static struct bpf_insn insns[] = {
 	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
@@ -63,6 +70,57 @@ static struct bpf_insn insns[] = {
 	BPF_STMT(BPF_RET+BPF_K, 0)
 };
 
+/*
+ * Filters that accept a packet if its halfword at offset 20 (TCP
+ * or UDP source port of IPv4 packet without options) is one of
+ * nkeys constants. The program is a ladder of BPF_JEQ instructions,
+ * each group of LADDER_GROUP instructions jumps to its own
+ * BPF_RET+BPF_K to stay within the range of jt.
+ */
+#define LADDER_GROUP	128
+#define LADDER_KEY(i)	(1000 + 37 * (i))
+
+static const size_t ladder_sizes[] = { 16, 64, 256 };
+
+static struct bpf_insn *
+make_ladder(size_t nkeys, size_t *insn_count)
+{
+	struct bpf_insn *prog;
+	size_t i, j, n, group, pos;
+
+	n = 1 + nkeys + (nkeys + LADDER_GROUP - 1) / LADDER_GROUP + 1;
+	prog = calloc(n, sizeof(prog[0]));
+	if (prog == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	prog[0].code = BPF_LD+BPF_H+BPF_ABS;
+	prog[0].k = 20;
+
+	pos = 1;
+	for (i = 0; i < nkeys; i += group) {
+		group = nkeys - i;
+		if (group > LADDER_GROUP)
+			group = LADDER_GROUP;
+
+		for (j = 0; j < group; j++, pos++) {
+			prog[pos].code = BPF_JMP+BPF_JEQ+BPF_K;
+			prog[pos].k = LADDER_KEY(i + j);
+			prog[pos].jt = group - j - 1;
+			prog[pos].jf = (j == group - 1) ? 1 : 0;
+		}
+
+		prog[pos].code = BPF_RET+BPF_K;
+		prog[pos].k = UINT32_MAX;
+		pos++;
+	}
+
+	prog[pos].code = BPF_RET+BPF_K;
+	prog[pos].k = 0;
+
+	*insn_count = n;
+	return prog;
+}
+
 static uint8_t test_pkt[128] = {
 	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
 	14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
@@ -72,16 +130,39 @@ static uint8_t test_pkt[128] = {
 
 
 
+static double
+elapsed_ns(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e9 +
+	    (end.tv_nsec - start->tv_nsec);
+}
+
+static void
+print_ns(const char *msg, double ns, size_t counter)
+{
+
+	if (counter > 0)
+		printf("%s: %.2f ns/packet\n", msg, ns / counter);
+}
+
 void
 test_fun(bpfjit_function_t fun, const uint8_t *pkt,
     unsigned int pktsize, size_t counter, size_t dummy, const char*msg)
 {
 	size_t i;
 	unsigned int ret = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	for (i = 0; i < counter; i++)
 		ret += bpfjit_call(fun, pkt, pktsize, pktsize);
 
+	print_ns(msg, elapsed_ns(&start), counter);
+
 	if (counter == dummy)
 		printf("%s returned %u\n", msg, ret);
 }
@@ -106,29 +187,505 @@ test_bpfjit(size_t counter, const uint8_t *pkt,
 	bpfjit_free_code(code);
 }
 
+/*
+ * Like test_fun() but the loop branches on a result of the predicate.
+ */
+static void
+test_predicate(size_t counter, const uint8_t *pkt,
+    unsigned int pktsize, size_t dummy)
+{
+	bpfjit_predicate_t pred;
+	size_t i;
+	unsigned int ret = 0;
+	struct timespec start;
+
+	pred = bpfjit_generate_predicate(NULL, insns,
+	    sizeof(insns) / sizeof(insns[0]));
+	if (pred == NULL)
+		errx(EXIT_FAILURE, "Can't compile bpf predicate");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < counter; i++) {
+		if (bpfjit_match(pred, pkt, pktsize, pktsize))
+			ret++;
+	}
+
+	print_ns("bpfjit predicate", elapsed_ns(&start), counter);
+
+	if (counter == dummy)
+		printf("bpfjit predicate returned %u\n", ret);
+
+	bpfjit_free_predicate(pred);
+}
+
+static void
+test_direct(size_t counter, const uint8_t *pkt,
+    unsigned int pktsize, size_t dummy)
+{
+	bpfjit_direct_t direct;
+	size_t i;
+	unsigned int ret = 0;
+	struct timespec start;
+
+	direct = bpfjit_generate_direct_code(insns,
+	    sizeof(insns) / sizeof(insns[0]));
+	if (direct == NULL)
+		errx(EXIT_FAILURE, "Can't compile bpf program");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < counter; i++)
+		ret += direct(pkt, pktsize, pktsize);
+
+	print_ns("bpfjit direct code", elapsed_ns(&start), counter);
+
+	if (counter == dummy)
+		printf("bpfjit direct code returned %u\n", ret);
+
+	bpfjit_free_direct_code(direct);
+}
+
+/*
+ * Like test_fun() but packets are passed to batch code in
+ * bursts of BATCH_SIZE packets.
+ */
+#define BATCH_SIZE	64
+
+static void
+test_batch(size_t counter, const uint8_t *pkt,
+    unsigned int pktsize, size_t dummy)
+{
+	bpfjit_batch_t batch;
+	bpf_args_t args[BATCH_SIZE];
+	size_t res[BATCH_SIZE];
+	size_t i, n;
+	unsigned int ret = 0;
+	struct timespec start;
+
+	batch = bpfjit_generate_batch_code(NULL, insns,
+	    sizeof(insns) / sizeof(insns[0]));
+	if (batch == NULL)
+		errx(EXIT_FAILURE, "Can't compile bpf program");
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		args[i].pkt = pkt;
+		args[i].wirelen = args[i].buflen = pktsize;
+		args[i].arg = NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < counter; i += n) {
+		n = (counter - i < BATCH_SIZE) ? counter - i : BATCH_SIZE;
+		batch(args, n, res);
+		ret += res[0];
+	}
+
+	print_ns("bpfjit batch code", elapsed_ns(&start), counter);
+
+	if (counter == dummy)
+		printf("bpfjit batch code returned %u\n", ret);
+
+	bpfjit_free_batch_code(batch);
+}
+
+/*
+ * MULTI_PROGS filters "ip src host 128.3.112.j", one per subscriber.
+ * Compare calling them one by one with one call of multi code.
+ */
+#define MULTI_PROGS	64
+
+static void
+test_multi(size_t counter, const uint8_t *pkt,
+    unsigned int pktsize, size_t dummy)
+{
+	struct bpf_insn progs[MULTI_PROGS][6];
+	struct bpf_insn *progp[MULTI_PROGS];
+	size_t insn_counts[MULTI_PROGS];
+	bpfjit_function_t code[MULTI_PROGS];
+	size_t res[MULTI_PROGS];
+	bpfjit_multi_t *bm;
+	bpf_args_t args;
+	size_t i, j;
+	unsigned int ret;
+	struct timespec start;
+
+	for (j = 0; j < MULTI_PROGS; j++) {
+		progs[j][0] = (struct bpf_insn)
+		    BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12);
+		progs[j][1] = (struct bpf_insn)
+		    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 3);
+		progs[j][2] = (struct bpf_insn)
+		    BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26);
+		progs[j][3] = (struct bpf_insn)
+		    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x80037000 + j, 0, 1);
+		progs[j][4] = (struct bpf_insn)
+		    BPF_STMT(BPF_RET+BPF_K, UINT32_MAX);
+		progs[j][5] = (struct bpf_insn)
+		    BPF_STMT(BPF_RET+BPF_K, 0);
+		progp[j] = progs[j];
+		insn_counts[j] = 6;
+
+		code[j] = bpfjit_generate_code(NULL, progs[j], 6);
+		if (code[j] == NULL)
+			errx(EXIT_FAILURE, "Can't compile bpf program");
+	}
+
+	bm = bpfjit_multi_create(NULL, progp, insn_counts, MULTI_PROGS);
+	if (bm == NULL)
+		errx(EXIT_FAILURE, "Can't compile bpf programs");
+
+	args.pkt = pkt;
+	args.wirelen = args.buflen = pktsize;
+	args.arg = NULL;
+
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < counter; i++) {
+		for (j = 0; j < MULTI_PROGS; j++)
+			ret += code[j](NULL, &args) != 0;
+	}
+	print_ns("bpfjit code, 64 filters", elapsed_ns(&start), counter);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < counter; i++)
+		ret += bpfjit_multi_call(bm, &args, res) != 0;
+	print_ns("bpfjit multi code, 64 filters", elapsed_ns(&start), counter);
+
+	if (counter == dummy)
+		printf("bpfjit multi code returned %u\n", ret);
+
+	for (j = 0; j < MULTI_PROGS; j++)
+		bpfjit_free_code(code[j]);
+	bpfjit_multi_destroy(bm);
+}
+
+/*
+ * FSET_PROGS filters "ip src host 128.3.j", one by one and in
+ * a filter set.
+ */
+#define FSET_PROGS	4096
+
+static void
+test_fset(size_t counter, const uint8_t *pkt,
+    unsigned int pktsize, size_t dummy)
+{
+	static struct bpf_insn progs[FSET_PROGS][6];
+	static struct bpf_insn *progp[FSET_PROGS];
+	static bpfjit_function_t code[FSET_PROGS];
+	size_t ids[FSET_PROGS];
+	bpfjit_fset_t *fs;
+	bpf_args_t args;
+	size_t i, j;
+	unsigned int ret;
+	struct timespec start;
+
+	for (j = 0; j < FSET_PROGS; j++) {
+		progs[j][0] = (struct bpf_insn)
+		    BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12);
+		progs[j][1] = (struct bpf_insn)
+		    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 3);
+		progs[j][2] = (struct bpf_insn)
+		    BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26);
+		progs[j][3] = (struct bpf_insn)
+		    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x80030000 + j, 0, 1);
+		progs[j][4] = (struct bpf_insn)
+		    BPF_STMT(BPF_RET+BPF_K, UINT32_MAX);
+		progs[j][5] = (struct bpf_insn)
+		    BPF_STMT(BPF_RET+BPF_K, 0);
+		progp[j] = progs[j];
+
+		code[j] = bpfjit_generate_code(NULL, progs[j], 6);
+		if (code[j] == NULL)
+			errx(EXIT_FAILURE, "Can't compile bpf program");
+	}
+
+	fs = bpfjit_fset_create(progp, 6, FSET_PROGS);
+	if (fs == NULL)
+		errx(EXIT_FAILURE, "Can't create a filter set");
+
+	args.pkt = pkt;
+	args.wirelen = args.buflen = pktsize;
+	args.arg = NULL;
+
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < counter; i++) {
+		for (j = 0; j < FSET_PROGS; j++)
+			ret += code[j](NULL, &args) != 0;
+	}
+	print_ns("bpfjit code, 4096 filters", elapsed_ns(&start), counter);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < counter; i++)
+		ret += bpfjit_fset_call(fs, &args, ids, FSET_PROGS);
+	print_ns("bpfjit filter set, 4096 filters", elapsed_ns(&start),
+	    counter);
+
+	if (counter == dummy)
+		printf("bpfjit filter set returned %u\n", ret);
+
+	for (j = 0; j < FSET_PROGS; j++)
+		bpfjit_free_code(code[j]);
+	bpfjit_fset_destroy(fs);
+}
+
+/*
+ * "ip src in set" with HSET_KEYS random addresses, packets cycle
+ * through HSET_PKTS source addresses and half of them are in the set.
+ */
+#define HSET_KEYS	(1024 * 1024)
+#define HSET_PKTS	4096
+
+static void
+test_hset(size_t counter, const uint8_t *pkt,
+    unsigned int pktsize, size_t dummy)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26),
+		BPF_STMT(BPF_MISC+BPF_COP, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static const bpf_copfunc_t copfuncs[] = { &bpfjit_hset_cop };
+	static bpf_ctx_t ctx = { copfuncs, 1, NULL, NULL };
+	static uint32_t keys[HSET_KEYS];
+	static uint8_t pkts[HSET_PKTS][64];
+	bpfjit_function_t code;
+	bpfjit_hset_t *hs;
+	bpf_args_t args;
+	uint32_t seed, v;
+	size_t i;
+	unsigned int ret;
+	struct timespec start;
+
+	if (pktsize > sizeof(pkts[0]))
+		pktsize = sizeof(pkts[0]);
+
+	seed = 1;
+	for (i = 0; i < HSET_KEYS; i++) {
+		seed = seed * 1103515245 + 12345;
+		keys[i] = seed;
+	}
+
+	for (i = 0; i < HSET_PKTS; i++) {
+		seed = seed * 1103515245 + 12345;
+		v = (i % 2 == 0) ? keys[seed % HSET_KEYS] : seed;
+		memcpy(pkts[i], pkt, pktsize);
+		pkts[i][26] = v >> 24;
+		pkts[i][27] = v >> 16;
+		pkts[i][28] = v >> 8;
+		pkts[i][29] = v;
+	}
+
+	hs = bpfjit_hset_create(keys, HSET_KEYS);
+	if (hs == NULL)
+		errx(EXIT_FAILURE, "Can't create a set");
+	ctx.hset = hs;
+
+	code = bpfjit_generate_code(&ctx, insns,
+	    sizeof(insns) / sizeof(insns[0]));
+	if (code == NULL)
+		errx(EXIT_FAILURE, "Can't compile bpf program");
+
+	args.wirelen = args.buflen = pktsize;
+	args.arg = NULL;
+
+	ret = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < counter; i++) {
+		args.pkt = pkts[i % HSET_PKTS];
+		ret += code(&ctx, &args);
+	}
+	print_ns("bpfjit code, set of 1M addresses", elapsed_ns(&start),
+	    counter);
+
+	if (counter == dummy)
+		printf("bpfjit set lookup returned %u\n", ret);
+
+	bpfjit_free_code(code);
+	bpfjit_hset_destroy(hs);
+}
+
 void
 test_bpf_filter(size_t counter, size_t dummy)
 {
 	size_t i;
 	unsigned int ret = 0;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	for (i = 0; i < counter; i++) {
 		ret += bpf_filter(insns, test_pkt,
 		    sizeof(test_pkt), sizeof(test_pkt));
 	}
 
+	print_ns("bpf_filter", elapsed_ns(&start), counter);
+
 	if (counter == dummy)
 		printf("bpf_filter returned %u\n", ret);
 }
 
+/*
+ * Run ladders of all sizes. A packet matches the last constant,
+ * this is the longest path through a ladder.
+ */
+static void
+test_ladders(size_t counter, size_t dummy)
+{
+	struct bpf_insn *prog;
+	bpfjit_function_t code;
+	size_t i, j, n, insn_count;
+	unsigned int ret;
+	uint8_t pkt[sizeof(test_pkt)];
+	struct timespec start;
+	char msg[64];
+
+	for (i = 0; i < sizeof(ladder_sizes) / sizeof(ladder_sizes[0]); i++) {
+		n = ladder_sizes[i];
+		prog = make_ladder(n, &insn_count);
+
+		if (!bpf_validate(prog, insn_count))
+			errx(EXIT_FAILURE, "Not valid bpf program");
+
+		memcpy(pkt, test_pkt, sizeof(pkt));
+		pkt[20] = LADDER_KEY(n - 1) >> 8;
+		pkt[21] = LADDER_KEY(n - 1) & 0xff;
+
+		ret = 0;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (j = 0; j < counter; j++)
+			ret += bpf_filter(prog, pkt, sizeof(pkt), sizeof(pkt));
+		snprintf(msg, sizeof(msg), "bpf_filter, %zu keys", n);
+		print_ns(msg, elapsed_ns(&start), counter);
+		if (counter == dummy)
+			printf("%s returned %u\n", msg, ret);
+
+		code = bpfjit_generate_code(NULL, prog, insn_count);
+		if (code == NULL)
+			errx(EXIT_FAILURE, "Can't compile bpf program");
+
+		snprintf(msg, sizeof(msg), "bpfjit code, %zu keys", n);
+		test_fun(code, pkt, sizeof(pkt), counter, dummy, msg);
+
+		bpfjit_free_code(code);
+		free(prog);
+	}
+}
+
+/*
+ * Churn workload: counter filters are attached one after another,
+ * nine of ten see at most CHURN_SHORT packets before they're
+ * detached, the rest see up to CHURN_LONG packets. Compare compiling
+ * every filter upfront with tiered handles that compile after
+ * TIER_THRESHOLD calls.
+ */
+#define CHURN_SHORT	8
+#define CHURN_LONG	10000
+#define TIER_THRESHOLD	64
+
+static size_t
+churn_packets(uint32_t *seed)
+{
+
+	*seed = *seed * 1103515245 + 12345;
+	if ((*seed >> 16) % 10 != 0)
+		return 1 + (*seed >> 8) % CHURN_SHORT;
+	else
+		return 1 + (*seed >> 8) % CHURN_LONG;
+}
+
+static void
+churn_hook(bpfjit_tiered_t *bt, void *arg)
+{
+
+	if (bpfjit_tiered_compile(bt) != NULL)
+		(*(size_t *)arg)++;
+}
+
+static void
+test_churn(size_t counter, size_t dummy)
+{
+	bpfjit_tiered_t *bt;
+	bpfjit_function_t code;
+	bpf_args_t args;
+	size_t i, j, n, compiled;
+	unsigned int ret;
+	uint32_t seed;
+	struct timespec start;
+	double eager_ns, tiered_ns;
+	const size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	args.pkt = test_pkt;
+	args.wirelen = args.buflen = sizeof(test_pkt);
+	args.arg = NULL;
+
+	ret = 0;
+	compiled = 0;
+	seed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < counter; i++) {
+		code = bpfjit_generate_code(NULL, insns, insn_count);
+		if (code == NULL)
+			errx(EXIT_FAILURE, "Can't compile bpf program");
+		compiled++;
+
+		n = churn_packets(&seed);
+		for (j = 0; j < n; j++)
+			ret += code(NULL, &args);
+
+		bpfjit_free_code(code);
+	}
+	eager_ns = elapsed_ns(&start);
+	printf("bpfjit code: %zu compilations, %.0f ns\n",
+	    compiled, eager_ns);
+
+	compiled = 0;
+	seed = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < counter; i++) {
+		bt = bpfjit_tiered_create(NULL, insns, insn_count,
+		    TIER_THRESHOLD, &churn_hook, &compiled);
+		if (bt == NULL)
+			errx(EXIT_FAILURE, "Can't create tiered handle");
+
+		n = churn_packets(&seed);
+		for (j = 0; j < n; j++)
+			ret += bpfjit_tiered_call(bt, &args);
+
+		bpfjit_tiered_destroy(bt);
+	}
+	tiered_ns = elapsed_ns(&start);
+	printf("tiered code: %zu compilations, %.0f ns\n",
+	    compiled, tiered_ns);
+
+	if (counter > 0) {
+		printf("saved: %.0f ns, %.2f ns/filter\n",
+		    eager_ns - tiered_ns, (eager_ns - tiered_ns) / counter);
+	}
+
+	if (counter == dummy)
+		printf("churn returned %u\n", ret);
+}
+
 void usage(const char *prog)
 {
 
 	fprintf(stderr,
-	    "USAGE: time %s -b|-j|-c NNN\n"
+	    "USAGE: time %s -b|-j|-p|-d|-a|-m|-s|-k|-c|-l|-t NNN\n"
 	    " -b  - run bpf_filter\n"
 	    " -c  - run C code\n"
 	    " -j  - run bpfjit code\n"
+	    " -p  - run bpfjit predicate\n"
+	    " -d  - run bpfjit direct code\n"
+	    " -a  - run bpfjit batch code\n"
+	    " -m  - run 64 filters one by one and in multi code\n"
+	    " -s  - run 4096 filters one by one and in a filter set\n"
+	    " -k  - run a lookup in a set of 1M addresses\n"
+	    " -l  - run bpf_filter and bpfjit code for BPF_JEQ ladders\n"
+	    " -t  - attach NNN short-lived filters with and without tiering\n"
 	    " NNN - number of iterations\n", prog);
 }
 
@@ -158,11 +715,36 @@ int main(int argc, char* argv[])
 	case 'j':
 		test_bpfjit(counter, test_pkt, sizeof(test_pkt), dummy);
 		break;
+	case 'p':
+		test_predicate(counter, test_pkt, sizeof(test_pkt), dummy);
+		break;
+	case 'd':
+		test_direct(counter, test_pkt, sizeof(test_pkt), dummy);
+		break;
+	case 'a':
+		test_batch(counter, test_pkt, sizeof(test_pkt), dummy);
+		break;
+	case 'm':
+		test_multi(counter, test_pkt, sizeof(test_pkt), dummy);
+		break;
+	case 's':
+		test_fset(counter, test_pkt, sizeof(test_pkt), dummy);
+		break;
+	case 'k':
+		test_hset(counter, test_pkt, sizeof(test_pkt), dummy);
+		break;
 	case 'b':
 		test_bpf_filter(counter, dummy);
 		break;
 	case 'c':
 		test_c(counter, test_pkt, sizeof(test_pkt), dummy);
+		break;
+	case 'l':
+		test_ladders(counter, dummy);
+		break;
+	case 't':
+		test_churn(counter, dummy);
+		break;
 	}
 
 	return EXIT_SUCCESS;
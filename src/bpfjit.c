@@ -38,11 +38,15 @@
 #define BJ_ALLOC(sz) malloc(sz)
 #define BJ_FREE(p, sz) free(p)
 #define BJ_ASSERT(c) assert(c)
+#define BJ_CAS_UINT(p, o, n) __sync_val_compare_and_swap(p, o, n)
+#define BJ_MEMBAR_PRODUCER() __sync_synchronize()
 #else
 #include <sys/kmem.h>
 #define BJ_ALLOC(sz) kmem_alloc(sz, KM_SLEEP)
 #define BJ_FREE(p, sz) kmem_free(p, sz)
 #define BJ_ASSERT(c) KASSERT(c)
+#define BJ_CAS_UINT(p, o, n) atomic_cas_uint(p, o, n)
+#define BJ_MEMBAR_PRODUCER() membar_producer()
 #endif
 
 #ifndef _KERNEL
@@ -66,6 +70,26 @@
 #define BJ_CTX_ARG	SLJIT_SAVED_REG1
 #define BJ_ARGS		SLJIT_SAVED_REG2
 
+/*
+ * Arguments of generated bpfjit_direct_t. The first and
+ * the last arguments land in BJ_BUF and BJ_BUFLEN.
+ */
+#define BJ_WIRELEN	SLJIT_SAVED_REG2
+
+/*
+ * Arguments of generated bpfjit_batch_t. The first argument
+ * is moved to BJ_ARGS, the others are saved on the stack.
+ */
+#define BJ_BATCH_ARGS	SLJIT_SAVED_REG1
+#define BJ_BATCH_N	SLJIT_SAVED_REG2
+#define BJ_BATCH_RES	SLJIT_SAVED_REG3
+
+/*
+ * The last argument of generated multi code, it's saved on the stack
+ * before BJ_BUFLEN is loaded.
+ */
+#define BJ_MULTI_OUT	SLJIT_SAVED_REG3
+
 /*
  * Permanent register assignments.
  */
@@ -78,6 +102,33 @@
 #define BJ_XREG		SLJIT_TEMPORARY_EREG1
 #define BJ_TMP3REG	SLJIT_TEMPORARY_EREG2
 
+/*
+ * Copy of a packet word that is loaded more than once,
+ * see optimize_loads(). The kernel needs BJ_TMP3REG for
+ * m_xword/m_xhalf/m_xbyte calls.
+ */
+#ifndef _KERNEL
+#define BJ_LDCACHE	SLJIT_TEMPORARY_EREG2
+#endif
+
+/*
+ * Packet pointer advanced by X, see optimize_msh(). It's BJ_LDCACHE
+ * register, it can be used if neither optimize_loads() nor
+ * optimize_memwords() need BJ_LDCACHE. EREG registers of x86-32
+ * can't address memory.
+ */
+#if defined(BJ_LDCACHE) && \
+    !(defined(SLJIT_CONFIG_X86_32) && SLJIT_CONFIG_X86_32)
+#define BJ_XBUF		BJ_LDCACHE
+#endif
+
+/*
+ * Registers for M[k] words, see optimize_memwords().
+ * BJ_LDCACHE is in the list too, it's used only if
+ * optimize_loads() doesn't need it.
+ */
+#define BJ_MEMREG_MAX	3
+
 /*
  * EREG registers can't be used for indirect calls, reuse BJ_BUF and
  * BJ_BUFLEN registers. They can be easily restored from BJ_ARGS.
@@ -85,6 +136,35 @@
 #define BJ_COPF_PTR	SLJIT_SAVED_REG1
 #define BJ_COPF_IDX	SLJIT_SAVED_REG3
 
+/*
+ * Raw x86 instructions may only be emitted on x86.
+ * Older sljit doesn't define SLJIT_CONFIG_X86.
+ */
+#if (defined(SLJIT_CONFIG_X86) && SLJIT_CONFIG_X86) || \
+    (defined(SLJIT_CONFIG_X86_32) && SLJIT_CONFIG_X86_32) || \
+    (defined(SLJIT_CONFIG_X86_64) && SLJIT_CONFIG_X86_64)
+#define BJ_CONFIG_X86 1
+#else
+#define BJ_CONFIG_X86 0
+#endif
+
+/*
+ * Multibyte packet words can be read with one load on targets that
+ * support unaligned memory access. Big-endian targets need nothing
+ * else, x86 converts a loaded word to host order with bswap (or rol
+ * for halfwords). Other targets read a word byte by byte.
+ * emit_swap32() and emit_swap16() fall back to shifts if this list
+ * is ever extended to other little-endian targets.
+ * Define BPFJIT_NO_UNALIGNED_LOADS to always read byte by byte.
+ */
+#if !defined(BPFJIT_NO_UNALIGNED_LOADS) && \
+    defined(SLJIT_UNALIGNED) && SLJIT_UNALIGNED && \
+    ((defined(SLJIT_BIG_ENDIAN) && SLJIT_BIG_ENDIAN) || BJ_CONFIG_X86)
+#define BJ_UNALIGNED_LOADS 1
+#else
+#define BJ_UNALIGNED_LOADS 0
+#endif
+
 typedef unsigned int bpfjit_init_mask_t;
 #define BJ_INIT_NOBITS  0u
 #define BJ_INIT_MBIT(k) (1u << (k))
@@ -92,6 +172,12 @@ typedef unsigned int bpfjit_init_mask_t;
 #define BJ_INIT_ABIT    BJ_INIT_MBIT(BPF_MEMWORDS)
 #define BJ_INIT_XBIT    BJ_INIT_MBIT(BPF_MEMWORDS + 1)
 
+/*
+ * Internal BPF_MISC instruction of multi code, see bpfjit_multi_create().
+ * It stores a result of program jt, k if jf is 0 or A otherwise.
+ */
+#define BJ_MISC_RESULT	0x60
+
 struct bpfjit_stack
 {
 	bpf_state_t state; // must be at offset 0
@@ -99,6 +185,12 @@ struct bpfjit_stack
 #ifdef _KERNEL
 	void *tmp;
 #endif
+	/* see emit_batch_return() */
+	const bpf_args_t *end;
+	size_t *res;
+	size_t accepted;
+	/* see emit_multi_result() */
+	size_t mask;
 };
 
 /*
@@ -107,7 +199,6 @@ struct bpfjit_stack
 struct bpfjit_jump {
 	struct sljit_jump *bj_jump;
 	SLIST_ENTRY(bpfjit_jump) bj_entries;
-	uint32_t bj_safe_length;
 };
 
 /*
@@ -120,6 +211,53 @@ struct bpfjit_jump_data {
 	 * bj_jtf[1] - when coming from jf path.
 	 */
 	struct bpfjit_jump bj_jtf[2];
+
+	/* Jump offsets, they may be changed by thread_jumps(). */
+	uint32_t bj_jt;
+	uint32_t bj_jf;
+
+	/* Number of cases if the insn starts a switch, see optimize_switch(). */
+	uint32_t bj_ncases;
+
+	/* The insn is a case of a switch compiled at its head. */
+	bool bj_case;
+};
+
+/*
+ * Minimum and maximum number of cases in a switch.
+ */
+#define BJ_MINCASES 8
+#define BJ_MAXCASES 1024
+
+/*
+ * Switches with up to BJ_LINEARCASES cases are compiled
+ * to a linear sequence of comparisons.
+ */
+#define BJ_LINEARCASES 4
+
+/*
+ * Case of a switch.
+ */
+struct bpfjit_case {
+	uint32_t bj_key;
+	size_t bj_insn;
+};
+
+/*
+ * Maximum number of values in bj_ne.
+ */
+#define BJ_MAXNE 8
+
+/*
+ * Facts about A known on a jump edge, see thread_jumps().
+ */
+struct bpfjit_facts {
+	uint32_t bj_lo;            /* bj_lo <= A */
+	uint32_t bj_hi;            /* A <= bj_hi */
+	uint32_t bj_ones;          /* bits of A known to be set */
+	uint32_t bj_zeros;         /* bits of A known to be clear */
+	uint32_t bj_ne[BJ_MAXNE];  /* A isn't equal to these values */
+	size_t bj_nne;
 };
 
 /*
@@ -133,6 +271,88 @@ struct bpfjit_read_pkt_data {
 	 * we'd need a special bool variable to emit unconditional "return 0").
 	 */
 	uint32_t bj_check_length;
+
+	/*
+	 * If positive, emit "if (buflen - bj_check_index < X) return 0"
+	 * for BPF_LD+BPF_IND instruction. It's never greater than a length
+	 * checked on all paths to the instruction.
+	 */
+	uint32_t bj_check_index;
+
+	/*
+	 * BJ_VN_* flags of BPF_LD+BPF_ABS instruction,
+	 * see optimize_loads().
+	 */
+	unsigned int bj_vn;
+
+	/*
+	 * BPF_LDX+BPF_MSH sets BJ_XBUF to buf+X, BPF_LD+BPF_IND
+	 * reads at BJ_XBUF+k, see optimize_msh().
+	 */
+	bool bj_xbuf;
+};
+
+#define BJ_VN_SKIP       0x1u /* A already holds P[k:w] */
+#define BJ_VN_FROM_CACHE 0x2u /* A <- BJ_LDCACHE */
+#define BJ_VN_TO_CACHE   0x4u /* BJ_LDCACHE <- A after the load */
+
+/*
+ * Maximum number of packet words tracked by optimize_loads().
+ */
+#define BJ_VN_MAXWORDS 32
+
+/*
+ * Packet words held by A and loaded on all paths at the start
+ * of an instruction, see optimize_loads().
+ */
+struct bpfjit_vn {
+	size_t bj_a;        /* index of a matching load or SIZE_MAX */
+	uint32_t bj_avail;  /* bitmask of words loaded on all paths */
+	bool bj_seen;       /* reachable from the entry */
+};
+
+/*
+ * Lengths anticipated and checked at the start of an instruction,
+ * see optimize_checks(). Index lengths are lengths of BPF_LD+BPF_IND
+ * loads that use the same value of X.
+ */
+struct bpfjit_checks {
+	uint32_t bj_ant;       /* anticipated length */
+	uint32_t bj_ant_index; /* anticipated index length */
+	uint32_t bj_len;       /* length checked on all paths */
+	uint32_t bj_index;     /* index length checked on all paths */
+};
+
+/*
+ * Data for BPF_COP and BPF_COPX instructions.
+ */
+struct bpfjit_cop_data {
+	/* M[k] words to copy from registers to bpf_state before a call. */
+	bpfjit_init_mask_t bj_spill;
+
+	/* M[k] words to copy from bpf_state to registers after a call. */
+	bpfjit_init_mask_t bj_reload;
+
+	/* BPF_COP is emitted inline, see optimize_cops(). */
+	bool bj_inline;
+};
+
+/*
+ * Data for BPF_RET instruction, see optimize_returns().
+ */
+struct bpfjit_ret_data {
+	/*
+	 * Index of the first instruction that returns the same value
+	 * or SIZE_MAX if the value is 0 and the instruction jumps to
+	 * the return at the end of a generated function.
+	 */
+	size_t bj_shared;
+
+	/* The previous instruction can fall through to this one. */
+	bool bj_fallthru;
+
+	/* Return code of the first instruction. */
+	struct sljit_label *bj_label;
 };
 
 /*
@@ -145,10 +365,41 @@ struct bpfjit_insn_data {
 	union {
 		struct bpfjit_jump_data     bj_jdata;
 		struct bpfjit_read_pkt_data bj_rdata;
+		struct bpfjit_cop_data      bj_cdata;
+		struct bpfjit_ret_data      bj_retdata;
 	} bj_aux;
 
 	bpfjit_init_mask_t bj_invalid;
 	bool bj_unreachable;
+
+	/* Instruction is removed, see optimize_dead(). */
+	bool bj_dead;
+
+	/* Instruction is emitted by the next one, see fuse_insn(). */
+	bool bj_fuse;
+
+	/* BJ_FOLD_* action and a value, see optimize_consts(). */
+	unsigned int bj_fold;
+	uint32_t bj_const;
+};
+
+#define BJ_FOLD_NONE 0u
+#define BJ_FOLD_A    1u /* A <- bj_const or return bj_const */
+#define BJ_FOLD_X    2u /* X <- bj_const */
+#define BJ_FOLD_K    3u /* BPF_X operand is equal to bj_const */
+#define BJ_FOLD_JT   4u /* jump is always taken */
+#define BJ_FOLD_JF   5u /* jump is never taken */
+
+/*
+ * Values of A, X and M[] known at the start of an instruction,
+ * see optimize_consts().
+ */
+struct bpfjit_consts {
+	bpfjit_init_mask_t bj_known; /* BJ_INIT_* bits of known values */
+	uint32_t bj_a;
+	uint32_t bj_x;
+	uint32_t bj_mem[BPF_MEMWORDS];
+	bool bj_seen;                /* reachable from the entry */
 };
 
 #ifdef _KERNEL
@@ -259,30 +510,248 @@ append_jump(struct sljit_jump *jump, struct sljit_jump ***jumps,
 
 /*
  * Generate code for BPF_LD+BPF_B+BPF_ABS    A <- P[k:1].
+ * The src operand is SLJIT_MEM1(BJ_BUF), k or, for BPF_IND loads,
+ * an indexed operand, see emit_pkt_read().
  */
 static int
-emit_read8(struct sljit_compiler* compiler, uint32_t k)
+emit_read8(struct sljit_compiler* compiler, int src, sljit_sw srcw)
 {
 
 	return sljit_emit_op1(compiler,
 	    SLJIT_MOV_UB,
 	    BJ_AREG, 0,
-	    SLJIT_MEM1(BJ_BUF), k);
+	    src, srcw);
+}
+
+#if BJ_UNALIGNED_LOADS
+/*
+ * Convert a 32bit word loaded from a packet to host byte order.
+ */
+static int
+emit_swap32(struct sljit_compiler* compiler, int reg)
+{
+#if defined(SLJIT_BIG_ENDIAN) && SLJIT_BIG_ENDIAN
+
+	return SLJIT_SUCCESS;
+#elif BJ_CONFIG_X86
+	sljit_ub insn[3];
+	int n = 0;
+	const int idx = sljit_get_register_index(reg);
+
+	BJ_ASSERT(idx >= 0 && idx < 16);
+
+	/* bswap reg32 */
+	if (idx >= 8)
+		insn[n++] = 0x41; /* REX.B */
+	insn[n++] = 0x0f;
+	insn[n++] = 0xc8 + (idx & 7);
+
+	return sljit_emit_op_custom(compiler, insn, n);
+#else
+	int status;
+
+	/* tmp1 = reg >> 24; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_LSHR,
+	    BJ_TMP1REG, 0,
+	    reg, 0,
+	    SLJIT_IMM, 24);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* tmp2 = reg >> 8; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_LSHR,
+	    BJ_TMP2REG, 0,
+	    reg, 0,
+	    SLJIT_IMM, 8);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* tmp2 = tmp2 & 0xff00; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_AND,
+	    BJ_TMP2REG, 0,
+	    BJ_TMP2REG, 0,
+	    SLJIT_IMM, 0xff00);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* tmp1 = tmp1 | tmp2; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_OR,
+	    BJ_TMP1REG, 0,
+	    BJ_TMP1REG, 0,
+	    BJ_TMP2REG, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* tmp2 = reg & 0xff00; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_AND,
+	    BJ_TMP2REG, 0,
+	    reg, 0,
+	    SLJIT_IMM, 0xff00);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* tmp2 = tmp2 << 8; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_SHL,
+	    BJ_TMP2REG, 0,
+	    BJ_TMP2REG, 0,
+	    SLJIT_IMM, 8);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* tmp1 = tmp1 | tmp2; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_OR,
+	    BJ_TMP1REG, 0,
+	    BJ_TMP1REG, 0,
+	    BJ_TMP2REG, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* reg = reg & 0xff; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_AND,
+	    reg, 0,
+	    reg, 0,
+	    SLJIT_IMM, 0xff);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* reg = reg << 24; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_SHL,
+	    reg, 0,
+	    reg, 0,
+	    SLJIT_IMM, 24);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* reg = reg | tmp1; */
+	return sljit_emit_op2(compiler,
+	    SLJIT_OR,
+	    reg, 0,
+	    reg, 0,
+	    BJ_TMP1REG, 0);
+#endif
+}
+
+/*
+ * Convert a 16bit word loaded from a packet to host byte order.
+ * Upper bits of reg must be zero.
+ */
+static int
+emit_swap16(struct sljit_compiler* compiler, int reg)
+{
+#if defined(SLJIT_BIG_ENDIAN) && SLJIT_BIG_ENDIAN
+
+	return SLJIT_SUCCESS;
+#elif BJ_CONFIG_X86
+	sljit_ub insn[5];
+	int n = 0;
+	const int idx = sljit_get_register_index(reg);
+
+	BJ_ASSERT(idx >= 0 && idx < 16);
+
+	/* rol reg16, 8 */
+	insn[n++] = 0x66;
+	if (idx >= 8)
+		insn[n++] = 0x41; /* REX.B */
+	insn[n++] = 0xc1;
+	insn[n++] = 0xc0 + (idx & 7);
+	insn[n++] = 8;
+
+	return sljit_emit_op_custom(compiler, insn, n);
+#else
+	int status;
+
+	/* tmp1 = reg >> 8; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_LSHR,
+	    BJ_TMP1REG, 0,
+	    reg, 0,
+	    SLJIT_IMM, 8);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* reg = reg & 0xff; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_AND,
+	    reg, 0,
+	    reg, 0,
+	    SLJIT_IMM, 0xff);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* reg = reg << 8; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_SHL,
+	    reg, 0,
+	    reg, 0,
+	    SLJIT_IMM, 8);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* reg = reg | tmp1; */
+	return sljit_emit_op2(compiler,
+	    SLJIT_OR,
+	    reg, 0,
+	    reg, 0,
+	    BJ_TMP1REG, 0);
+#endif
+}
+
+/*
+ * Convert k to the byte order of a packet word of the given
+ * width loaded with one load.
+ */
+static uint32_t
+pkt_order(uint32_t k, uint32_t width)
+{
+#if defined(SLJIT_BIG_ENDIAN) && SLJIT_BIG_ENDIAN
+
+	return k;
+#else
+
+	if (width == 2)
+		return ((k & 0xff) << 8) | ((k >> 8) & 0xff);
+
+	return ((k & 0xff) << 24) | ((k & 0xff00) << 8) |
+	    ((k >> 8) & 0xff00) | (k >> 24);
+#endif
 }
+#endif
 
 /*
  * Generate code for BPF_LD+BPF_H+BPF_ABS    A <- P[k:2].
+ * See emit_read8() for src.
  */
 static int
-emit_read16(struct sljit_compiler* compiler, uint32_t k)
+emit_read16(struct sljit_compiler* compiler, int src, sljit_sw srcw)
 {
 	int status;
 
+#if BJ_UNALIGNED_LOADS
+	/* A = *(uint16_t *)&buf[k]; */
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_UH,
+	    BJ_AREG, 0,
+	    src, srcw);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* A = ntohs(A); */
+	return emit_swap16(compiler, BJ_AREG);
+#else
 	/* tmp1 = buf[k]; */
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV_UB,
 	    BJ_TMP1REG, 0,
-	    SLJIT_MEM1(BJ_BUF), k);
+	    src, srcw);
 	if (status != SLJIT_SUCCESS)
 		return status;
 
@@ -290,7 +759,7 @@ emit_read16(struct sljit_compiler* compiler, uint32_t k)
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV_UB,
 	    BJ_AREG, 0,
-	    SLJIT_MEM1(BJ_BUF), k+1);
+	    src, srcw + 1);
 	if (status != SLJIT_SUCCESS)
 		return status;
 
@@ -310,21 +779,35 @@ emit_read16(struct sljit_compiler* compiler, uint32_t k)
 	    BJ_AREG, 0,
 	    BJ_TMP1REG, 0);
 	return status;
+#endif
 }
 
 /*
  * Generate code for BPF_LD+BPF_W+BPF_ABS    A <- P[k:4].
+ * See emit_read8() for src.
  */
 static int
-emit_read32(struct sljit_compiler* compiler, uint32_t k)
+emit_read32(struct sljit_compiler* compiler, int src, sljit_sw srcw)
 {
 	int status;
 
+#if BJ_UNALIGNED_LOADS
+	/* A = *(uint32_t *)&buf[k]; */
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_UI,
+	    BJ_AREG, 0,
+	    src, srcw);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* A = ntohl(A); */
+	return emit_swap32(compiler, BJ_AREG);
+#else
 	/* tmp1 = buf[k]; */
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV_UB,
 	    BJ_TMP1REG, 0,
-	    SLJIT_MEM1(BJ_BUF), k);
+	    src, srcw);
 	if (status != SLJIT_SUCCESS)
 		return status;
 
@@ -332,7 +815,7 @@ emit_read32(struct sljit_compiler* compiler, uint32_t k)
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV_UB,
 	    BJ_TMP2REG, 0,
-	    SLJIT_MEM1(BJ_BUF), k+1);
+	    src, srcw + 1);
 	if (status != SLJIT_SUCCESS)
 		return status;
 
@@ -340,7 +823,7 @@ emit_read32(struct sljit_compiler* compiler, uint32_t k)
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV_UB,
 	    BJ_AREG, 0,
-	    SLJIT_MEM1(BJ_BUF), k+3);
+	    src, srcw + 3);
 	if (status != SLJIT_SUCCESS)
 		return status;
 
@@ -366,7 +849,7 @@ emit_read32(struct sljit_compiler* compiler, uint32_t k)
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV_UB,
 	    BJ_TMP1REG, 0,
-	    SLJIT_MEM1(BJ_BUF), k+2);
+	    src, srcw + 2);
 	if (status != SLJIT_SUCCESS)
 		return status;
 
@@ -404,6 +887,7 @@ emit_read32(struct sljit_compiler* compiler, uint32_t k)
 	    BJ_AREG, 0,
 	    BJ_TMP1REG, 0);
 	return status;
+#endif
 }
 
 #ifdef _KERNEL
@@ -665,28 +1149,229 @@ emit_cop(struct sljit_compiler* compiler, bpf_ctx_t *bc, struct bpf_insn *pc,
 }
 
 /*
- * Generate code for
- * BPF_LD+BPF_W+BPF_ABS    A <- P[k:4]
- * BPF_LD+BPF_H+BPF_ABS    A <- P[k:2]
- * BPF_LD+BPF_B+BPF_ABS    A <- P[k:1]
- * BPF_LD+BPF_W+BPF_IND    A <- P[X+k:4]
- * BPF_LD+BPF_H+BPF_IND    A <- P[X+k:2]
- * BPF_LD+BPF_B+BPF_IND    A <- P[X+k:1]
+ * Set of bpfjit_hset_cop(). Non-zero words are in hs_keys, the probe
+ * for k starts at (k * BJ_HSET_MUL) >> hs_shift and moves forward
+ * to the first match or to an empty slot. Slots past the hash range
+ * take keys that would otherwise wrap around and the last slot is
+ * always empty, so a probe is a loop without bounds checks.
+ */
+#define BJ_HSET_MUL	0x9e3779b1u
+
+struct bpfjit_hset {
+	uint32_t *hs_keys; /* 0 marks an empty slot */
+	size_t hs_nslots;
+	uint32_t hs_shift;
+	uint32_t hs_zero; /* 1 if 0 is in the set */
+};
+
+/*
+ * Emit the probe of bpfjit_hset_cop() with the register contract
+ * of an inline copfunc. It reads hset of the ctx argument once,
+ * generate_code() saves ctx on the stack.
  */
 static int
-emit_pkt_read(struct sljit_compiler* compiler,
-    struct bpf_insn *pc, struct sljit_jump *to_mchain_jump,
-    struct sljit_jump ***ret0, size_t *ret0_size, size_t *ret0_maxsize)
+emit_hset_cop(struct sljit_compiler* compiler,
+    const struct bpfjit_cop_regs *regs)
 {
-	int status;
-	uint32_t width;
-	struct sljit_jump *jump;
-#ifdef _KERNEL
+	struct sljit_jump *jump, *nullset, *zero, *found, *empty, *done[2];
 	struct sljit_label *label;
-	struct sljit_jump *over_mchain_jump;
-	const bool check_zero_buflen = (to_mchain_jump != NULL);
-#endif
-	const uint32_t k = pc->k;
+	int status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    regs->tmp[0], 0,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, ctx));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    regs->tmp[0], 0,
+	    SLJIT_MEM1(regs->tmp[0]),
+	    offsetof(struct bpf_ctx, hset));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	nullset = sljit_emit_cmp(compiler,
+	    SLJIT_C_EQUAL,
+	    regs->tmp[0], 0,
+	    SLJIT_IMM, 0);
+	if (nullset == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	zero = sljit_emit_cmp(compiler,
+	    SLJIT_C_EQUAL|SLJIT_INT_OP,
+	    regs->a, 0,
+	    SLJIT_IMM, 0);
+	if (zero == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	status = sljit_emit_op2(compiler,
+	    SLJIT_MUL|SLJIT_INT_OP,
+	    regs->tmp[1], 0,
+	    regs->a, 0,
+	    SLJIT_IMM, (uint32_t)BJ_HSET_MUL);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op2(compiler,
+	    SLJIT_LSHR|SLJIT_INT_OP,
+	    regs->tmp[1], 0,
+	    regs->tmp[1], 0,
+	    SLJIT_MEM1(regs->tmp[0]),
+	    offsetof(struct bpfjit_hset, hs_shift));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    regs->tmp[0], 0,
+	    SLJIT_MEM1(regs->tmp[0]),
+	    offsetof(struct bpfjit_hset, hs_keys));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	found = sljit_emit_cmp(compiler,
+	    SLJIT_C_EQUAL|SLJIT_INT_OP,
+	    regs->a, 0,
+	    SLJIT_MEM2(regs->tmp[0], regs->tmp[1]), 2);
+	if (found == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	empty = sljit_emit_cmp(compiler,
+	    SLJIT_C_EQUAL|SLJIT_INT_OP,
+	    SLJIT_MEM2(regs->tmp[0], regs->tmp[1]), 2,
+	    SLJIT_IMM, 0);
+	if (empty == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	status = sljit_emit_op2(compiler,
+	    SLJIT_ADD,
+	    regs->tmp[1], 0,
+	    regs->tmp[1], 0,
+	    SLJIT_IMM, 1);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(jump, label);
+
+	/* A = 1 if found. */
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(found, label);
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    regs->a, 0,
+	    SLJIT_IMM, 1);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	done[0] = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (done[0] == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	/* A = hs_zero if A is 0. */
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(zero, label);
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_UI,
+	    regs->a, 0,
+	    SLJIT_MEM1(regs->tmp[0]),
+	    offsetof(struct bpfjit_hset, hs_zero));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	done[1] = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (done[1] == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	/* A = 0 if not found or if there is no set. */
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(empty, label);
+	sljit_set_label(nullset, label);
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    regs->a, 0,
+	    SLJIT_IMM, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(done[0], label);
+	sljit_set_label(done[1], label);
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Emit an inline copfunc in place of BPF_COP call, see optimize_cops().
+ */
+static int
+emit_inline_cop(struct sljit_compiler* compiler, bpf_ctx_t *bc,
+    struct bpf_insn *pc)
+{
+	struct bpfjit_cop_regs regs;
+
+	regs.a = BJ_AREG;
+	regs.args = BJ_ARGS;
+	regs.tmp[0] = BJ_TMP1REG;
+	regs.tmp[1] = BJ_TMP2REG;
+
+	if (bc->copfuncs[pc->k] == bpfjit_hset_cop)
+		return emit_hset_cop(compiler, &regs);
+
+	return bc->copemits[pc->k](compiler, &regs);
+}
+
+/*
+ * Generate code for
+ * BPF_LD+BPF_W+BPF_ABS    A <- P[k:4]
+ * BPF_LD+BPF_H+BPF_ABS    A <- P[k:2]
+ * BPF_LD+BPF_B+BPF_ABS    A <- P[k:1]
+ * BPF_LD+BPF_W+BPF_IND    A <- P[X+k:4]
+ * BPF_LD+BPF_H+BPF_IND    A <- P[X+k:2]
+ * BPF_LD+BPF_B+BPF_IND    A <- P[X+k:1]
+ *
+ * If check_index is positive, BPF_IND load checks X against
+ * buflen - check_index, see optimize_checks(). If xbuf is set,
+ * BPF_IND load reads at BJ_XBUF+k, see optimize_msh().
+ */
+static int
+emit_pkt_read(struct sljit_compiler* compiler,
+    struct bpf_insn *pc, uint32_t check_index, bool xbuf,
+    struct sljit_jump *to_mchain_jump,
+    struct sljit_jump ***ret0, size_t *ret0_size, size_t *ret0_maxsize)
+{
+	int status;
+	int src;
+	sljit_sw srcw;
+	uint32_t width;
+	bool indexed;
+	struct sljit_jump *jump;
+#ifdef _KERNEL
+	struct sljit_label *label;
+	struct sljit_jump *over_mchain_jump;
+	const bool check_zero_buflen = (to_mchain_jump != NULL);
+#endif
+	const uint32_t k = pc->k;
 
 #ifdef _KERNEL
 	if (to_mchain_jump == NULL) {
@@ -700,23 +1385,26 @@ emit_pkt_read(struct sljit_compiler* compiler,
 #endif
 
 	width = read_width(pc);
+	src = SLJIT_MEM1(BJ_BUF);
+	srcw = k;
+	indexed = BPF_MODE(pc->code) == BPF_IND;
+
+#ifdef BJ_XBUF
+	if (indexed && xbuf) {
+		src = SLJIT_MEM1(BJ_XBUF);
+		indexed = false;
+	}
+#else
+	BJ_ASSERT(!xbuf);
+#endif
 
-	if (BPF_MODE(pc->code) == BPF_IND) {
-		/* tmp1 = buflen - (pc->k + width); */
+	if (BPF_MODE(pc->code) == BPF_IND && check_index > 0) {
+		/* tmp1 = buflen - check_index; */
 		status = sljit_emit_op2(compiler,
 		    SLJIT_SUB,
 		    BJ_TMP1REG, 0,
 		    BJ_BUFLEN, 0,
-		    SLJIT_IMM, k + width);
-		if (status != SLJIT_SUCCESS)
-			return status;
-
-		/* buf += X; */
-		status = sljit_emit_op2(compiler,
-		    SLJIT_ADD,
-		    BJ_BUF, 0,
-		    BJ_BUF, 0,
-		    BJ_XREG, 0);
+		    SLJIT_IMM, check_index);
 		if (status != SLJIT_SUCCESS)
 			return status;
 
@@ -731,22 +1419,56 @@ emit_pkt_read(struct sljit_compiler* compiler,
 			return SLJIT_ERR_ALLOC_FAILED;
 	}
 
+	if (indexed) {
+#if BJ_UNALIGNED_LOADS
+		/*
+		 * tmp1 = X + k;
+		 * BJ_XREG may not be a real register, use tmp1 as an index.
+		 */
+		status = sljit_emit_op2(compiler,
+		    SLJIT_ADD,
+		    BJ_TMP1REG, 0,
+		    BJ_XREG, 0,
+		    SLJIT_IMM, k);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		src = SLJIT_MEM2(BJ_BUF, BJ_TMP1REG);
+		srcw = 0;
+#else
+		/*
+		 * Byte loads need buf[k+1], buf[k+2] and buf[k+3],
+		 * indexed operands don't have an offset.
+		 */
+
+		/* buf += X; */
+		status = sljit_emit_op2(compiler,
+		    SLJIT_ADD,
+		    BJ_BUF, 0,
+		    BJ_BUF, 0,
+		    BJ_XREG, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+#endif
+	}
+
 	switch (width) {
 	case 4:
-		status = emit_read32(compiler, k);
+		status = emit_read32(compiler, src, srcw);
 		break;
 	case 2:
-		status = emit_read16(compiler, k);
+		status = emit_read16(compiler, src, srcw);
 		break;
 	case 1:
-		status = emit_read8(compiler, k);
+		status = emit_read8(compiler, src, srcw);
 		break;
 	}
 
 	if (status != SLJIT_SUCCESS)
 		return status;
 
-	if (BPF_MODE(pc->code) == BPF_IND) {
+#if !BJ_UNALIGNED_LOADS
+	if (indexed) {
 		/* buf -= X; */
 		status = sljit_emit_op2(compiler,
 		    SLJIT_SUB,
@@ -756,6 +1478,7 @@ emit_pkt_read(struct sljit_compiler* compiler,
 		if (status != SLJIT_SUCCESS)
 			return status;
 	}
+#endif
 
 #ifdef _KERNEL
 	over_mchain_jump = sljit_emit_jump(compiler, SLJIT_JUMP);
@@ -918,12 +1641,24 @@ emit_msh(struct sljit_compiler* compiler,
 	return status;
 }
 
+/*
+ * Generate A = A / k or A = A % k for k which is a power of two.
+ */
 static int
-emit_pow2_division(struct sljit_compiler* compiler, uint32_t k)
+emit_pow2_division(struct sljit_compiler* compiler, int op, uint32_t k)
 {
 	int shift = 0;
 	int status = SLJIT_SUCCESS;
 
+	if (op == BPF_MOD) {
+		/* A = A & (k - 1); */
+		return sljit_emit_op2(compiler,
+		    SLJIT_AND,
+		    BJ_AREG, 0,
+		    BJ_AREG, 0,
+		    SLJIT_IMM, k - 1);
+	}
+
 	while (k > 1) {
 		k >>= 1;
 		shift++;
@@ -942,93 +1677,307 @@ emit_pow2_division(struct sljit_compiler* compiler, uint32_t k)
 	return status;
 }
 
-#if !defined(BPFJIT_USE_UDIV)
-static sljit_uw
-divide(sljit_uw x, sljit_uw y)
+/*
+ * Find a magic number m for k which isn't a power of two such that
+ * A / k == (A * m) >> (32 + *shift) for all 32bit values of A.
+ * The magic number may be up to 33 bits long.
+ */
+static uint64_t
+division_magic(uint32_t k, int *shift)
 {
+	uint64_t p, m;
+	int l;
 
-	return (uint32_t)x / (uint32_t)y;
+	BJ_ASSERT(k > 2 && (k & (k - 1)) != 0);
+
+	/*
+	 * Try m = floor(2^(32+l) / k) + 1 for increasing l, it works when
+	 * m * k - 2^(32+l) <= 2^l. The condition holds for l = 32.
+	 * Note that k doesn't divide p + 1 = 2^(32+l).
+	 */
+	for (l = 0; l < 32; l++) {
+		p = (UINT64_C(1) << (32 + l)) - 1;
+		m = p / k + 1;
+		if (m * k - p - 1 <= (UINT64_C(1) << l))
+			break;
+	}
+
+	if (l == 32)
+		m = UINT64_MAX / k + 1;
+
+	*shift = l;
+	return m;
 }
-#endif
 
 /*
- * Generate A = A / div.
- * divt,divw are either SLJIT_IMM,pc->k or BJ_XREG,0.
+ * Generate A = A / k or A = A % k for k which isn't a power of two.
+ * Division is replaced with a multiplication by a magic number,
+ * see division_magic().
  */
 static int
-emit_division(struct sljit_compiler* compiler, int divt, sljit_sw divw)
+emit_magic_division(struct sljit_compiler* compiler, int op, uint32_t k)
 {
-	int status;
-
-#if BJ_XREG == SLJIT_RETURN_REG   || \
-    BJ_XREG == SLJIT_SCRATCH_REG1 || \
-    BJ_XREG == SLJIT_SCRATCH_REG2 || \
-    BJ_AREG == SLJIT_SCRATCH_REG2
+#if BJ_AREG != SLJIT_SCRATCH_REG1   || \
+    BJ_TMP1REG != SLJIT_SCRATCH_REG2 || \
+    BJ_TMP2REG == SLJIT_SCRATCH_REG1 || \
+    BJ_TMP2REG == SLJIT_SCRATCH_REG2
 #error "Not supported assignment of registers."
 #endif
+	uint64_t m;
+	int shift, status;
 
-#if BJ_AREG != SLJIT_SCRATCH_REG1
+	m = division_magic(k, &shift);
+
+#if defined(SLJIT_64BIT_ARCHITECTURE) && SLJIT_64BIT_ARCHITECTURE
+	/* A = (uint32_t)A; */
 	status = sljit_emit_op1(compiler,
-	    SLJIT_MOV,
-	    SLJIT_SCRATCH_REG1, 0,
+	    SLJIT_MOV_UI,
+	    BJ_AREG, 0,
 	    BJ_AREG, 0);
 	if (status != SLJIT_SUCCESS)
 		return status;
-#endif
 
+	if (op == BPF_MOD) {
+		/* tmp2 = A; */
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV,
+		    BJ_TMP2REG, 0,
+		    BJ_AREG, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
+
+	/*
+	 * A 64bit high word of A * (m << (32 - shift)) is A / k,
+	 * the shifted magic number fits into 64 bits.
+	 */
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV,
-	    SLJIT_SCRATCH_REG2, 0,
-	    divt, divw);
+	    BJ_TMP1REG, 0,
+	    SLJIT_IMM, (sljit_sw)(m << (32 - shift)));
 	if (status != SLJIT_SUCCESS)
 		return status;
 
-#if defined(BPFJIT_USE_UDIV)
-	status = sljit_emit_op0(compiler, SLJIT_UDIV|SLJIT_INT_OP);
+	/* tmp1:A = A * tmp1; */
+	status = sljit_emit_op0(compiler, SLJIT_UMUL);
+	if (status != SLJIT_SUCCESS)
+		return status;
 
-#if BJ_AREG != SLJIT_SCRATCH_REG1
+	/* A = tmp1; */
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV,
 	    BJ_AREG, 0,
-	    SLJIT_SCRATCH_REG1, 0);
+	    BJ_TMP1REG, 0);
 	if (status != SLJIT_SUCCESS)
 		return status;
-#endif
 #else
-	status = sljit_emit_ijump(compiler,
-	    SLJIT_CALL2,
-	    SLJIT_IMM, SLJIT_FUNC_OFFSET(divide));
+	if (op == BPF_MOD || m > UINT32_MAX) {
+		/* tmp2 = A; */
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV,
+		    BJ_TMP2REG, 0,
+		    BJ_AREG, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
 
-#if BJ_AREG != SLJIT_RETURN_REG
+	/* tmp1 = low 32 bits of m; */
 	status = sljit_emit_op1(compiler,
 	    SLJIT_MOV,
-	    BJ_AREG, 0,
-	    SLJIT_RETURN_REG, 0);
+	    BJ_TMP1REG, 0,
+	    SLJIT_IMM, (uint32_t)m);
 	if (status != SLJIT_SUCCESS)
 		return status;
-#endif
-#endif
-
-	return status;
-}
 
-/*
- * Return true if pc is a "read from packet" instruction.
- * If length is not NULL and return value is true, *length will
- * be set to a safe length required to read a packet.
- */
-static bool
-read_pkt_insn(struct bpf_insn *pc, uint32_t *length)
-{
-	bool rv;
-	uint32_t width;
+	/* tmp1:A = A * tmp1; */
+	status = sljit_emit_op0(compiler, SLJIT_UMUL);
+	if (status != SLJIT_SUCCESS)
+		return status;
 
-	switch (BPF_CLASS(pc->code)) {
-	default:
-		rv = false;
-		break;
+	if (m <= UINT32_MAX) {
+		/* A = tmp1 >> shift; */
+		status = sljit_emit_op2(compiler,
+		    SLJIT_LSHR|SLJIT_INT_OP,
+		    BJ_AREG, 0,
+		    BJ_TMP1REG, 0,
+		    SLJIT_IMM, shift);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	} else {
+		/*
+		 * 33bit magic number, tmp1 is the high word
+		 * of A * (m - 2^32), A = (A * m) >> (32 + shift):
+		 * A = (((tmp2 - tmp1) >> 1) + tmp1) >> (shift - 1);
+		 */
+		status = sljit_emit_op2(compiler,
+		    SLJIT_SUB,
+		    BJ_AREG, 0,
+		    BJ_TMP2REG, 0,
+		    BJ_TMP1REG, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
 
-	case BPF_LD:
+		status = sljit_emit_op2(compiler,
+		    SLJIT_LSHR,
+		    BJ_AREG, 0,
+		    BJ_AREG, 0,
+		    SLJIT_IMM, 1);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		status = sljit_emit_op2(compiler,
+		    SLJIT_ADD,
+		    BJ_AREG, 0,
+		    BJ_AREG, 0,
+		    BJ_TMP1REG, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		status = sljit_emit_op2(compiler,
+		    SLJIT_LSHR,
+		    BJ_AREG, 0,
+		    BJ_AREG, 0,
+		    SLJIT_IMM, shift - 1);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
+#endif
+
+	if (op == BPF_MOD) {
+		/* tmp1 = A * k; */
+		status = sljit_emit_op2(compiler,
+		    SLJIT_MUL|SLJIT_INT_OP,
+		    BJ_TMP1REG, 0,
+		    BJ_AREG, 0,
+		    SLJIT_IMM, k);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		/* A = tmp2 - tmp1; */
+		status = sljit_emit_op2(compiler,
+		    SLJIT_SUB,
+		    BJ_AREG, 0,
+		    BJ_TMP2REG, 0,
+		    BJ_TMP1REG, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
+
+	return status;
+}
+
+#if !defined(BPFJIT_USE_UDIV)
+static sljit_uw
+divide(sljit_uw x, sljit_uw y)
+{
+
+	return (uint32_t)x / (uint32_t)y;
+}
+
+static sljit_uw
+modulus(sljit_uw x, sljit_uw y)
+{
+
+	return (uint32_t)x % (uint32_t)y;
+}
+#endif
+
+/*
+ * Generate A = A / div or A = A % div.
+ * divt,divw are either SLJIT_IMM,pc->k or BJ_XREG,0.
+ */
+static int
+emit_division(struct sljit_compiler* compiler, int op,
+    int divt, sljit_sw divw)
+{
+	int status;
+
+#if BJ_XREG == SLJIT_RETURN_REG   || \
+    BJ_XREG == SLJIT_SCRATCH_REG1 || \
+    BJ_XREG == SLJIT_SCRATCH_REG2 || \
+    BJ_AREG == SLJIT_SCRATCH_REG2
+#error "Not supported assignment of registers."
+#endif
+
+#if BJ_AREG != SLJIT_SCRATCH_REG1
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    SLJIT_SCRATCH_REG1, 0,
+	    BJ_AREG, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+#endif
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    SLJIT_SCRATCH_REG2, 0,
+	    divt, divw);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+#if defined(BPFJIT_USE_UDIV)
+	status = sljit_emit_op0(compiler, SLJIT_UDIV|SLJIT_INT_OP);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	if (op == BPF_MOD) {
+		/* the remainder is in SLJIT_SCRATCH_REG2 */
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV,
+		    BJ_AREG, 0,
+		    SLJIT_SCRATCH_REG2, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
+
+#if BJ_AREG != SLJIT_SCRATCH_REG1
+	if (op != BPF_MOD) {
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV,
+		    BJ_AREG, 0,
+		    SLJIT_SCRATCH_REG1, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
+#endif
+#else
+	status = sljit_emit_ijump(compiler,
+	    SLJIT_CALL2,
+	    SLJIT_IMM, op == BPF_MOD ?
+	    SLJIT_FUNC_OFFSET(modulus) : SLJIT_FUNC_OFFSET(divide));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+#if BJ_AREG != SLJIT_RETURN_REG
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    BJ_AREG, 0,
+	    SLJIT_RETURN_REG, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+#endif
+#endif
+
+	return status;
+}
+
+/*
+ * Return true if pc is a "read from packet" instruction.
+ * If length is not NULL and return value is true, *length will
+ * be set to a safe length required to read a packet.
+ */
+static bool
+read_pkt_insn(struct bpf_insn *pc, uint32_t *length)
+{
+	bool rv;
+	uint32_t width;
+
+	switch (BPF_CLASS(pc->code)) {
+	default:
+		rv = false;
+		break;
+
+	case BPF_LD:
 		rv = BPF_MODE(pc->code) == BPF_ABS ||
 		     BPF_MODE(pc->code) == BPF_IND;
 		if (rv)
@@ -1050,164 +1999,422 @@ read_pkt_insn(struct bpf_insn *pc, uint32_t *length)
 }
 
 /*
- * Set bj_check_length for all "read from packet" instructions
- * in a linear block of instructions [from, to).
+ * Get jump offsets of BPF_JMP instruction. Jumps resolved
+ * by optimize_consts() have equal offsets.
  */
 static void
-set_check_length(struct bpf_insn *insns, struct bpfjit_insn_data *insn_dat,
-    size_t from, size_t to, uint32_t length)
+get_jump_offsets(struct bpf_insn *pc, const struct bpfjit_insn_data *dat,
+    uint32_t *jt, uint32_t *jf)
 {
 
-	for (; from < to; from++) {
-		if (read_pkt_insn(&insns[from], NULL)) {
-			insn_dat[from].bj_aux.bj_rdata.bj_check_length = length;
-			length = 0;
-		}
+	if (pc->code == (BPF_JMP|BPF_JA)) {
+		*jt = *jf = pc->k;
+	} else {
+		*jt = pc->jt;
+		*jf = pc->jf;
 	}
+
+	if (dat->bj_fold == BJ_FOLD_JT)
+		*jf = *jt;
+	else if (dat->bj_fold == BJ_FOLD_JF)
+		*jt = *jf;
 }
 
 /*
- * Get safe length for a jump destication.
+ * Compute A <op> k of BPF_ALU instruction.
+ * Return false if the result isn't known at compile time.
  */
-static uint32_t
-get_safe_length(struct bpfjit_insn_data *insn_dat)
+static bool
+fold_alu(struct bpf_insn *pc, uint32_t a, uint32_t k, uint32_t *res)
 {
-	struct bpfjit_jump *jmp;
-	uint32_t rv;
 
-	rv = UINT32_MAX;
-	SLIST_FOREACH(jmp, &insn_dat->bj_jumps, bj_entries) {
-		if (jmp->bj_safe_length < rv)
-			rv = jmp->bj_safe_length;
+	switch (BPF_OP(pc->code)) {
+	case BPF_ADD: *res = a + k; break;
+	case BPF_SUB: *res = a - k; break;
+	case BPF_MUL: *res = a * k; break;
+	case BPF_OR:  *res = a | k; break;
+	case BPF_AND: *res = a & k; break;
+	case BPF_NEG: *res = -a;    break;
+	case BPF_DIV:
+		if (k == 0)
+			return false; /* returns 0 at run time */
+		*res = a / k;
+		break;
+	case BPF_MOD:
+		if (k == 0)
+			return false; /* returns 0 at run time */
+		*res = a % k;
+		break;
+	case BPF_LSH:
+		if (k >= 32)
+			return false;
+		*res = a << k;
+		break;
+	case BPF_RSH:
+		if (k >= 32)
+			return false;
+		*res = a >> k;
+		break;
+	default:
+		return false;
 	}
 
-	return rv;
+	return true;
 }
 
 /*
- * The function divides instructions into blocks. Destination of a jump
- * instruction starts a new block. BPF_RET and BPF_JMP instructions
- * terminate a block. Blocks are linear, that is, there are no jumps out
- * from the middle of a block and there are no jumps in to the middle of
- * a block.
- * If a block has one or more "read from packet" instructions,
- * bj_check_length will be set to one value for the whole block and that
- * value will be equal to the greatest value of safe lengths of "read from
- * packet" instructions inside the block.
- *
- * The function also sets bits in *initmask for memwords that
- * need to be initialized to zero. Note that this set should be empty
- * for any valid kernel filter program.
+ * Compute a condition of BPF_JMP instruction.
  */
 static bool
-optimize1(struct bpf_insn *insns,
-    struct bpfjit_insn_data *insn_dat, size_t insn_count,
-    bpfjit_init_mask_t *initmask, int *nscratches, int *ncopfuncs)
+fold_jmp(struct bpf_insn *pc, uint32_t a, uint32_t k)
 {
-	struct bpfjit_jump *jtf;
-	size_t i;
-	size_t first_read;
-	uint32_t jt, jf;
-	uint32_t length, safe_length;
-	bpfjit_init_mask_t invalid; /* borrowed from bpf_filter() */
-	bool break_block, jump_dst, unreachable;
 
-	*initmask = BJ_INIT_NOBITS;
-	*nscratches = 2;
-	*ncopfuncs = 0;
+	switch (BPF_OP(pc->code)) {
+	case BPF_JGT:  return a > k;
+	case BPF_JGE:  return a >= k;
+	case BPF_JEQ:  return a == k;
+	case BPF_JSET: return (a & k) != 0;
+	default:
+		BJ_ASSERT(false);
+		return false;
+	}
+}
 
-	for (i = 0; i < insn_count; i++) {
-		insn_dat[i].bj_invalid = BJ_INIT_NOBITS;
-		SLIST_INIT(&insn_dat[i].bj_jumps);
+/*
+ * Merge known values coming to an instruction from one path.
+ */
+static void
+merge_consts(struct bpfjit_consts *dst, const struct bpfjit_consts *src)
+{
+	size_t k;
+
+	if (!dst->bj_seen) {
+		*dst = *src;
+		return;
 	}
 
-	safe_length = 0;
-	invalid = ~BJ_INIT_NOBITS;
-	unreachable = false;
-	first_read = SIZE_MAX;
+	dst->bj_known &= src->bj_known;
+
+	if (dst->bj_a != src->bj_a)
+		dst->bj_known &= ~BJ_INIT_ABIT;
+	if (dst->bj_x != src->bj_x)
+		dst->bj_known &= ~BJ_INIT_XBIT;
+
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		if (dst->bj_mem[k] != src->bj_mem[k])
+			dst->bj_known &= ~BJ_INIT_MBIT(k);
+	}
+}
+
+/*
+ * Constant propagation. It runs before optimize1().
+ *
+ * The pass tracks values of A, X and M[] known at compile time
+ * and sets bj_fold of instructions that can be simplified:
+ * loads and ALU operations with a known result become moves of
+ * a constant, BPF_X operands with a known value become BPF_K
+ * operands and conditional jumps with a known outcome become
+ * unconditional. Arms of resolved jumps that can't be reached
+ * from elsewhere are later marked with bj_unreachable by
+ * optimize1().
+ *
+ * bpf_filter() starts with zero A and X. Memwords read before
+ * they're written are zeroed too (see initmask).
+ */
+static bool
+optimize_consts(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count)
+{
+	struct bpfjit_consts *cs, cur;
+	struct bpf_insn *pc;
+	size_t i, k;
+	uint32_t jt, jf, v;
+	bool known;
 
 	for (i = 0; i < insn_count; i++) {
-		jump_dst = !SLIST_EMPTY(&insn_dat[i].bj_jumps);
-		break_block =
-		    insns[i].code == (BPF_MISC|BPF_COP) ||
-		    insns[i].code == (BPF_MISC|BPF_COPX);
+		insn_dat[i].bj_fold = BJ_FOLD_NONE;
+		insn_dat[i].bj_const = 0;
+	}
 
-		if (jump_dst || (break_block && !unreachable)) {
-			unreachable = false;
+	if (insn_count == 0 || insn_count > SIZE_MAX / sizeof(cs[0]))
+		return false;
 
-			set_check_length(insns, insn_dat,
-			    first_read, i, safe_length);
-			first_read = SIZE_MAX;
+	cs = BJ_ALLOC(insn_count * sizeof(cs[0]));
+	if (cs == NULL)
+		return false;
 
-			if (jump_dst)
-				safe_length = get_safe_length(&insn_dat[i]);
-		}
+	for (i = 0; i < insn_count; i++)
+		cs[i].bj_seen = false;
 
-		insn_dat[i].bj_unreachable = unreachable;
-		if (unreachable)
+	cs[0].bj_known = BJ_INIT_MMASK | BJ_INIT_ABIT | BJ_INIT_XBIT;
+	cs[0].bj_a = 0;
+	cs[0].bj_x = 0;
+	for (k = 0; k < BPF_MEMWORDS; k++)
+		cs[0].bj_mem[k] = 0;
+	cs[0].bj_seen = true;
+
+	for (i = 0; i < insn_count; i++) {
+		if (!cs[i].bj_seen)
 			continue;
 
-		invalid |= insn_dat[i].bj_invalid;
+		cur = cs[i];
+		pc = &insns[i];
 
-		if (read_pkt_insn(&insns[i], &length)) {
-			if (first_read == SIZE_MAX)
-				first_read = i;
-			if (length > safe_length)
-				safe_length = length;
+		/* Value of BPF_K or BPF_X operand. */
+		if (BPF_SRC(pc->code) == BPF_X) {
+			known = (cur.bj_known & BJ_INIT_XBIT) != 0;
+			v = cur.bj_x;
+		} else {
+			known = true;
+			v = pc->k;
 		}
 
-		switch (BPF_CLASS(insns[i].code)) {
+		switch (BPF_CLASS(pc->code)) {
 		case BPF_RET:
-			if (BPF_RVAL(insns[i].code) == BPF_A)
-				*initmask |= invalid & BJ_INIT_ABIT;
+			if (BPF_RVAL(pc->code) == BPF_A &&
+			    (cur.bj_known & BJ_INIT_ABIT)) {
+				insn_dat[i].bj_fold = BJ_FOLD_A;
+				insn_dat[i].bj_const = cur.bj_a;
+			}
 
-			unreachable = true;
 			continue;
 
 		case BPF_LD:
-			if (BPF_MODE(insns[i].code) == BPF_IND ||
-			    BPF_MODE(insns[i].code) == BPF_ABS) {
-				if (BPF_MODE(insns[i].code) == BPF_IND &&
-				    *nscratches < 4) {
-					/* uses BJ_XREG */
-					*nscratches = 4;
-				}
-				if (*nscratches < 3 &&
-				    read_width(&insns[i]) == 4) {
-					/* uses BJ_TMP2REG */
-					*nscratches = 3;
-				}
+			if (pc->code == (BPF_LD|BPF_IMM)) {
+				cur.bj_known |= BJ_INIT_ABIT;
+				cur.bj_a = pc->k;
+			} else if (pc->code == (BPF_LD|BPF_MEM) &&
+			    (uint32_t)pc->k < BPF_MEMWORDS &&
+			    (cur.bj_known & BJ_INIT_MBIT(pc->k))) {
+				cur.bj_known |= BJ_INIT_ABIT;
+				cur.bj_a = cur.bj_mem[pc->k];
+				insn_dat[i].bj_fold = BJ_FOLD_A;
+				insn_dat[i].bj_const = cur.bj_a;
+			} else {
+				cur.bj_known &= ~BJ_INIT_ABIT;
 			}
 
-			if (BPF_MODE(insns[i].code) == BPF_IND)
-				*initmask |= invalid & BJ_INIT_XBIT;
+			break;
 
-			if (BPF_MODE(insns[i].code) == BPF_MEM &&
-			    (uint32_t)insns[i].k < BPF_MEMWORDS) {
-				*initmask |= invalid & BJ_INIT_MBIT(insns[i].k);
+		case BPF_LDX:
+			if (pc->code == (BPF_LDX|BPF_W|BPF_IMM)) {
+				cur.bj_known |= BJ_INIT_XBIT;
+				cur.bj_x = pc->k;
+			} else if (pc->code == (BPF_LDX|BPF_W|BPF_MEM) &&
+			    (uint32_t)pc->k < BPF_MEMWORDS &&
+			    (cur.bj_known & BJ_INIT_MBIT(pc->k))) {
+				cur.bj_known |= BJ_INIT_XBIT;
+				cur.bj_x = cur.bj_mem[pc->k];
+				insn_dat[i].bj_fold = BJ_FOLD_X;
+				insn_dat[i].bj_const = cur.bj_x;
+			} else {
+				cur.bj_known &= ~BJ_INIT_XBIT;
 			}
 
-			invalid &= ~BJ_INIT_ABIT;
-			continue;
+			break;
 
-		case BPF_LDX:
-#if defined(_KERNEL)
-			/* uses BJ_TMP3REG */
-			*nscratches = 5;
-#endif
-			/* uses BJ_XREG */
-			if (*nscratches < 4)
-				*nscratches = 4;
+		case BPF_ST:
+		case BPF_STX:
+			if ((uint32_t)pc->k >= BPF_MEMWORDS)
+				break;
 
-			if (BPF_MODE(insns[i].code) == BPF_MEM &&
-			    (uint32_t)insns[i].k < BPF_MEMWORDS) {
-				*initmask |= invalid & BJ_INIT_MBIT(insns[i].k);
+			if (BPF_CLASS(pc->code) == BPF_ST) {
+				known = (cur.bj_known & BJ_INIT_ABIT) != 0;
+				v = cur.bj_a;
+			} else {
+				known = (cur.bj_known & BJ_INIT_XBIT) != 0;
+				v = cur.bj_x;
 			}
 
-			invalid &= ~BJ_INIT_XBIT;
-			continue;
+			cur.bj_mem[pc->k] = v;
+			if (known)
+				cur.bj_known |= BJ_INIT_MBIT(pc->k);
+			else
+				cur.bj_known &= ~BJ_INIT_MBIT(pc->k);
 
-		case BPF_ST:
+			break;
+
+		case BPF_ALU:
+			if ((cur.bj_known & BJ_INIT_ABIT) && known &&
+			    fold_alu(pc, cur.bj_a, v, &cur.bj_a)) {
+				insn_dat[i].bj_fold = BJ_FOLD_A;
+				insn_dat[i].bj_const = cur.bj_a;
+				break;
+			}
+
+			if (pc->code != (BPF_ALU|BPF_NEG) &&
+			    BPF_SRC(pc->code) == BPF_X && known) {
+				insn_dat[i].bj_fold = BJ_FOLD_K;
+				insn_dat[i].bj_const = v;
+			}
+
+			cur.bj_known &= ~BJ_INIT_ABIT;
+			break;
+
+		case BPF_MISC:
+			switch (BPF_MISCOP(pc->code)) {
+			case BPF_TAX:
+				cur.bj_x = cur.bj_a;
+				if (cur.bj_known & BJ_INIT_ABIT) {
+					cur.bj_known |= BJ_INIT_XBIT;
+					insn_dat[i].bj_fold = BJ_FOLD_X;
+					insn_dat[i].bj_const = cur.bj_x;
+				} else {
+					cur.bj_known &= ~BJ_INIT_XBIT;
+				}
+				break;
+
+			case BPF_TXA:
+				cur.bj_a = cur.bj_x;
+				if (cur.bj_known & BJ_INIT_XBIT) {
+					cur.bj_known |= BJ_INIT_ABIT;
+					insn_dat[i].bj_fold = BJ_FOLD_A;
+					insn_dat[i].bj_const = cur.bj_a;
+				} else {
+					cur.bj_known &= ~BJ_INIT_ABIT;
+				}
+				break;
+
+			case BJ_MISC_RESULT:
+				break;
+
+			default:
+				/* copfuncs can change A and M[] */
+				cur.bj_known &= ~(BJ_INIT_ABIT | BJ_INIT_MMASK);
+				break;
+			}
+
+			break;
+
+		case BPF_JMP:
+			if (pc->code != (BPF_JMP|BPF_JA)) {
+				if ((cur.bj_known & BJ_INIT_ABIT) && known) {
+					insn_dat[i].bj_fold =
+					    fold_jmp(pc, cur.bj_a, v) ?
+					    BJ_FOLD_JT : BJ_FOLD_JF;
+				} else if (BPF_SRC(pc->code) == BPF_X &&
+				    known) {
+					insn_dat[i].bj_fold = BJ_FOLD_K;
+					insn_dat[i].bj_const = v;
+				}
+			}
+
+			get_jump_offsets(pc, &insn_dat[i], &jt, &jf);
+			if (jt >= insn_count - (i + 1) ||
+			    jf >= insn_count - (i + 1)) {
+				BJ_FREE(cs, insn_count * sizeof(cs[0]));
+				return false;
+			}
+
+			merge_consts(&cs[i + 1 + jt], &cur);
+			merge_consts(&cs[i + 1 + jf], &cur);
+			continue;
+		}
+
+		if (i + 1 < insn_count)
+			merge_consts(&cs[i + 1], &cur);
+	}
+
+	BJ_FREE(cs, insn_count * sizeof(cs[0]));
+	return true;
+}
+
+/*
+ * The function divides instructions into blocks. Destination of a jump
+ * instruction starts a new block. BPF_RET and BPF_JMP instructions
+ * terminate a block. Blocks are linear, that is, there are no jumps out
+ * from the middle of a block and there are no jumps in to the middle of
+ * a block.
+ *
+ * The function also sets bits in *initmask for memwords that
+ * need to be initialized to zero. Note that this set should be empty
+ * for any valid kernel filter program.
+ */
+static bool
+optimize1(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count,
+    bpfjit_init_mask_t *initmask, int *nscratches, int *ncopfuncs)
+{
+	struct bpfjit_jump *jtf;
+	size_t i;
+	uint32_t jt, jf;
+	bpfjit_init_mask_t invalid; /* borrowed from bpf_filter() */
+	bool unreachable;
+
+	*initmask = BJ_INIT_NOBITS;
+	*nscratches = 2;
+	*ncopfuncs = 0;
+
+	for (i = 0; i < insn_count; i++) {
+		insn_dat[i].bj_invalid = BJ_INIT_NOBITS;
+		SLIST_INIT(&insn_dat[i].bj_jumps);
+	}
+
+	invalid = ~BJ_INIT_NOBITS;
+	unreachable = false;
+
+	for (i = 0; i < insn_count; i++) {
+		if (!SLIST_EMPTY(&insn_dat[i].bj_jumps))
+			unreachable = false;
+
+		insn_dat[i].bj_unreachable = unreachable;
+		if (unreachable)
+			continue;
+
+		invalid |= insn_dat[i].bj_invalid;
+
+		switch (BPF_CLASS(insns[i].code)) {
+		case BPF_RET:
+			if (BPF_RVAL(insns[i].code) == BPF_A)
+				*initmask |= invalid & BJ_INIT_ABIT;
+
+			unreachable = true;
+			continue;
+
+		case BPF_LD:
+			if (BPF_MODE(insns[i].code) == BPF_IND ||
+			    BPF_MODE(insns[i].code) == BPF_ABS) {
+				if (BPF_MODE(insns[i].code) == BPF_IND &&
+				    *nscratches < 4) {
+					/* uses BJ_XREG */
+					*nscratches = 4;
+				}
+				if (*nscratches < 3 &&
+				    read_width(&insns[i]) == 4) {
+					/* uses BJ_TMP2REG */
+					*nscratches = 3;
+				}
+			}
+
+			if (BPF_MODE(insns[i].code) == BPF_IND)
+				*initmask |= invalid & BJ_INIT_XBIT;
+
+			if (BPF_MODE(insns[i].code) == BPF_MEM &&
+			    (uint32_t)insns[i].k < BPF_MEMWORDS) {
+				*initmask |= invalid & BJ_INIT_MBIT(insns[i].k);
+			}
+
+			invalid &= ~BJ_INIT_ABIT;
+			continue;
+
+		case BPF_LDX:
+#if defined(_KERNEL)
+			/* uses BJ_TMP3REG */
+			*nscratches = 5;
+#endif
+			/* uses BJ_XREG */
+			if (*nscratches < 4)
+				*nscratches = 4;
+
+			if (BPF_MODE(insns[i].code) == BPF_MEM &&
+			    (uint32_t)insns[i].k < BPF_MEMWORDS) {
+				*initmask |= invalid & BJ_INIT_MBIT(insns[i].k);
+			}
+
+			invalid &= ~BJ_INIT_XBIT;
+			continue;
+
+		case BPF_ST:
 			*initmask |= invalid & BJ_INIT_ABIT;
 
 			if ((uint32_t)insns[i].k < BPF_MEMWORDS)
@@ -1239,6 +2446,13 @@ optimize1(struct bpf_insn *insns,
 
 			}
 
+			if ((BPF_OP(insns[i].code) == BPF_DIV ||
+			    BPF_OP(insns[i].code) == BPF_MOD) &&
+			    *nscratches < 3) {
+				/* uses BJ_TMP2REG */
+				*nscratches = 3;
+			}
+
 			invalid &= ~BJ_INIT_ABIT;
 			continue;
 
@@ -1266,6 +2480,8 @@ optimize1(struct bpf_insn *insns,
 				/* uses BJ_XREG */
 				if (*nscratches < 4)
 					*nscratches = 4;
+
+				*initmask |= invalid & BJ_INIT_XBIT;
 				/* FALLTHROUGH */
 
 			case BPF_COP:
@@ -1278,39 +2494,51 @@ optimize1(struct bpf_insn *insns,
 				invalid &= ~BJ_INIT_ABIT;
 				// XXX Tweak MBITs.
 				continue;
+
+			case BJ_MISC_RESULT:
+				if (insns[i].jf != 0)
+					*initmask |= invalid & BJ_INIT_ABIT;
+				continue;
 			}
 
 			continue;
 
 		case BPF_JMP:
-			if (insns[i].code == (BPF_JMP|BPF_JA)) {
-				jt = jf = insns[i].k;
-			} else {
-				jt = insns[i].jt;
-				jf = insns[i].jf;
-			}
+			get_jump_offsets(&insns[i], &insn_dat[i], &jt, &jf);
 
 			if (jt >= insn_count - (i + 1) ||
 			    jf >= insn_count - (i + 1)) {
 				return false;
 			}
 
+			if (insns[i].code != (BPF_JMP|BPF_JA)) {
+				*initmask |= invalid & BJ_INIT_ABIT;
+				if (BPF_SRC(insns[i].code) == BPF_X) {
+					/* uses BJ_XREG */
+					if (*nscratches < 4)
+						*nscratches = 4;
+
+					*initmask |= invalid & BJ_INIT_XBIT;
+				}
+			}
+
 			if (jt > 0 && jf > 0)
 				unreachable = true;
 
+			insn_dat[i].bj_aux.bj_jdata.bj_jt = jt;
+			insn_dat[i].bj_aux.bj_jdata.bj_jf = jf;
+
 			jt += i + 1;
 			jf += i + 1;
 
 			jtf = insn_dat[i].bj_aux.bj_jdata.bj_jtf;
 
 			jtf[0].bj_jump = NULL;
-			jtf[0].bj_safe_length = safe_length;
 			SLIST_INSERT_HEAD(&insn_dat[jt].bj_jumps,
 			    &jtf[0], bj_entries);
 
 			if (jf != jt) {
 				jtf[1].bj_jump = NULL;
-				jtf[1].bj_safe_length = safe_length;
 				SLIST_INSERT_HEAD(&insn_dat[jf].bj_jumps,
 				    &jtf[1], bj_entries);
 			}
@@ -1323,633 +2551,5010 @@ optimize1(struct bpf_insn *insns,
 		}
 	}
 
-	set_check_length(insns, insn_dat, first_read, insn_count, safe_length);
-
 	return true;
 }
 
 /*
- * Convert BPF_ALU operations except BPF_NEG and BPF_DIV to sljit operation.
+ * Mark BPF_COP instructions that have inline emitters in bc.
+ * They don't count as calls in *ncopfuncs. Inline bpfjit_hset_cop()
+ * reads the ctx argument, it's counted in *nhsets instead. Batch code
+ * has no ctx argument and doesn't inline it. It runs after optimize1().
  */
-static int
-bpf_alu_to_sljit_op(struct bpf_insn *pc)
+static void
+optimize_cops(bpf_ctx_t *bc, struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count, bool batch,
+    int *ncopfuncs, int *nhsets)
 {
+	struct bpf_insn *pc;
+	size_t i;
+	bool hset;
 
-	/*
-	 * Note: all supported 64bit arches have 32bit multiply
-	 * instruction so SLJIT_INT_OP doesn't have any overhead.
-	 */
-	switch (BPF_OP(pc->code)) {
-	case BPF_ADD: return SLJIT_ADD;
-	case BPF_SUB: return SLJIT_SUB;
-	case BPF_MUL: return SLJIT_MUL|SLJIT_INT_OP;
-	case BPF_OR:  return SLJIT_OR;
-	case BPF_AND: return SLJIT_AND;
-	case BPF_LSH: return SLJIT_SHL;
-	case BPF_RSH: return SLJIT_LSHR|SLJIT_INT_OP;
-	default:
-		BJ_ASSERT(false);
-		return 0;
+	*nhsets = 0;
+
+	for (i = 0; i < insn_count; i++) {
+		pc = &insns[i];
+		if (pc->code != (BPF_MISC|BPF_COP) &&
+		    pc->code != (BPF_MISC|BPF_COPX)) {
+			continue;
+		}
+
+		hset = pc->code == (BPF_MISC|BPF_COP) &&
+		    bc != NULL && pc->k < bc->nfuncs &&
+		    bc->copfuncs[pc->k] == bpfjit_hset_cop;
+
+		insn_dat[i].bj_aux.bj_cdata.bj_inline =
+		    pc->code == (BPF_MISC|BPF_COP) &&
+		    bc != NULL && pc->k < bc->nfuncs &&
+		    ((hset && !batch) || (!hset && bc->copemits != NULL &&
+		    bc->copemits[pc->k] != NULL));
+
+		if (insn_dat[i].bj_aux.bj_cdata.bj_inline &&
+		    !insn_dat[i].bj_unreachable) {
+			(*ncopfuncs)--;
+			if (hset)
+				(*nhsets)++;
+		}
 	}
 }
 
 /*
- * Convert BPF_JMP operations except BPF_JA to sljit condition.
+ * Return true if pc is BPF_LD+BPF_ABS instruction.
  */
-static int
-bpf_jmp_to_sljit_cond(struct bpf_insn *pc, bool negate)
+static bool
+ld_abs_insn(struct bpf_insn *pc)
 {
-	/*
-	 * Note: all supported 64bit arches have 32bit comparison
-	 * instructions so SLJIT_INT_OP doesn't have any overhead.
-	 */
-	int rv = SLJIT_INT_OP;
-
-	switch (BPF_OP(pc->code)) {
-	case BPF_JGT:
-		rv |= negate ? SLJIT_C_LESS_EQUAL : SLJIT_C_GREATER;
-		break;
-	case BPF_JGE:
-		rv |= negate ? SLJIT_C_LESS : SLJIT_C_GREATER_EQUAL;
-		break;
-	case BPF_JEQ:
-		rv |= negate ? SLJIT_C_NOT_EQUAL : SLJIT_C_EQUAL;
-		break;
-	case BPF_JSET:
-		rv |= negate ? SLJIT_C_EQUAL : SLJIT_C_NOT_EQUAL;
-		break;
-	default:
-		BJ_ASSERT(false);
-	}
 
-	return rv;
+	return BPF_CLASS(pc->code) == BPF_LD && BPF_MODE(pc->code) == BPF_ABS;
 }
 
 /*
- * Convert BPF_K and BPF_X to sljit register.
+ * Merge value numbers coming to an instruction from one path.
  */
-static int
-kx_to_reg(struct bpf_insn *pc)
+static void
+merge_vn(struct bpfjit_vn *dst, const struct bpfjit_vn *src)
 {
 
-	switch (BPF_SRC(pc->code)) {
-	case BPF_K: return SLJIT_IMM;
-	case BPF_X: return BJ_XREG;
-	default:
-		BJ_ASSERT(false);
-		return 0;
+	if (!dst->bj_seen) {
+		*dst = *src;
+		return;
 	}
+
+	if (dst->bj_a != src->bj_a)
+		dst->bj_a = SIZE_MAX;
+	dst->bj_avail &= src->bj_avail;
 }
 
-static sljit_sw
-kx_to_reg_arg(struct bpf_insn *pc)
+/*
+ * Value numbering of BPF_LD+BPF_ABS loads. It runs after optimize1().
+ *
+ * A load of P[k:w] is skipped when A holds P[k:w] on all paths to the
+ * load. Otherwise, if P[k:w] has been loaded on all paths, the load can
+ * be replaced with a register move from BJ_LDCACHE. There is only one
+ * BJ_LDCACHE register and it's given to the word that saves most loads.
+ * Skipped loads and register moves don't need bounds checks because
+ * every path has already read the word, see optimize_checks().
+ * Words don't stay available past BJ_MISC_RESULT, a failed check
+ * of multi code continues with the next program.
+ */
+static bool
+optimize_loads(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count, bool *ldcache)
 {
+	struct bpfjit_vn *vn, cur;
+	struct bpf_insn *pc;
+	size_t *vnum;
+	size_t words[BJ_VN_MAXWORDS];
+	size_t saved[BJ_VN_MAXWORDS];
+	size_t i, j, nwords, cached;
+	uint32_t jt, jf, bit;
+
+	vn = BJ_ALLOC(insn_count * sizeof(vn[0]));
+	if (vn == NULL)
+		return false;
 
-	switch (BPF_SRC(pc->code)) {
-	case BPF_K: return (uint32_t)pc->k; /* SLJIT_IMM, pc->k, */
-	case BPF_X: return 0;               /* BJ_XREG, 0,      */
-	default:
-		BJ_ASSERT(false);
-		return 0;
+	vnum = BJ_ALLOC(insn_count * sizeof(vnum[0]));
+	if (vnum == NULL) {
+		BJ_FREE(vn, insn_count * sizeof(vn[0]));
+		return false;
 	}
-}
-
-bpfjit_function_t
-bpfjit_generate_code(bpf_ctx_t *bc, struct bpf_insn *insns, size_t insn_count)
-{
-	void *rv;
-	struct sljit_compiler *compiler;
 
-	size_t i;
-	int status;
-	int branching, negate;
-	unsigned int rval, mode, src;
+	/*
+	 * Number loads by the index of the first matching load.
+	 * Words loaded more than once are tracked in bj_avail masks.
+	 */
+	*ldcache = false;
+	nwords = 0;
+	for (i = 0; i < insn_count; i++) {
+		vnum[i] = SIZE_MAX;
+		vn[i].bj_seen = false;
 
-	/* optimization related */
-	bpfjit_init_mask_t initmask;
-	int nscratches, ncopfuncs;
+		if (read_pkt_insn(&insns[i], NULL)) {
+			insn_dat[i].bj_aux.bj_rdata.bj_vn = 0;
+			insn_dat[i].bj_aux.bj_rdata.bj_xbuf = false;
+		}
 
-	/* a list of jumps to out-of-bound return from a generated function */
-	struct sljit_jump **ret0;
-	size_t ret0_size, ret0_maxsize;
+		if (insn_dat[i].bj_unreachable || !ld_abs_insn(&insns[i]))
+			continue;
 
-	struct bpf_insn *pc;
-	struct bpfjit_insn_data *insn_dat;
+		for (j = 0; j < i; j++) {
+			if (vnum[j] == j && insns[j].code == insns[i].code &&
+			    insns[j].k == insns[i].k) {
+				break;
+			}
+		}
 
-	/* for local use */
-	struct sljit_label *label;
-	struct sljit_jump *jump;
-	struct bpfjit_jump *bjump, *jtf;
+		vnum[i] = j;
+
+		if (j < i && nwords < BJ_VN_MAXWORDS) {
+			for (bit = 0; bit < nwords; bit++) {
+				if (words[bit] == j)
+					break;
+			}
+			if (bit == nwords) {
+				saved[nwords] = 0;
+				words[nwords++] = j;
+			}
+		}
+	}
+
+	/*
+	 * Propagate value numbers and count loads that
+	 * BJ_LDCACHE would replace for every tracked word.
+	 */
+	vn[0].bj_a = SIZE_MAX;
+	vn[0].bj_avail = 0;
+	vn[0].bj_seen = true;
+
+	for (i = 0; i < insn_count; i++) {
+		if (!vn[i].bj_seen)
+			continue;
+
+		cur = vn[i];
+		pc = &insns[i];
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			continue;
+
+		case BPF_JMP:
+			get_jump_offsets(pc, &insn_dat[i], &jt, &jf);
+
+			merge_vn(&vn[i + 1 + jt], &cur);
+			merge_vn(&vn[i + 1 + jf], &cur);
+			continue;
+
+		case BPF_LD:
+			if (!ld_abs_insn(pc)) {
+				cur.bj_a = SIZE_MAX;
+				break;
+			}
+
+			for (bit = 0; bit < nwords; bit++) {
+				if (words[bit] == vnum[i])
+					break;
+			}
+
+			if (bit < nwords) {
+				if (cur.bj_a != vnum[i] &&
+				    (cur.bj_avail & (UINT32_C(1) << bit))) {
+					saved[bit]++;
+				}
+				cur.bj_avail |= UINT32_C(1) << bit;
+			}
+
+			/* A fused load doesn't change A but it's clobbered. */
+			cur.bj_a = insn_dat[i].bj_fuse ?
+			    SIZE_MAX : vnum[i];
+			break;
+
+		case BPF_ALU:
+			cur.bj_a = SIZE_MAX;
+			break;
+
+		case BPF_MISC:
+			if (BPF_MISCOP(pc->code) == BPF_TAX)
+				break;
+			cur.bj_a = SIZE_MAX;
+			if (BPF_MISCOP(pc->code) != BPF_TXA)
+				cur.bj_avail = 0; /* COP, COPX or RESULT */
+			break;
+		}
+
+		if (i + 1 < insn_count)
+			merge_vn(&vn[i + 1], &cur);
+	}
+
+	bit = 0;
+	cached = SIZE_MAX;
+#ifdef BJ_LDCACHE
+	for (j = 0; j < nwords; j++) {
+		if (saved[j] > 0 && (cached == SIZE_MAX ||
+		    saved[j] > saved[bit])) {
+			bit = j;
+			cached = words[j];
+		}
+	}
+#endif
+
+	/*
+	 * Mark loads. BJ_LDCACHE holds the cached word iff
+	 * the word has been loaded on all paths.
+	 */
+	for (i = 0; i < insn_count; i++) {
+		if (!vn[i].bj_seen || !ld_abs_insn(&insns[i]))
+			continue;
+
+		if (vn[i].bj_a == vnum[i]) {
+			insn_dat[i].bj_aux.bj_rdata.bj_vn = BJ_VN_SKIP;
+		} else if (vnum[i] == cached &&
+		    (vn[i].bj_avail & (UINT32_C(1) << bit))) {
+			insn_dat[i].bj_aux.bj_rdata.bj_vn = BJ_VN_FROM_CACHE;
+		} else if (vnum[i] == cached) {
+			insn_dat[i].bj_aux.bj_rdata.bj_vn = BJ_VN_TO_CACHE;
+			*ldcache = true;
+		}
+
+		/* A or BJ_LDCACHE is cheaper than a fused load. */
+		if (insn_dat[i].bj_aux.bj_rdata.bj_vn != 0)
+			insn_dat[i].bj_fuse = false;
+	}
+
+	BJ_FREE(vnum, insn_count * sizeof(vnum[0]));
+	BJ_FREE(vn, insn_count * sizeof(vn[0]));
+	return true;
+}
+
+/*
+ * Set *use and *def to A, X and M[k] words read and written by pc.
+ * Copfuncs read A and any word through bpf_state but words they write
+ * aren't in *def because they may be left unchanged. Inline copfuncs
+ * only read A.
+ * Return true if pc has no effects other than writing *def.
+ */
+static bool
+insn_use_def(struct bpf_insn *pc, const struct bpfjit_insn_data *dat,
+    bpfjit_init_mask_t *use, bpfjit_init_mask_t *def)
+{
+	bool pure;
+
+	*use = *def = BJ_INIT_NOBITS;
+	pure = false;
+
+	switch (BPF_CLASS(pc->code)) {
+	case BPF_RET:
+		if (BPF_RVAL(pc->code) == BPF_A && dat->bj_fold != BJ_FOLD_A)
+			*use = BJ_INIT_ABIT;
+		break;
+
+	case BPF_LD:
+	case BPF_LDX:
+		*def = (BPF_CLASS(pc->code) == BPF_LD) ?
+		    BJ_INIT_ABIT : BJ_INIT_XBIT;
+
+		switch (BPF_MODE(pc->code)) {
+		case BPF_IND:
+			*use = BJ_INIT_XBIT;
+			break;
+		case BPF_MEM:
+			if ((uint32_t)pc->k < BPF_MEMWORDS) {
+				pure = true;
+				if (dat->bj_fold == BJ_FOLD_NONE)
+					*use = BJ_INIT_MBIT(pc->k);
+			}
+			break;
+		case BPF_IMM:
+		case BPF_LEN:
+			pure = true;
+			break;
+		}
+		break;
+
+	case BPF_ST:
+	case BPF_STX:
+		*use = (BPF_CLASS(pc->code) == BPF_ST) ?
+		    BJ_INIT_ABIT : BJ_INIT_XBIT;
+		if ((uint32_t)pc->k < BPF_MEMWORDS) {
+			*def = BJ_INIT_MBIT(pc->k);
+			pure = true;
+		}
+		break;
+
+	case BPF_ALU:
+		*def = BJ_INIT_ABIT;
+		pure = true;
+
+		if (dat->bj_fold == BJ_FOLD_A)
+			break;
+
+		*use = BJ_INIT_ABIT;
+		if (pc->code != (BPF_ALU|BPF_NEG) &&
+		    BPF_SRC(pc->code) == BPF_X &&
+		    dat->bj_fold != BJ_FOLD_K) {
+			*use |= BJ_INIT_XBIT;
+		}
+
+		/* Division by zero returns 0. */
+		if ((BPF_OP(pc->code) == BPF_DIV ||
+		    BPF_OP(pc->code) == BPF_MOD) &&
+		    (BPF_SRC(pc->code) == BPF_X ?
+		    dat->bj_fold != BJ_FOLD_K || dat->bj_const == 0 :
+		    pc->k == 0)) {
+			pure = false;
+		}
+		break;
+
+	case BPF_JMP:
+		if (pc->code == (BPF_JMP|BPF_JA) ||
+		    dat->bj_fold == BJ_FOLD_JT || dat->bj_fold == BJ_FOLD_JF) {
+			break;
+		}
+
+		*use = BJ_INIT_ABIT;
+		if (BPF_SRC(pc->code) == BPF_X && dat->bj_fold != BJ_FOLD_K)
+			*use |= BJ_INIT_XBIT;
+		break;
+
+	case BPF_MISC:
+		switch (BPF_MISCOP(pc->code)) {
+		case BPF_TAX:
+			*def = BJ_INIT_XBIT;
+			if (dat->bj_fold != BJ_FOLD_X)
+				*use = BJ_INIT_ABIT;
+			pure = true;
+			break;
+
+		case BPF_TXA:
+			*def = BJ_INIT_ABIT;
+			if (dat->bj_fold != BJ_FOLD_A)
+				*use = BJ_INIT_XBIT;
+			pure = true;
+			break;
+
+		case BPF_COPX:
+			*use = BJ_INIT_XBIT;
+			/* FALLTHROUGH */
+
+		case BPF_COP:
+			*use |= BJ_INIT_ABIT;
+			if (!dat->bj_aux.bj_cdata.bj_inline)
+				*use |= BJ_INIT_MMASK;
+			*def = BJ_INIT_ABIT;
+			break;
+
+		case BJ_MISC_RESULT:
+			if (pc->jf != 0)
+				*use = BJ_INIT_ABIT;
+			break;
+		}
+		break;
+	}
+
+	return pure;
+}
+
+/*
+ * Return true if the instruction at index i can be fused with
+ * the next instruction, see optimize_dead(). Live masks of
+ * instructions after i are already computed, so is bj_fuse
+ * of the next instruction.
+ *
+ * These sequences are fused if A is dead after the jump:
+ *
+ *   BPF_ALU+BPF_AND+BPF_K, BPF_JMP+BPF_JEQ+BPF_K 0;
+ *   BPF_LD+BPF_ABS, BPF_JMP+BPF_JEQ+BPF_K;
+ *   BPF_LD+BPF_ABS, BPF_JMP+BPF_JSET+BPF_K;
+ *   BPF_LD+BPF_ABS, fused BPF_ALU+BPF_AND+BPF_K.
+ */
+static bool
+fuse_insn(struct bpf_insn *insns, struct bpfjit_insn_data *insn_dat,
+    size_t insn_count, size_t i, const bpfjit_init_mask_t *live)
+{
+	struct bpf_insn *next;
+	uint32_t jt, jf;
+#if BJ_UNALIGNED_LOADS && !defined(_KERNEL)
+	uint32_t width;
+#endif
+
+	if (i + 1 >= insn_count ||
+	    insn_dat[i].bj_fold != BJ_FOLD_NONE ||
+	    insn_dat[i + 1].bj_fold != BJ_FOLD_NONE ||
+	    !SLIST_EMPTY(&insn_dat[i + 1].bj_jumps)) {
+		return false;
+	}
+
+	next = &insns[i + 1];
+
+	if (insns[i].code == (BPF_ALU|BPF_AND|BPF_K)) {
+		if (next->code != (BPF_JMP|BPF_JEQ|BPF_K) || next->k != 0)
+			return false;
+
+		get_jump_offsets(next, &insn_dat[i + 1], &jt, &jf);
+
+		return jt != jf &&
+		    ((live[i + 2 + jt] | live[i + 2 + jf]) & BJ_INIT_ABIT) == 0;
+	}
+
+#if BJ_UNALIGNED_LOADS && !defined(_KERNEL)
+	if (!ld_abs_insn(&insns[i]))
+		return false;
+
+	width = read_width(&insns[i]);
+	if (width == 1)
+		return false;
+
+	/* Liveness of A after the jump was checked for the fused AND. */
+	if (insn_dat[i + 1].bj_fuse)
+		return true;
+
+	if ((next->code != (BPF_JMP|BPF_JEQ|BPF_K) &&
+	    next->code != (BPF_JMP|BPF_JSET|BPF_K)) ||
+	    (width == 2 && next->k > UINT16_MAX &&
+	    BPF_OP(next->code) == BPF_JEQ)) {
+		return false;
+	}
+
+	get_jump_offsets(next, &insn_dat[i + 1], &jt, &jf);
+
+	return jt != jf &&
+	    ((live[i + 2 + jt] | live[i + 2 + jf]) & BJ_INIT_ABIT) == 0;
+#else
+	/*
+	 * Without unaligned loads, a word is assembled in a register
+	 * anyway. The kernel may need to read an mbuf chain into A.
+	 */
+	return false;
+#endif
+}
+
+/*
+ * Dead code elimination. It runs after optimize1().
+ *
+ * Backward liveness analysis of A, X and M[k] words marks instructions
+ * without side effects as dead if nothing they write is live. Dead
+ * instructions don't generate any code. Packet reads and divisions
+ * that can return 0 are never dead. Copfuncs see all words, so stores
+ * before a call stay.
+ *
+ * If A is dead after a jump, instructions that compute an operand
+ * of the jump may be fused with it, see fuse_insn(). The jump tests
+ * or compares the packet word in packet byte order and A isn't loaded.
+ */
+static bool
+optimize_dead(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count)
+{
+	bpfjit_init_mask_t *live;
+	bpfjit_init_mask_t use, def, out;
+	size_t i;
+	uint32_t jt, jf;
+	struct bpf_insn *pc;
+
+	live = BJ_ALLOC(insn_count * sizeof(live[0]));
+	if (live == NULL)
+		return false;
+
+	for (i = insn_count; i-- > 0; ) {
+		pc = &insns[i];
+		live[i] = BJ_INIT_NOBITS;
+		insn_dat[i].bj_dead = false;
+		insn_dat[i].bj_fuse = false;
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			out = BJ_INIT_NOBITS;
+			break;
+
+		case BPF_JMP:
+			get_jump_offsets(pc, &insn_dat[i], &jt, &jf);
+
+			out = live[i + 1 + jt] | live[i + 1 + jf];
+			break;
+
+		default:
+			out = (i + 1 < insn_count) ?
+			    live[i + 1] : BJ_INIT_NOBITS;
+			break;
+		}
+
+		insn_dat[i].bj_fuse =
+		    fuse_insn(insns, insn_dat, insn_count, i, live);
+
+		if (insn_use_def(pc, &insn_dat[i], &use, &def) &&
+		    (out & def) == BJ_INIT_NOBITS) {
+			insn_dat[i].bj_dead = true;
+			live[i] = out;
+			continue;
+		}
+
+		live[i] = use | (out & ~def);
+	}
+
+	BJ_FREE(live, insn_count * sizeof(live[0]));
+	return true;
+}
+
+/*
+ * Set *use and *def to M[k] words read and written by pc.
+ * Copfuncs can read and write any word through bpf_state.
+ */
+static void
+memword_use_def(struct bpf_insn *pc, const struct bpfjit_insn_data *dat,
+    bpfjit_init_mask_t *use, bpfjit_init_mask_t *def)
+{
+
+	if (dat->bj_dead) {
+		*use = *def = BJ_INIT_NOBITS;
+		return;
+	}
+
+	insn_use_def(pc, dat, use, def);
+	*use &= BJ_INIT_MMASK;
+	*def &= BJ_INIT_MMASK;
+}
+
+/*
+ * Mark every pair of M[k] words in mask as interfering.
+ */
+static void
+interfere(bpfjit_init_mask_t *interf, bpfjit_init_mask_t mask)
+{
+	size_t k;
+
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		if (mask & BJ_INIT_MBIT(k))
+			interf[k] |= mask & ~BJ_INIT_MBIT(k);
+	}
+}
+
+/*
+ * Assign registers to M[k] words. It runs after optimize1().
+ *
+ * Backward liveness analysis finds live ranges of words. Two words
+ * interfere if one is defined while the other is live and holds
+ * a value. Words are coloured greedily in order of the number of
+ * instructions accessing them. Words that don't interfere can share
+ * a register. Words that don't fit stay in bpf_state.
+ *
+ * Copfuncs access M[] through bpf_state, so register values are
+ * copied there before a call and copied back if they're live after
+ * the call.
+ *
+ * The number of registers is up to BJ_MEMREG_MAX: BJ_LDCACHE if
+ * it's not used by optimize_loads() and two extra saved registers.
+ */
+static bool
+optimize_memwords(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count,
+    bpfjit_init_mask_t initmask, bool ldcache,
+    int memregs[BPF_MEMWORDS], int *nscratches, int *nsaveds)
+{
+	bpfjit_init_mask_t *live, *maydef;
+	bpfjit_init_mask_t use, def, out, interf[BPF_MEMWORDS], taken;
+	size_t weight[BPF_MEMWORDS];
+	int regs[BJ_MEMREG_MAX];
+	int nregs, r;
+	size_t i, k, best;
+	uint32_t jt, jf;
+	struct bpf_insn *pc;
+
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		memregs[k] = SLJIT_UNUSED;
+		interf[k] = BJ_INIT_NOBITS;
+		weight[k] = 0;
+	}
+
+	nregs = 0;
+#ifdef BJ_LDCACHE
+	if (!ldcache)
+		regs[nregs++] = BJ_LDCACHE;
+#endif
+	regs[nregs++] = SLJIT_SAVED_EREG1;
+	regs[nregs++] = SLJIT_SAVED_EREG2;
+
+	for (i = 0; i < insn_count; i++) {
+		if (insn_dat[i].bj_unreachable)
+			continue;
+		memword_use_def(&insns[i], &insn_dat[i], &use, &def);
+		if (BPF_CLASS(insns[i].code) == BPF_MISC)
+			continue;
+		for (k = 0; k < BPF_MEMWORDS; k++) {
+			if ((use | def) & BJ_INIT_MBIT(k))
+				weight[k]++;
+		}
+	}
+
+	for (k = 0; k < BPF_MEMWORDS && weight[k] < 2; k++)
+		continue;
+	if (k == BPF_MEMWORDS)
+		return true; /* nothing to allocate */
+
+	live = BJ_ALLOC(insn_count * sizeof(live[0]));
+	if (live == NULL)
+		return false;
+
+	maydef = BJ_ALLOC(insn_count * sizeof(maydef[0]));
+	if (maydef == NULL) {
+		BJ_FREE(live, insn_count * sizeof(live[0]));
+		return false;
+	}
+
+	/*
+	 * Words that may hold a value at the start of instruction.
+	 */
+	for (i = 0; i < insn_count; i++)
+		maydef[i] = BJ_INIT_NOBITS;
+	maydef[0] = initmask & BJ_INIT_MMASK;
+
+	for (i = 0; i < insn_count; i++) {
+		pc = &insns[i];
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		memword_use_def(pc, &insn_dat[i], &use, &def);
+		out = maydef[i] | def;
+		if (use == BJ_INIT_MMASK)
+			out = BJ_INIT_MMASK; /* copfunc */
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			continue;
+
+		case BPF_JMP:
+			get_jump_offsets(pc, &insn_dat[i], &jt, &jf);
+
+			maydef[i + 1 + jt] |= out;
+			maydef[i + 1 + jf] |= out;
+			continue;
+		}
+
+		if (i + 1 < insn_count)
+			maydef[i + 1] |= out;
+	}
+
+	/*
+	 * Live words at the start of instruction.
+	 */
+	for (i = insn_count; i-- > 0; ) {
+		pc = &insns[i];
+		live[i] = BJ_INIT_NOBITS;
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			out = BJ_INIT_NOBITS;
+			break;
+
+		case BPF_JMP:
+			get_jump_offsets(pc, &insn_dat[i], &jt, &jf);
+
+			out = live[i + 1 + jt] | live[i + 1 + jf];
+			break;
+
+		default:
+			out = (i + 1 < insn_count) ?
+			    live[i + 1] : BJ_INIT_NOBITS;
+			break;
+		}
+
+		memword_use_def(pc, &insn_dat[i], &use, &def);
+		live[i] = use | (out & ~def);
+
+		/* Interference of words holding a value after pc. */
+		if (def != BJ_INIT_NOBITS) {
+			out &= maydef[i] | def;
+			for (k = 0; k < BPF_MEMWORDS; k++) {
+				if (def & BJ_INIT_MBIT(k))
+					interf[k] |= out & ~def;
+			}
+			for (k = 0; k < BPF_MEMWORDS; k++) {
+				if (out & ~def & BJ_INIT_MBIT(k))
+					interf[k] |= def;
+			}
+		} else if (use == BJ_INIT_MMASK) {
+			/* spill before and reload after the call */
+			interfere(interf, maydef[i]);
+			interfere(interf, out);
+			insn_dat[i].bj_aux.bj_cdata.bj_spill = maydef[i];
+			insn_dat[i].bj_aux.bj_cdata.bj_reload = out;
+		}
+	}
+
+	interfere(interf, live[0] & maydef[0]);
+
+	/*
+	 * Colour words greedily, heaviest first.
+	 */
+	for (;;) {
+		best = BPF_MEMWORDS;
+		for (k = 0; k < BPF_MEMWORDS; k++) {
+			if (memregs[k] == SLJIT_UNUSED && weight[k] >= 2 &&
+			    (best == BPF_MEMWORDS || weight[k] > weight[best])) {
+				best = k;
+			}
+		}
+
+		if (best == BPF_MEMWORDS)
+			break;
+
+		weight[best] = 0;
+
+		taken = BJ_INIT_NOBITS;
+		for (k = 0; k < BPF_MEMWORDS; k++) {
+			if ((interf[best] & BJ_INIT_MBIT(k)) &&
+			    memregs[k] != SLJIT_UNUSED) {
+				for (r = 0; r < nregs; r++) {
+					if (regs[r] == memregs[k])
+						taken |= 1u << r;
+				}
+			}
+		}
+
+		for (r = 0; r < nregs; r++) {
+			if (!(taken & (1u << r))) {
+				memregs[best] = regs[r];
+				break;
+			}
+		}
+	}
+
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		if (memregs[k] == SLJIT_SAVED_EREG2 && *nsaveds < 5)
+			*nsaveds = 5;
+		else if (memregs[k] == SLJIT_SAVED_EREG1 && *nsaveds < 4)
+			*nsaveds = 4;
+#ifdef BJ_LDCACHE
+		else if (memregs[k] == BJ_LDCACHE)
+			*nscratches = 5;
+#endif
+	}
+
+	BJ_FREE(maydef, insn_count * sizeof(maydef[0]));
+	BJ_FREE(live, insn_count * sizeof(live[0]));
+	return true;
+}
+
+/*
+ * Size the stack frame. It runs after optimize_memwords().
+ *
+ * Leaf code that doesn't call copfuncs (or mbuf functions in
+ * the kernel) and keeps all M[] words in registers doesn't need
+ * locals. If it doesn't read the packet either, buf and buflen
+ * aren't loaded and BJ_BUFLEN isn't saved.
+ */
+static void
+optimize_frame(struct bpf_insn *insns,
+    const struct bpfjit_insn_data *insn_dat, size_t insn_count,
+    bpfjit_init_mask_t initmask, int ncopfuncs,
+    const int memregs[BPF_MEMWORDS], int *locals, bool *pktregs)
+{
+	bpfjit_init_mask_t use, def, mem;
+	bool pktread;
+	size_t i, k;
+
+	mem = initmask & BJ_INIT_MMASK;
+	pktread = false;
+
+	for (i = 0; i < insn_count; i++) {
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		if (read_pkt_insn(&insns[i], NULL))
+			pktread = true;
+
+		memword_use_def(&insns[i], &insn_dat[i], &use, &def);
+		mem |= use | def;
+	}
+
+	*locals = 0;
+	*pktregs = pktread || ncopfuncs > 0;
+
+	if (ncopfuncs > 0)
+		*locals = sizeof(struct bpfjit_stack);
+
+#ifdef _KERNEL
+	/* emit_xcall() passes &tmp to m_xword() and friends. */
+	if (pktread)
+		*locals = sizeof(struct bpfjit_stack);
+#endif
+
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		if ((mem & BJ_INIT_MBIT(k)) && memregs[k] == SLJIT_UNUSED)
+			*locals = sizeof(struct bpfjit_stack);
+	}
+}
+
+/*
+ * Get BPF_K operand of BPF_JMP instruction or a known value
+ * of BPF_X operand. Return false if the operand isn't known.
+ */
+static bool
+jmp_operand(struct bpf_insn *pc, const struct bpfjit_insn_data *dat,
+    uint32_t *k)
+{
+
+	if (BPF_SRC(pc->code) == BPF_K) {
+		*k = pc->k;
+		return true;
+	}
+
+	if (dat->bj_fold == BJ_FOLD_K) {
+		*k = dat->bj_const;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Add a fact about A known after a jump to jt (n == 0)
+ * or to jf (n == 1) destination of pc.
+ */
+static void
+add_fact(struct bpfjit_facts *f, struct bpf_insn *pc, uint32_t k, int n)
+{
+
+	switch (BPF_OP(pc->code)) {
+	case BPF_JEQ:
+		if (n == 0) {
+			f->bj_lo = f->bj_hi = k;
+		} else if (f->bj_nne < BJ_MAXNE) {
+			f->bj_ne[f->bj_nne++] = k;
+		}
+		break;
+
+	case BPF_JGT:
+		if (n == 0 && k != UINT32_MAX && f->bj_lo <= k)
+			f->bj_lo = k + 1;
+		else if (n == 1 && f->bj_hi > k)
+			f->bj_hi = k;
+		break;
+
+	case BPF_JGE:
+		if (n == 0 && f->bj_lo < k)
+			f->bj_lo = k;
+		else if (n == 1 && k != 0 && f->bj_hi >= k)
+			f->bj_hi = k - 1;
+		break;
+
+	case BPF_JSET:
+		if (n == 1)
+			f->bj_zeros |= k;
+		else if (k != 0 && (k & (k - 1)) == 0)
+			f->bj_ones |= k;
+		break;
+	}
+}
+
+/*
+ * Decide an outcome of BPF_JMP instruction at pc given facts
+ * about A. Return 0 if the jump goes to jt, 1 if it goes to jf
+ * and -1 if it can't be decided.
+ */
+static int
+decide_jmp(const struct bpfjit_facts *f, struct bpf_insn *pc,
+    const struct bpfjit_insn_data *dat)
+{
+	uint32_t k;
+	size_t i;
+
+	if (pc->code == (BPF_JMP|BPF_JA) || dat->bj_fold == BJ_FOLD_JT)
+		return 0;
+	if (dat->bj_fold == BJ_FOLD_JF)
+		return 1;
+
+	if (!jmp_operand(pc, dat, &k))
+		return -1;
+
+	switch (BPF_OP(pc->code)) {
+	case BPF_JEQ:
+		if (f->bj_lo == f->bj_hi)
+			return (f->bj_lo == k) ? 0 : 1;
+		if (k < f->bj_lo || k > f->bj_hi)
+			return 1;
+		if ((k & f->bj_zeros) != 0 || (~k & f->bj_ones) != 0)
+			return 1;
+		for (i = 0; i < f->bj_nne; i++) {
+			if (f->bj_ne[i] == k)
+				return 1;
+		}
+		return -1;
+
+	case BPF_JGT:
+		if (f->bj_lo > k)
+			return 0;
+		if (f->bj_hi <= k)
+			return 1;
+		return -1;
+
+	case BPF_JGE:
+		if (f->bj_lo >= k)
+			return 0;
+		if (f->bj_hi < k)
+			return 1;
+		return -1;
+
+	case BPF_JSET:
+		if (f->bj_lo == f->bj_hi)
+			return (f->bj_lo & k) ? 0 : 1;
+		if (k & f->bj_ones)
+			return 0;
+		if ((k & ~f->bj_zeros) == 0)
+			return 1;
+		return -1;
+	}
+
+	return -1;
+}
+
+/*
+ * Remove jumps of an unreachable BPF_JMP instruction at index i
+ * from bj_jumps lists of its destinations.
+ */
+static void
+remove_jumps(struct bpfjit_insn_data *insn_dat, size_t i)
+{
+	struct bpfjit_jump_data *jdata = &insn_dat[i].bj_aux.bj_jdata;
+	size_t jt, jf;
+
+	jt = i + 1 + jdata->bj_jt;
+	jf = i + 1 + jdata->bj_jf;
+
+	SLIST_REMOVE(&insn_dat[jt].bj_jumps,
+	    &jdata->bj_jtf[0], bpfjit_jump, bj_entries);
+	if (jf != jt) {
+		SLIST_REMOVE(&insn_dat[jf].bj_jumps,
+		    &jdata->bj_jtf[1], bpfjit_jump, bj_entries);
+	}
+}
+
+/*
+ * Jump threading. It runs after optimize_memwords().
+ *
+ * If a jump lands on BPF_JMP instruction and facts about A known
+ * on that edge decide the outcome, the jump is redirected to the
+ * final destination. For instance, a jump taken after A == k is
+ * compared again with k goes straight to the jt destination of the
+ * second comparison. Jumps are redirected by moving bj_jumps nodes
+ * and instructions left without predecessors are marked unreachable.
+ *
+ * A doesn't change between a jump and its destination, so facts
+ * computed by other passes at the final destination still hold.
+ */
+static void
+thread_jumps(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count)
+{
+	struct bpfjit_facts f;
+	struct bpfjit_jump_data *jdata;
+	struct bpf_insn *pc;
+	size_t i, dst, old;
+	uint32_t k, dstk, jt, jf;
+	int n, nedges, outcome;
+	bool cond, reachable;
+
+	for (i = 0; i < insn_count; i++) {
+		pc = &insns[i];
+
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		/* Predecessors may have been redirected or removed. */
+		reachable = (i == 0) ||
+		    !SLIST_EMPTY(&insn_dat[i].bj_jumps) ||
+		    (!insn_dat[i - 1].bj_unreachable &&
+		     BPF_CLASS(insns[i - 1].code) != BPF_RET &&
+		     BPF_CLASS(insns[i - 1].code) != BPF_JMP);
+
+		if (!reachable) {
+			insn_dat[i].bj_unreachable = true;
+			if (BPF_CLASS(pc->code) == BPF_JMP)
+				remove_jumps(insn_dat, i);
+			continue;
+		}
+
+		if (BPF_CLASS(pc->code) != BPF_JMP)
+			continue;
+
+		jdata = &insn_dat[i].bj_aux.bj_jdata;
+		nedges = (jdata->bj_jt == jdata->bj_jf) ? 1 : 2;
+
+		k = 0;
+		cond = nedges == 2 && jmp_operand(pc, &insn_dat[i], &k);
+
+		for (n = 0; n < nedges; n++) {
+			f.bj_lo = 0;
+			f.bj_hi = UINT32_MAX;
+			f.bj_ones = f.bj_zeros = 0;
+			f.bj_nne = 0;
+
+			if (cond)
+				add_fact(&f, pc, k, n);
+
+			old = i + 1 + (n == 0 ? jdata->bj_jt : jdata->bj_jf);
+			dst = old;
+
+			while (BPF_CLASS(insns[dst].code) == BPF_JMP) {
+				outcome = decide_jmp(&f, &insns[dst],
+				    &insn_dat[dst]);
+				if (outcome < 0)
+					break;
+
+				if (jmp_operand(&insns[dst],
+				    &insn_dat[dst], &dstk)) {
+					add_fact(&f, &insns[dst],
+					    dstk, outcome);
+				}
+
+				jt = insn_dat[dst].bj_aux.bj_jdata.bj_jt;
+				jf = insn_dat[dst].bj_aux.bj_jdata.bj_jf;
+				dst += 1 + (outcome == 0 ? jt : jf);
+			}
+
+			if (dst == old)
+				continue;
+
+			SLIST_REMOVE(&insn_dat[old].bj_jumps,
+			    &jdata->bj_jtf[n], bpfjit_jump, bj_entries);
+			SLIST_INSERT_HEAD(&insn_dat[dst].bj_jumps,
+			    &jdata->bj_jtf[n], bj_entries);
+
+			if (nedges == 1 || n == 0)
+				jdata->bj_jt = dst - (i + 1);
+			if (nedges == 1 || n == 1)
+				jdata->bj_jf = dst - (i + 1);
+		}
+	}
+}
+
+/*
+ * Return true if pc returns 0 from the filter.
+ */
+static bool
+ret0_insn(struct bpf_insn *pc, const struct bpfjit_insn_data *dat)
+{
+
+	if (BPF_RVAL(pc->code) == BPF_K)
+		return pc->k == 0;
+
+	return dat->bj_fold == BJ_FOLD_A && dat->bj_const == 0;
+}
+
+/*
+ * Return true if pc changes X.
+ */
+static bool
+x_def_insn(struct bpf_insn *pc)
+{
+
+	return BPF_CLASS(pc->code) == BPF_LDX ||
+	    pc->code == (BPF_MISC|BPF_TAX);
+}
+
+/*
+ * Place packet bounds checks. It runs after thread_jumps().
+ *
+ * A length is anticipated at an instruction if every path from that
+ * instruction reads a packet up to that length or returns 0 before
+ * it calls a copfunc or returns non-zero. A failed check returns 0,
+ * so a check can be hoisted to the first instruction where a length
+ * is anticipated. A read doesn't need a check if every path to it
+ * has already checked a greater or equal length. BJ_MISC_RESULT
+ * ends a program of multi code like BPF_RET, checks don't cross it.
+ *
+ * BPF_LD+BPF_IND loads are checked in two steps. The length check
+ * covers k+width and the index check covers X. Index lengths are
+ * anticipated and checked the same way but X must not change, so
+ * loads that share X share one index check. An index check relies
+ * on the length check, so an index length anticipated at a load is
+ * also required from the length check.
+ *
+ * Skipped loads (see optimize_loads()) don't read a packet.
+ */
+static bool
+optimize_checks(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count)
+{
+	struct bpfjit_checks *chk, cur;
+	struct bpfjit_read_pkt_data *rdata;
+	struct bpf_insn *pc;
+	uint32_t length, jt, jf;
+	size_t i, n;
+
+	chk = BJ_ALLOC(insn_count * sizeof(chk[0]));
+	if (chk == NULL)
+		return false;
+
+	/* Anticipated lengths are computed backwards. */
+	for (i = insn_count; i-- > 0; ) {
+		pc = &insns[i];
+
+		/* Jump offsets of unreachable insns aren't initialized. */
+		if (insn_dat[i].bj_unreachable) {
+			chk[i].bj_ant = chk[i].bj_ant_index = 0;
+			continue;
+		}
+
+		cur.bj_ant = cur.bj_ant_index = 0;
+		if (i + 1 < insn_count)
+			cur = chk[i + 1];
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			cur.bj_ant = ret0_insn(pc, &insn_dat[i]) ? UINT32_MAX : 0;
+			cur.bj_ant_index = cur.bj_ant;
+			break;
+
+		case BPF_JMP:
+			jt = insn_dat[i].bj_aux.bj_jdata.bj_jt;
+			jf = insn_dat[i].bj_aux.bj_jdata.bj_jf;
+			cur = chk[i + 1 + jt];
+			if (chk[i + 1 + jf].bj_ant < cur.bj_ant)
+				cur.bj_ant = chk[i + 1 + jf].bj_ant;
+			if (chk[i + 1 + jf].bj_ant_index < cur.bj_ant_index)
+				cur.bj_ant_index = chk[i + 1 + jf].bj_ant_index;
+			break;
+
+		case BPF_MISC:
+			if (pc->code == (BPF_MISC|BPF_COP) ||
+			    pc->code == (BPF_MISC|BPF_COPX)) {
+				cur.bj_ant = cur.bj_ant_index = 0;
+			}
+			if (pc->code == (BPF_MISC|BJ_MISC_RESULT)) {
+				cur.bj_ant = (pc->jf == 0 && pc->k == 0) ?
+				    UINT32_MAX : 0;
+				cur.bj_ant_index = cur.bj_ant;
+			}
+			break;
+		}
+
+		if (x_def_insn(pc))
+			cur.bj_ant_index = 0;
+
+		if (read_pkt_insn(pc, &length) &&
+		    (insn_dat[i].bj_aux.bj_rdata.bj_vn &
+		    (BJ_VN_SKIP|BJ_VN_FROM_CACHE)) == 0) {
+			if (length > cur.bj_ant)
+				cur.bj_ant = length;
+			if (BPF_MODE(pc->code) == BPF_IND &&
+			    length > cur.bj_ant_index) {
+				cur.bj_ant_index = length;
+			}
+		}
+
+		chk[i].bj_ant = cur.bj_ant;
+		chk[i].bj_ant_index = cur.bj_ant_index;
+	}
+
+	/* Checked lengths are propagated forward. */
+	for (i = 0; i < insn_count; i++)
+		chk[i].bj_len = chk[i].bj_index = UINT32_MAX;
+	chk[0].bj_len = chk[0].bj_index = 0;
+
+	for (i = 0; i < insn_count; i++) {
+		pc = &insns[i];
+
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		cur = chk[i];
+
+		if (read_pkt_insn(pc, &length)) {
+			rdata = &insn_dat[i].bj_aux.bj_rdata;
+			rdata->bj_check_length = 0;
+			rdata->bj_check_index = 0;
+
+			if (rdata->bj_vn & (BJ_VN_SKIP|BJ_VN_FROM_CACHE))
+				length = 0;
+
+			if (BPF_MODE(pc->code) == BPF_IND &&
+			    length > cur.bj_index) {
+				rdata->bj_check_index = cur.bj_ant_index;
+				cur.bj_index = cur.bj_ant_index;
+				length = cur.bj_ant_index;
+			}
+
+			if (length > cur.bj_len) {
+				rdata->bj_check_length = cur.bj_ant;
+				cur.bj_len = cur.bj_ant;
+			}
+		}
+
+		if (x_def_insn(pc) ||
+		    pc->code == (BPF_MISC|BPF_COP) ||
+		    pc->code == (BPF_MISC|BPF_COPX)) {
+			cur.bj_index = 0;
+		}
+
+		/* A failed check continues with the next program. */
+		if (pc->code == (BPF_MISC|BJ_MISC_RESULT))
+			cur.bj_len = cur.bj_index = 0;
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			n = 0;
+			break;
+
+		case BPF_JMP:
+			jt = insn_dat[i].bj_aux.bj_jdata.bj_jt;
+			jf = insn_dat[i].bj_aux.bj_jdata.bj_jf;
+			n = i + 1 + jt;
+			if (cur.bj_len < chk[n].bj_len)
+				chk[n].bj_len = cur.bj_len;
+			if (cur.bj_index < chk[n].bj_index)
+				chk[n].bj_index = cur.bj_index;
+			n = i + 1 + jf;
+			break;
+
+		default:
+			n = i + 1;
+			break;
+		}
+
+		if (n > 0 && n < insn_count) {
+			if (cur.bj_len < chk[n].bj_len)
+				chk[n].bj_len = cur.bj_len;
+			if (cur.bj_index < chk[n].bj_index)
+				chk[n].bj_index = cur.bj_index;
+		}
+	}
+
+	BJ_FREE(chk, insn_count * sizeof(chk[0]));
+	return true;
+}
+
+/*
+ * Keep buf+X in BJ_XBUF after BPF_LDX+BPF_MSH instructions. They're
+ * the first half of "ldxb 4*([k]&0xf); ldh [x+k2]" idiom that reads
+ * transport headers. BPF_LD+BPF_IND loads read at BJ_XBUF+k rather
+ * than compute X+k first, if X is set by BPF_LDX+BPF_MSH on every
+ * path to the load and neither X nor BJ_XBUF change on the way.
+ * Bounds checks of these loads are placed by optimize_checks().
+ * It runs after optimize_memwords().
+ */
+static bool
+optimize_msh(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count,
+    bool ldcache, const int memregs[BPF_MEMWORDS], int *nscratches)
+{
+#ifdef BJ_XBUF
+	struct bpf_insn *pc;
+	bool *valid, cur, used;
+	uint32_t jt, jf;
+	size_t i, k;
+
+	if (ldcache)
+		return true;
+
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		if (memregs[k] == BJ_XBUF)
+			return true;
+	}
+
+	valid = BJ_ALLOC(insn_count * sizeof(valid[0]));
+	if (valid == NULL)
+		return false;
+
+	for (i = 0; i < insn_count; i++)
+		valid[i] = true;
+	valid[0] = false;
+
+	used = false;
+	for (i = 0; i < insn_count; i++) {
+		pc = &insns[i];
+
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		cur = valid[i];
+
+		if (pc->code == (BPF_LD|BPF_IND|BPF_W) ||
+		    pc->code == (BPF_LD|BPF_IND|BPF_H) ||
+		    pc->code == (BPF_LD|BPF_IND|BPF_B)) {
+			insn_dat[i].bj_aux.bj_rdata.bj_xbuf =
+			    cur && !insn_dat[i].bj_dead;
+			used = used || insn_dat[i].bj_aux.bj_rdata.bj_xbuf;
+		}
+
+		if (pc->code == (BPF_LDX|BPF_B|BPF_MSH)) {
+			insn_dat[i].bj_aux.bj_rdata.bj_xbuf = false;
+			cur = !insn_dat[i].bj_dead;
+		} else if (x_def_insn(pc) ||
+		    pc->code == (BPF_MISC|BPF_COP) ||
+		    pc->code == (BPF_MISC|BPF_COPX)) {
+			cur = false;
+		}
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			break;
+
+		case BPF_JMP:
+			jt = insn_dat[i].bj_aux.bj_jdata.bj_jt;
+			jf = insn_dat[i].bj_aux.bj_jdata.bj_jf;
+			valid[i + 1 + jt] = valid[i + 1 + jt] && cur;
+			valid[i + 1 + jf] = valid[i + 1 + jf] && cur;
+			break;
+
+		default:
+			if (i + 1 < insn_count)
+				valid[i + 1] = valid[i + 1] && cur;
+			break;
+		}
+	}
+
+	/* Every BPF_LDX+BPF_MSH sets BJ_XBUF if any load needs it. */
+	for (i = 0; used && i < insn_count; i++) {
+		if (insns[i].code == (BPF_LDX|BPF_B|BPF_MSH) &&
+		    !insn_dat[i].bj_unreachable && !insn_dat[i].bj_dead) {
+			insn_dat[i].bj_aux.bj_rdata.bj_xbuf = true;
+		}
+	}
+
+	if (used)
+		*nscratches = 5;
+
+	BJ_FREE(valid, insn_count * sizeof(valid[0]));
+#endif
+	return true;
+}
+
+/*
+ * Return true if pc can be a case of a switch.
+ */
+static bool
+case_insn(struct bpf_insn *pc, const struct bpfjit_insn_data *dat)
+{
+
+	return pc->code == (BPF_JMP|BPF_JEQ|BPF_K) &&
+	    !dat->bj_unreachable && dat->bj_fold == BJ_FOLD_NONE &&
+	    dat->bj_aux.bj_jdata.bj_jt != dat->bj_aux.bj_jdata.bj_jf;
+}
+
+/*
+ * Find ladders of BPF_JMP+BPF_JEQ+BPF_K instructions that compare A
+ * with different constants. Each instruction in a ladder except the
+ * first one is a jf destination of the previous instruction and it
+ * has no other predecessors, including the instruction before it. The whole ladder is compiled at its head
+ * as a balanced tree of comparisons, see emit_switch().
+ * It runs after thread_jumps().
+ */
+static void
+optimize_switch(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count, int *nscratches)
+{
+	struct bpfjit_jump_data *jdata;
+	struct bpfjit_jump *jmp;
+	size_t i, m, next;
+	uint32_t n;
+
+	for (i = 0; i < insn_count; i++) {
+		if (BPF_CLASS(insns[i].code) == BPF_JMP &&
+		    !insn_dat[i].bj_unreachable) {
+			insn_dat[i].bj_aux.bj_jdata.bj_ncases = 0;
+			insn_dat[i].bj_aux.bj_jdata.bj_case = false;
+		}
+	}
+
+	for (i = 0; i < insn_count; i++) {
+		if (!case_insn(&insns[i], &insn_dat[i]) ||
+		    insn_dat[i].bj_aux.bj_jdata.bj_case) {
+			continue;
+		}
+
+		n = 1;
+		for (m = i; n < BJ_MAXCASES; m = next, n++) {
+			jdata = &insn_dat[m].bj_aux.bj_jdata;
+			next = m + 1 + jdata->bj_jf;
+			if (!case_insn(&insns[next], &insn_dat[next]))
+				break;
+
+			jmp = SLIST_FIRST(&insn_dat[next].bj_jumps);
+			if (jmp != &jdata->bj_jtf[1] ||
+			    SLIST_NEXT(jmp, bj_entries) != NULL) {
+				break;
+			}
+
+			/* bj_jumps doesn't list fall-through predecessors. */
+			if (next != m + 1 &&
+			    BPF_CLASS(insns[next - 1].code) != BPF_RET &&
+			    BPF_CLASS(insns[next - 1].code) != BPF_JMP &&
+			    !insn_dat[next - 1].bj_unreachable) {
+				break;
+			}
+		}
+
+		if (n < BJ_MINCASES)
+			continue;
+
+		insn_dat[i].bj_aux.bj_jdata.bj_ncases = n;
+		for (m = i; --n > 0; ) {
+			m += 1 + insn_dat[m].bj_aux.bj_jdata.bj_jf;
+			insn_dat[m].bj_aux.bj_jdata.bj_case = true;
+		}
+
+		/* bit tests use BJ_TMP1REG and BJ_TMP2REG */
+		if (*nscratches < 3)
+			*nscratches = 3;
+	}
+}
+
+/*
+ * Return true if pc and pc2 return the same value.
+ */
+static bool
+same_ret_insns(struct bpf_insn *pc, const struct bpfjit_insn_data *dat,
+    struct bpf_insn *pc2, const struct bpfjit_insn_data *dat2)
+{
+	bool const1, const2;
+
+	const1 = BPF_RVAL(pc->code) == BPF_K || dat->bj_fold == BJ_FOLD_A;
+	const2 = BPF_RVAL(pc2->code) == BPF_K || dat2->bj_fold == BJ_FOLD_A;
+
+	if (const1 != const2)
+		return false;
+
+	if (!const1)
+		return BPF_RVAL(pc->code) == BPF_RVAL(pc2->code);
+
+	return (BPF_RVAL(pc->code) == BPF_K ? pc->k : dat->bj_const) ==
+	    (BPF_RVAL(pc2->code) == BPF_K ? pc2->k : dat2->bj_const);
+}
+
+/*
+ * Return true if code generated for the instruction at index i
+ * may continue with code of the next instruction.
+ */
+static bool
+fallthru_insn(struct bpf_insn *insns,
+    const struct bpfjit_insn_data *insn_dat, size_t i)
+{
+	const struct bpfjit_jump_data *jdata;
+
+	if (insn_dat[i].bj_unreachable)
+		return false;
+
+	switch (BPF_CLASS(insns[i].code)) {
+	case BPF_RET:
+		return false;
+
+	case BPF_JMP:
+		jdata = &insn_dat[i].bj_aux.bj_jdata;
+		if (jdata->bj_case || jdata->bj_ncases > 0)
+			return true;
+
+		return jdata->bj_jt == 0 || jdata->bj_jf == 0;
+
+	default:
+		return true;
+	}
+}
+
+/*
+ * Share return code between BPF_RET instructions that return the
+ * same value. It runs last, after optimize_switch().
+ *
+ * The first instruction that returns a value emits the epilogue,
+ * other instructions only redirect jumps to it. All "return 0"
+ * instructions jump to the epilogue at the end of a generated
+ * function which is also a target of out-of-bounds jumps.
+ */
+static void
+optimize_returns(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count)
+{
+	struct bpfjit_ret_data *rdata;
+	size_t i, j, last;
+
+	last = 0;
+	for (i = 0; i < insn_count; i++) {
+		if (!insn_dat[i].bj_unreachable)
+			last = i;
+	}
+
+	for (i = 0; i < insn_count; i++) {
+		if (BPF_CLASS(insns[i].code) != BPF_RET ||
+		    insn_dat[i].bj_unreachable) {
+			continue;
+		}
+
+		rdata = &insn_dat[i].bj_aux.bj_retdata;
+		rdata->bj_label = NULL;
+		rdata->bj_fallthru =
+		    i > 0 && fallthru_insn(insns, insn_dat, i - 1);
+
+		if (ret0_insn(&insns[i], &insn_dat[i])) {
+			rdata->bj_shared = SIZE_MAX;
+
+			/* The epilogue is right after the last instruction. */
+			if (i == last)
+				rdata->bj_fallthru = false;
+			continue;
+		}
+
+		rdata->bj_shared = i;
+		for (j = 0; j < i; j++) {
+			if (BPF_CLASS(insns[j].code) == BPF_RET &&
+			    !insn_dat[j].bj_unreachable &&
+			    insn_dat[j].bj_aux.bj_retdata.bj_shared == j &&
+			    same_ret_insns(&insns[i], &insn_dat[i],
+			    &insns[j], &insn_dat[j])) {
+				rdata->bj_shared = j;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Return true if pc is BPF_RET with a known value and store
+ * the value in *val.
+ */
+static bool
+ret_value(struct bpf_insn *pc, const struct bpfjit_insn_data *dat,
+    uint32_t *val)
+{
+
+	if (BPF_CLASS(pc->code) != BPF_RET)
+		return false;
+
+	if (BPF_RVAL(pc->code) == BPF_K) {
+		*val = pc->k;
+		return true;
+	}
+
+	if (dat->bj_fold == BJ_FOLD_A) {
+		*val = dat->bj_const;
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Check that every reachable BPF_RET of a predicate returns a known
+ * value, see bpfjit_generate_predicate(). Folded values of BPF_RET+BPF_A
+ * are converted to 0 or 1, the caller converts BPF_RET+BPF_K.
+ */
+static bool
+check_predicate(struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t insn_count)
+{
+	size_t i;
+	uint32_t val;
+
+	for (i = 0; i < insn_count; i++) {
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		if (BPF_CLASS(insns[i].code) != BPF_RET)
+			continue;
+
+		if (!ret_value(&insns[i], &insn_dat[i], &val))
+			return false;
+
+		if (BPF_RVAL(insns[i].code) == BPF_A)
+			insn_dat[i].bj_const = (val != 0);
+	}
+
+	return true;
+}
+
+/*
+ * Return jt destination of a case.
+ */
+static size_t
+case_target(struct bpfjit_insn_data *insn_dat, const struct bpfjit_case *c)
+{
+
+	return c->bj_insn + 1 + insn_dat[c->bj_insn].bj_aux.bj_jdata.bj_jt;
+}
+
+/*
+ * Emit comparisons for cases [lo, hi) sorted by key. A jump to
+ * a jt destination of a case is stored in bj_jtf[0] of the case.
+ * Jumps taken when A doesn't match any case are appended to misses.
+ */
+static int
+emit_cases(struct sljit_compiler* compiler, struct bpfjit_insn_data *insn_dat,
+    const struct bpfjit_case *cases, size_t lo, size_t hi,
+    struct sljit_jump **misses, size_t *nmisses)
+{
+	struct bpfjit_jump *jtf;
+	struct sljit_jump *jump;
+	struct sljit_label *label;
+	uint32_t mask;
+	size_t c, mid;
+	int status;
+	bool bittest;
+
+	/*
+	 * Close keys with a common destination are tested
+	 * with one bit test: 1 << (A - lo) & mask.
+	 */
+	bittest = hi - lo >= 3 && cases[hi - 1].bj_key - cases[lo].bj_key < 32;
+	for (c = lo + 1; bittest && c < hi; c++) {
+		if (case_target(insn_dat, &cases[c]) !=
+		    case_target(insn_dat, &cases[lo])) {
+			bittest = false;
+		}
+	}
+
+	if (bittest) {
+		mask = 0;
+		for (c = lo; c < hi; c++)
+			mask |= UINT32_C(1) << (cases[c].bj_key - cases[lo].bj_key);
+
+		status = sljit_emit_op2(compiler,
+		    SLJIT_SUB,
+		    BJ_TMP1REG, 0,
+		    BJ_AREG, 0,
+		    SLJIT_IMM, cases[lo].bj_key);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		jump = sljit_emit_cmp(compiler,
+		    SLJIT_C_GREATER|SLJIT_INT_OP,
+		    BJ_TMP1REG, 0,
+		    SLJIT_IMM, cases[hi - 1].bj_key - cases[lo].bj_key);
+		if (jump == NULL)
+			return SLJIT_ERR_ALLOC_FAILED;
+		misses[(*nmisses)++] = jump;
+
+		status = sljit_emit_op2(compiler,
+		    SLJIT_SHL|SLJIT_INT_OP,
+		    BJ_TMP2REG, 0,
+		    SLJIT_IMM, 1,
+		    BJ_TMP1REG, 0);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		status = sljit_emit_op2(compiler,
+		    SLJIT_AND,
+		    BJ_TMP2REG, 0,
+		    BJ_TMP2REG, 0,
+		    SLJIT_IMM, mask);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		jump = sljit_emit_cmp(compiler,
+		    SLJIT_C_NOT_EQUAL,
+		    BJ_TMP2REG, 0,
+		    SLJIT_IMM, 0);
+		if (jump == NULL)
+			return SLJIT_ERR_ALLOC_FAILED;
+
+		jtf = insn_dat[cases[lo].bj_insn].bj_aux.bj_jdata.bj_jtf;
+		BJ_ASSERT(jtf[0].bj_jump == NULL);
+		jtf[0].bj_jump = jump;
+	} else if (hi - lo <= BJ_LINEARCASES) {
+		for (c = lo; c < hi; c++) {
+			jump = sljit_emit_cmp(compiler,
+			    SLJIT_C_EQUAL|SLJIT_INT_OP,
+			    BJ_AREG, 0,
+			    SLJIT_IMM, cases[c].bj_key);
+			if (jump == NULL)
+				return SLJIT_ERR_ALLOC_FAILED;
+
+			jtf = insn_dat[cases[c].bj_insn].bj_aux.bj_jdata.bj_jtf;
+			BJ_ASSERT(jtf[0].bj_jump == NULL);
+			jtf[0].bj_jump = jump;
+		}
+	} else {
+		mid = lo + (hi - lo) / 2;
+
+		jump = sljit_emit_cmp(compiler,
+		    SLJIT_C_LESS|SLJIT_INT_OP,
+		    BJ_AREG, 0,
+		    SLJIT_IMM, cases[mid].bj_key);
+		if (jump == NULL)
+			return SLJIT_ERR_ALLOC_FAILED;
+
+		status = emit_cases(compiler, insn_dat,
+		    cases, mid, hi, misses, nmisses);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		label = sljit_emit_label(compiler);
+		if (label == NULL)
+			return SLJIT_ERR_ALLOC_FAILED;
+		sljit_set_label(jump, label);
+
+		return emit_cases(compiler, insn_dat,
+		    cases, lo, mid, misses, nmisses);
+	}
+
+	jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	misses[(*nmisses)++] = jump;
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Emit a switch that starts at index head, see optimize_switch().
+ */
+static int
+emit_switch(struct sljit_compiler* compiler, struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t head)
+{
+	struct bpfjit_case *cases, tmp;
+	struct sljit_jump **misses;
+	struct sljit_jump *jump;
+	struct sljit_label *label;
+	struct bpfjit_jump_data *jdata;
+	size_t c, d, n, ncases, nmisses, m, last;
+	int status;
+
+	n = insn_dat[head].bj_aux.bj_jdata.bj_ncases;
+
+	cases = BJ_ALLOC(n * sizeof(cases[0]));
+	if (cases == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	/* A leaf of the tree with k cases has at most k misses. */
+	misses = BJ_ALLOC(n * sizeof(misses[0]));
+	if (misses == NULL) {
+		BJ_FREE(cases, n * sizeof(cases[0]));
+		return SLJIT_ERR_ALLOC_FAILED;
+	}
+
+	/* Insertion sort by key, the first case of equal keys wins. */
+	ncases = 0;
+	last = head;
+	for (c = 0, m = head; c < n; c++) {
+		last = m;
+		tmp.bj_key = insns[m].k;
+		tmp.bj_insn = m;
+		m += 1 + insn_dat[m].bj_aux.bj_jdata.bj_jf;
+
+		for (d = ncases; d > 0 && cases[d - 1].bj_key > tmp.bj_key; d--)
+			continue;
+		if (d > 0 && cases[d - 1].bj_key == tmp.bj_key)
+			continue;
+
+		memmove(&cases[d + 1], &cases[d],
+		    (ncases - d) * sizeof(cases[0]));
+		cases[d] = tmp;
+		ncases++;
+	}
+
+	nmisses = 0;
+	status = emit_cases(compiler, insn_dat,
+	    cases, 0, ncases, misses, &nmisses);
+	if (status != SLJIT_SUCCESS)
+		goto out;
+
+	label = sljit_emit_label(compiler);
+	if (label == NULL) {
+		status = SLJIT_ERR_ALLOC_FAILED;
+		goto out;
+	}
+
+	for (c = 0; c < nmisses; c++)
+		sljit_set_label(misses[c], label);
+
+	/* Jump to jf destination of the last case. */
+	jdata = &insn_dat[last].bj_aux.bj_jdata;
+	if (last + 1 + jdata->bj_jf != head + 1) {
+		jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+		if (jump == NULL) {
+			status = SLJIT_ERR_ALLOC_FAILED;
+			goto out;
+		}
+
+		BJ_ASSERT(jdata->bj_jtf[1].bj_jump == NULL);
+		jdata->bj_jtf[1].bj_jump = jump;
+	}
+
+out:
+	BJ_FREE(misses, n * sizeof(misses[0]));
+	BJ_FREE(cases, n * sizeof(cases[0]));
+	return status;
+}
+
+/*
+ * Set *op and *opw to sljit operand of M[k].
+ */
+static void
+memword_operand(const int memregs[BPF_MEMWORDS], uint32_t k,
+    int *op, sljit_sw *opw)
+{
+
+	if (memregs[k] != SLJIT_UNUSED) {
+		*op = memregs[k];
+		*opw = 0;
+	} else {
+		*op = SLJIT_MEM1(SLJIT_LOCALS_REG);
+		*opw = offsetof(struct bpf_state, mem) + k * sizeof(uint32_t);
+	}
+}
+
+/*
+ * Copy M[k] words in mask between registers and bpf_state.
+ */
+static int
+emit_memword_copy(struct sljit_compiler* compiler,
+    const int memregs[BPF_MEMWORDS], bpfjit_init_mask_t mask, bool spill)
+{
+	int status;
+	size_t k;
+	const sljit_sw off = offsetof(struct bpf_state, mem);
+
+	for (k = 0; k < BPF_MEMWORDS; k++) {
+		if (!(mask & BJ_INIT_MBIT(k)) || memregs[k] == SLJIT_UNUSED)
+			continue;
+
+		if (spill) {
+			status = sljit_emit_op1(compiler,
+			    SLJIT_MOV_UI,
+			    SLJIT_MEM1(SLJIT_LOCALS_REG),
+			    off + k * sizeof(uint32_t),
+			    memregs[k], 0);
+		} else {
+			status = sljit_emit_op1(compiler,
+			    SLJIT_MOV_UI,
+			    memregs[k], 0,
+			    SLJIT_MEM1(SLJIT_LOCALS_REG),
+			    off + k * sizeof(uint32_t));
+		}
+
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Convert BPF_ALU operations except BPF_NEG, BPF_DIV and BPF_MOD
+ * to sljit operation.
+ */
+static int
+bpf_alu_to_sljit_op(struct bpf_insn *pc)
+{
+
+	/*
+	 * Note: all supported 64bit arches have 32bit multiply
+	 * instruction so SLJIT_INT_OP doesn't have any overhead.
+	 */
+	switch (BPF_OP(pc->code)) {
+	case BPF_ADD: return SLJIT_ADD;
+	case BPF_SUB: return SLJIT_SUB;
+	case BPF_MUL: return SLJIT_MUL|SLJIT_INT_OP;
+	case BPF_OR:  return SLJIT_OR;
+	case BPF_AND: return SLJIT_AND;
+	case BPF_LSH: return SLJIT_SHL;
+	case BPF_RSH: return SLJIT_LSHR|SLJIT_INT_OP;
+	default:
+		BJ_ASSERT(false);
+		return 0;
+	}
+}
+
+/*
+ * Convert BPF_JMP operations except BPF_JA to sljit condition.
+ */
+static int
+bpf_jmp_to_sljit_cond(struct bpf_insn *pc, bool negate)
+{
+	/*
+	 * Note: all supported 64bit arches have 32bit comparison
+	 * instructions so SLJIT_INT_OP doesn't have any overhead.
+	 */
+	int rv = SLJIT_INT_OP;
+
+	switch (BPF_OP(pc->code)) {
+	case BPF_JGT:
+		rv |= negate ? SLJIT_C_LESS_EQUAL : SLJIT_C_GREATER;
+		break;
+	case BPF_JGE:
+		rv |= negate ? SLJIT_C_LESS : SLJIT_C_GREATER_EQUAL;
+		break;
+	case BPF_JEQ:
+		rv |= negate ? SLJIT_C_NOT_EQUAL : SLJIT_C_EQUAL;
+		break;
+	case BPF_JSET:
+		rv |= negate ? SLJIT_C_EQUAL : SLJIT_C_NOT_EQUAL;
+		break;
+	default:
+		BJ_ASSERT(false);
+	}
+
+	return rv;
+}
+
+/*
+ * Redirect jumps to BPF_RET instruction at index i to the shared
+ * return code, see optimize_returns().
+ */
+static int
+emit_shared_return(struct sljit_compiler* compiler,
+    struct bpfjit_insn_data *insn_dat, size_t i,
+    struct sljit_jump ***ret0, size_t *ret0_size, size_t *ret0_maxsize)
+{
+	struct bpfjit_ret_data *rdata;
+	struct bpfjit_jump *bjump;
+	struct sljit_label *label;
+	struct sljit_jump *jump;
+
+	rdata = &insn_dat[i].bj_aux.bj_retdata;
+	label = NULL;
+	if (rdata->bj_shared != SIZE_MAX) {
+		label = insn_dat[rdata->bj_shared].bj_aux.bj_retdata.bj_label;
+		BJ_ASSERT(label != NULL);
+	}
+
+	SLIST_FOREACH(bjump, &insn_dat[i].bj_jumps, bj_entries) {
+		jump = bjump->bj_jump;
+		if (jump == NULL)
+			continue;
+
+		if (label != NULL)
+			sljit_set_label(jump, label);
+		else if (!append_jump(jump, ret0, ret0_size, ret0_maxsize))
+			return SLJIT_ERR_ALLOC_FAILED;
+	}
+
+	if (!rdata->bj_fallthru)
+		return SLJIT_SUCCESS;
+
+	jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	if (label != NULL)
+		sljit_set_label(jump, label);
+	else if (!append_jump(jump, ret0, ret0_size, ret0_maxsize))
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Operands of BPF_JMP at index i fused with previous instructions,
+ * see fuse_insn(). Set cond to the condition of the jump (negated
+ * if negate is set), set test if the condition is (A & k) != 0 or
+ * (A & k) == 0 rather than a comparison with k. Return the fused
+ * packet load or NULL.
+ */
+static struct bpf_insn *
+fused_jump_operands(struct bpf_insn *insns,
+    const struct bpfjit_insn_data *insn_dat, size_t i, int negate,
+    int *cond, bool *test, uint32_t *k)
+{
+	struct bpf_insn *pc = &insns[i];
+
+	BJ_ASSERT(i > 0 && insn_dat[i - 1].bj_fuse);
+
+	if (BPF_CLASS(insns[i - 1].code) == BPF_ALU) {
+		/* (A & k) == 0 */
+		*test = true;
+		*k = insns[i - 1].k;
+		*cond = negate ? SLJIT_C_NOT_ZERO : SLJIT_C_ZERO;
+		if (i > 1 && insn_dat[i - 2].bj_fuse)
+			return &insns[i - 2];
+		return NULL;
+	} else if (BPF_OP(pc->code) == BPF_JSET) {
+		/* (A & k) != 0 */
+		*test = true;
+		*k = pc->k;
+		*cond = negate ? SLJIT_C_ZERO : SLJIT_C_NOT_ZERO;
+		return &insns[i - 1];
+	} else {
+		*test = false;
+		*k = pc->k;
+		*cond = bpf_jmp_to_sljit_cond(pc, negate);
+		return &insns[i - 1];
+	}
+}
+
+/*
+ * Set src to the operand of a fused jump, either A or a packet word
+ * read by the fused load ld. Convert k to the packet order if needed.
+ */
+static int
+emit_fused_operand(struct sljit_compiler* compiler, struct bpf_insn *ld,
+    uint32_t *k, int *src, sljit_sw *srcw)
+{
+#if BJ_UNALIGNED_LOADS
+	int status;
+	uint32_t width;
+#endif
+
+	*src = BJ_AREG;
+	*srcw = 0;
+
+	if (ld == NULL)
+		return SLJIT_SUCCESS;
+
+#if BJ_UNALIGNED_LOADS
+	width = read_width(ld);
+	if (width == 2)
+		*k &= UINT16_MAX;
+	*k = pkt_order(*k, width);
+
+	*src = SLJIT_MEM1(BJ_BUF);
+	*srcw = ld->k;
+
+	if (width == 2) {
+		/* tmp1 = *(uint16_t *)&buf[k]; */
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV_UH,
+		    BJ_TMP1REG, 0,
+		    *src, *srcw);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		*src = BJ_TMP1REG;
+		*srcw = 0;
+	}
+
+	return SLJIT_SUCCESS;
+#else
+	BJ_ASSERT(false);
+	return SLJIT_ERR_UNSUPPORTED;
+#endif
+}
+
+/*
+ * Generate code for BPF_JMP at index i and instructions fused with it,
+ * see fuse_insn(). Return a jump taken when the condition is true
+ * (or when it's false if negate is set).
+ */
+static struct sljit_jump *
+emit_fused_jump(struct sljit_compiler* compiler, struct bpf_insn *insns,
+    const struct bpfjit_insn_data *insn_dat, size_t i, int negate)
+{
+	int status;
+	int src, cond;
+	sljit_sw srcw;
+	uint32_t k;
+	bool test;
+	struct bpf_insn *ld;
+
+	ld = fused_jump_operands(insns, insn_dat, i, negate,
+	    &cond, &test, &k);
+
+	status = emit_fused_operand(compiler, ld, &k, &src, &srcw);
+	if (status != SLJIT_SUCCESS)
+		return NULL;
+
+	if (!test) {
+		return sljit_emit_cmp(compiler,
+		    cond,
+		    src, srcw,
+		    SLJIT_IMM, k);
+	}
+
+	/* test src, k */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_AND|SLJIT_INT_OP|SLJIT_SET_E,
+	    SLJIT_UNUSED, 0,
+	    src, srcw,
+	    SLJIT_IMM, k);
+	if (status != SLJIT_SUCCESS)
+		return NULL;
+
+	return sljit_emit_jump(compiler, cond);
+}
+
+/*
+ * Convert BPF_K and BPF_X to sljit register.
+ */
+static int
+kx_to_reg(struct bpf_insn *pc)
+{
+
+	switch (BPF_SRC(pc->code)) {
+	case BPF_K: return SLJIT_IMM;
+	case BPF_X: return BJ_XREG;
+	default:
+		BJ_ASSERT(false);
+		return 0;
+	}
+}
+
+static sljit_sw
+kx_to_reg_arg(struct bpf_insn *pc)
+{
+
+	switch (BPF_SRC(pc->code)) {
+	case BPF_K: return (uint32_t)pc->k; /* SLJIT_IMM, pc->k, */
+	case BPF_X: return 0;               /* BJ_XREG, 0,      */
+	default:
+		BJ_ASSERT(false);
+		return 0;
+	}
+}
+
+/*
+ * Generate code for BPF_JMP instruction pc at index i, pc may be
+ * a folded copy of insns[i]. Return a jump taken when the condition
+ * is true (or when it's false if negate is set).
+ */
+static struct sljit_jump *
+emit_cond_jump(struct sljit_compiler* compiler, struct bpf_insn *insns,
+    const struct bpfjit_insn_data *insn_dat, size_t i,
+    struct bpf_insn *pc, int negate)
+{
+	int status;
+
+	if (i > 0 && insn_dat[i - 1].bj_fuse)
+		return emit_fused_jump(compiler, insns, insn_dat, i, negate);
+
+	if (BPF_OP(pc->code) != BPF_JSET) {
+		return sljit_emit_cmp(compiler,
+		    bpf_jmp_to_sljit_cond(pc, negate),
+		    BJ_AREG, 0,
+		    kx_to_reg(pc), kx_to_reg_arg(pc));
+	}
+
+	status = sljit_emit_op2(compiler,
+	    SLJIT_AND,
+	    BJ_TMP1REG, 0,
+	    BJ_AREG, 0,
+	    kx_to_reg(pc), kx_to_reg_arg(pc));
+	if (status != SLJIT_SUCCESS)
+		return NULL;
+
+	return sljit_emit_cmp(compiler,
+	    bpf_jmp_to_sljit_cond(pc, negate),
+	    BJ_TMP1REG, 0,
+	    SLJIT_IMM, 0);
+}
+
+/*
+ * Generate "return cond;" for BPF_JMP instruction pc at index i of
+ * a predicate, see check_predicate(). Both targets of the jump
+ * return, the jt target accepts a packet (rejects if negate is set).
+ */
+static int
+emit_predicate_return(struct sljit_compiler* compiler,
+    struct bpf_insn *insns, const struct bpfjit_insn_data *insn_dat,
+    size_t i, struct bpf_insn *pc, int negate)
+{
+	int status;
+	int src, src2, cond;
+	sljit_sw srcw, src2w;
+	uint32_t k;
+	bool test;
+	struct bpf_insn *ld;
+
+	if (i > 0 && insn_dat[i - 1].bj_fuse) {
+		ld = fused_jump_operands(insns, insn_dat, i, negate,
+		    &cond, &test, &k);
+
+		status = emit_fused_operand(compiler, ld, &k, &src, &srcw);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		src2 = SLJIT_IMM;
+		src2w = k;
+	} else {
+		test = BPF_OP(pc->code) == BPF_JSET;
+		cond = bpf_jmp_to_sljit_cond(pc, negate);
+		src = BJ_AREG;
+		srcw = 0;
+		src2 = kx_to_reg(pc);
+		src2w = kx_to_reg_arg(pc);
+	}
+
+	status = sljit_emit_op2(compiler,
+	    test ? SLJIT_AND|SLJIT_INT_OP|SLJIT_SET_E :
+	    SLJIT_SUB|SLJIT_INT_OP|SLJIT_SET_E|SLJIT_SET_U,
+	    SLJIT_UNUSED, 0,
+	    src, srcw,
+	    src2, src2w);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op_flags(compiler,
+	    SLJIT_MOV,
+	    BJ_AREG, 0,
+	    SLJIT_UNUSED, 0,
+	    cond & ~SLJIT_INT_OP);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	return sljit_emit_return(compiler,
+	    SLJIT_MOV_UI,
+	    BJ_AREG, 0);
+}
+
+/*
+ * Generate "(*counter)++".
+ */
+static int
+emit_count(struct sljit_compiler* compiler, size_t *counter)
+{
+
+	return sljit_emit_op2(compiler,
+	    SLJIT_ADD,
+	    SLJIT_MEM0(), (sljit_sw)counter,
+	    SLJIT_MEM0(), (sljit_sw)counter,
+	    SLJIT_IMM, 1);
+}
+
+/*
+ * Like emit_cond_jump() but also count taken edges in counts[2*i]
+ * (jt) and counts[2*i+1] (jf). Both edges end with a jump, there
+ * is no fall-through.
+ */
+static int
+emit_profiled_jump(struct sljit_compiler* compiler, struct bpf_insn *insns,
+    struct bpfjit_insn_data *insn_dat, size_t i,
+    struct bpf_insn *pc, size_t *counts)
+{
+	struct bpfjit_jump *jtf;
+	struct sljit_jump *jump;
+	struct sljit_label *label;
+	uint32_t jt, jf;
+	int status;
+
+	jt = insn_dat[i].bj_aux.bj_jdata.bj_jt;
+	jf = insn_dat[i].bj_aux.bj_jdata.bj_jf;
+	jtf = insn_dat[i].bj_aux.bj_jdata.bj_jtf;
+
+	if (jt == jf) {
+		/* BPF_JA or a jump decided by optimize_consts(). */
+		status = emit_count(compiler, &counts[2 * i +
+		    (insn_dat[i].bj_fold == BJ_FOLD_JF ? 1 : 0)]);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+		if (jump == NULL)
+			return SLJIT_ERR_ALLOC_FAILED;
+
+		jtf[0].bj_jump = jump;
+		return SLJIT_SUCCESS;
+	}
+
+	jump = emit_cond_jump(compiler, insns, insn_dat, i, pc, 0);
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	status = emit_count(compiler, &counts[2 * i + 1]);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	jtf[1].bj_jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (jtf[1].bj_jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(jump, label);
+
+	status = emit_count(compiler, &counts[2 * i]);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	jtf[0].bj_jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (jtf[0].bj_jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Basic block of a program, see layout_insns().
+ */
+struct bpfjit_block {
+	size_t bj_start;    /* index of the first instruction */
+	size_t bj_end;      /* index of the last instruction */
+	size_t bj_succ[2];  /* jt and jf successors or SIZE_MAX */
+	size_t bj_count[2]; /* number of times an edge is taken */
+	size_t bj_heat;     /* number of times the block is entered */
+	size_t bj_npreds;   /* number of predecessors not yet placed */
+	size_t bj_pos;      /* index of the first instruction after layout */
+	bool bj_reachable;
+	bool bj_placed;
+};
+
+static size_t
+add_counts(size_t a, size_t b)
+{
+
+	return (a > SIZE_MAX - b) ? SIZE_MAX : a + b;
+}
+
+/*
+ * Return true if a block ending with pc has one successor at
+ * index i + 1 + *k where i is an index of pc.
+ */
+static bool
+uncond_insn(struct bpf_insn *pc, uint32_t *k)
+{
+
+	if (BPF_CLASS(pc->code) != BPF_JMP) {
+		*k = 0;
+		return true;
+	}
+
+	if (pc->code == (BPF_JMP|BPF_JA)) {
+		*k = pc->k;
+		return true;
+	}
+
+	*k = pc->jt;
+	return pc->jt == pc->jf;
+}
+
+/*
+ * Return a copy of the program with basic blocks reordered by
+ * edge counts collected by bpfjit_generate_profiled_code().
+ *
+ * Blocks are placed in a topological order because BPF jumps only
+ * go forward. After a block is placed, its most frequently taken
+ * successor follows it if all predecessors of the successor are
+ * already placed. Otherwise, the hottest block among blocks that
+ * can be placed is next. Cold blocks naturally sink to the end.
+ *
+ * Return NULL if the program can't be rewritten, for instance,
+ * if jt or jf of a jump doesn't fit into 8 bits after layout.
+ */
+static struct bpf_insn *
+layout_insns(struct bpf_insn *insns, size_t insn_count,
+    const size_t *counts, size_t *new_count)
+{
+	struct bpfjit_block *blocks, *b;
+	struct bpf_insn *rv, *pc;
+	size_t *order, *bnum;
+	size_t i, j, n, nblocks, nplaced, best, next, tgt;
+	uint32_t k;
+	bool ok;
+
+	rv = NULL;
+	blocks = NULL;
+	order = NULL;
+	ok = false;
+
+	bnum = BJ_ALLOC(insn_count * sizeof(bnum[0]));
+	if (bnum == NULL)
+		return NULL;
+
+	/* Mark leaders with 0 and number them. */
+	for (i = 0; i < insn_count; i++)
+		bnum[i] = SIZE_MAX;
+
+	bnum[0] = 0;
+	for (i = 0; i < insn_count; i++) {
+		pc = &insns[i];
+		if (BPF_CLASS(pc->code) != BPF_JMP &&
+		    BPF_CLASS(pc->code) != BPF_RET) {
+			continue;
+		}
+
+		if (i + 1 < insn_count)
+			bnum[i + 1] = 0;
+
+		if (BPF_CLASS(pc->code) == BPF_RET)
+			continue;
+
+		uncond_insn(pc, &k);
+		if (k >= insn_count - (i + 1) ||
+		    (pc->code != (BPF_JMP|BPF_JA) &&
+		    pc->jf >= insn_count - (i + 1))) {
+			goto out;
+		}
+
+		bnum[i + 1 + k] = 0;
+		if (pc->code != (BPF_JMP|BPF_JA))
+			bnum[i + 1 + pc->jf] = 0;
+	}
+
+	nblocks = 0;
+	for (i = 0; i < insn_count; i++) {
+		if (bnum[i] == 0)
+			bnum[i] = nblocks++;
+	}
+
+	blocks = BJ_ALLOC(nblocks * sizeof(blocks[0]));
+	order = BJ_ALLOC(nblocks * sizeof(order[0]));
+	if (blocks == NULL || order == NULL)
+		goto out;
+
+	for (i = 0, j = 0; i < insn_count; i++) {
+		if (bnum[i] == SIZE_MAX)
+			continue;
+
+		b = &blocks[j++];
+		b->bj_start = i;
+		b->bj_succ[0] = b->bj_succ[1] = SIZE_MAX;
+		b->bj_count[0] = b->bj_count[1] = 0;
+		b->bj_heat = 0;
+		b->bj_npreds = 0;
+		b->bj_reachable = false;
+		b->bj_placed = false;
+	}
+
+	for (j = 0; j < nblocks; j++) {
+		b = &blocks[j];
+		b->bj_end = (j + 1 < nblocks) ?
+		    blocks[j + 1].bj_start - 1 : insn_count - 1;
+
+		i = b->bj_end;
+		pc = &insns[i];
+		if (BPF_CLASS(pc->code) == BPF_RET)
+			continue;
+
+		if (uncond_insn(pc, &k)) {
+			/* The last block must end with BPF_RET. */
+			if (i + 1 + k >= insn_count)
+				goto out;
+			b->bj_succ[0] = bnum[i + 1 + k];
+		} else {
+			b->bj_succ[0] = bnum[i + 1 + pc->jt];
+			b->bj_succ[1] = bnum[i + 1 + pc->jf];
+			b->bj_count[0] = counts[2 * i];
+			b->bj_count[1] = counts[2 * i + 1];
+		}
+	}
+
+	/* Blocks are numbered in a topological order. */
+	blocks[0].bj_reachable = true;
+	blocks[0].bj_heat = SIZE_MAX;
+	n = 0;
+	for (j = 0; j < nblocks; j++) {
+		b = &blocks[j];
+		if (!b->bj_reachable)
+			continue;
+
+		n++;
+		if (b->bj_succ[1] == SIZE_MAX)
+			b->bj_count[0] = b->bj_heat;
+
+		for (i = 0; i < 2 && b->bj_succ[i] != SIZE_MAX; i++) {
+			tgt = b->bj_succ[i];
+			blocks[tgt].bj_reachable = true;
+			blocks[tgt].bj_npreds++;
+			blocks[tgt].bj_heat =
+			    add_counts(blocks[tgt].bj_heat, b->bj_count[i]);
+		}
+	}
+
+	for (nplaced = 0; nplaced < n; nplaced++) {
+		best = SIZE_MAX;
+
+		/* The hot successor of the previous block. */
+		if (nplaced > 0) {
+			b = &blocks[order[nplaced - 1]];
+			i = (b->bj_succ[1] != SIZE_MAX &&
+			    b->bj_count[1] > b->bj_count[0]) ? 1 : 0;
+			tgt = b->bj_succ[i];
+			if (tgt != SIZE_MAX && blocks[tgt].bj_npreds == 0)
+				best = tgt;
+		}
+
+		for (j = 0; best == SIZE_MAX && j < nblocks; j++) {
+			b = &blocks[j];
+			if (b->bj_reachable && !b->bj_placed &&
+			    b->bj_npreds == 0 && (best == SIZE_MAX ||
+			    b->bj_heat > blocks[best].bj_heat)) {
+				best = j;
+			}
+		}
+
+		for (j++; j < nblocks; j++) {
+			b = &blocks[j];
+			if (b->bj_reachable && !b->bj_placed &&
+			    b->bj_npreds == 0 &&
+			    b->bj_heat > blocks[best].bj_heat) {
+				best = j;
+			}
+		}
+
+		BJ_ASSERT(best != SIZE_MAX);
+		b = &blocks[best];
+		b->bj_placed = true;
+		order[nplaced] = best;
+
+		for (i = 0; i < 2 && b->bj_succ[i] != SIZE_MAX; i++)
+			blocks[b->bj_succ[i]].bj_npreds--;
+	}
+
+	/*
+	 * Compute new positions. A block with one successor ends
+	 * with BPF_JA unless the successor is the next block.
+	 */
+	*new_count = 0;
+	for (j = 0; j < n; j++) {
+		b = &blocks[order[j]];
+		next = (j + 1 < n) ? order[j + 1] : SIZE_MAX;
+
+		b->bj_pos = *new_count;
+		*new_count += b->bj_end - b->bj_start;
+		if (BPF_CLASS(insns[b->bj_end].code) != BPF_JMP ||
+		    b->bj_succ[1] != SIZE_MAX) {
+			*new_count += 1;
+		}
+		if (b->bj_succ[1] == SIZE_MAX && b->bj_succ[0] != SIZE_MAX &&
+		    b->bj_succ[0] != next) {
+			*new_count += 1;
+		}
+	}
+
+	rv = BJ_ALLOC(*new_count * sizeof(rv[0]));
+	if (rv == NULL)
+		goto out;
+
+	for (j = 0; j < n; j++) {
+		b = &blocks[order[j]];
+		next = (j + 1 < n) ? order[j + 1] : SIZE_MAX;
+
+		i = b->bj_pos;
+		memcpy(&rv[i], &insns[b->bj_start],
+		    (b->bj_end - b->bj_start) * sizeof(rv[0]));
+		i += b->bj_end - b->bj_start;
+		pc = &insns[b->bj_end];
+
+		if (BPF_CLASS(pc->code) == BPF_RET) {
+			rv[i] = *pc;
+		} else if (b->bj_succ[1] != SIZE_MAX) {
+			rv[i] = *pc;
+			tgt = blocks[b->bj_succ[0]].bj_pos - (i + 1);
+			if (tgt > UINT8_MAX)
+				goto out;
+			rv[i].jt = tgt;
+			tgt = blocks[b->bj_succ[1]].bj_pos - (i + 1);
+			if (tgt > UINT8_MAX)
+				goto out;
+			rv[i].jf = tgt;
+		} else {
+			if (BPF_CLASS(pc->code) != BPF_JMP)
+				rv[i++] = *pc;
+			if (b->bj_succ[0] != next) {
+				rv[i].code = BPF_JMP|BPF_JA;
+				rv[i].jt = rv[i].jf = 0;
+				rv[i].k = blocks[b->bj_succ[0]].bj_pos - (i + 1);
+			}
+		}
+	}
+
+	ok = true;
+
+out:
+	if (!ok && rv != NULL) {
+		BJ_FREE(rv, *new_count * sizeof(rv[0]));
+		rv = NULL;
+	}
+	if (order != NULL)
+		BJ_FREE(order, nblocks * sizeof(order[0]));
+	if (blocks != NULL)
+		BJ_FREE(blocks, nblocks * sizeof(blocks[0]));
+	BJ_FREE(bnum, insn_count * sizeof(bnum[0]));
+	return rv;
+}
+
+/*
+ * Emit the end of an iteration of batch code. Store the result
+ * and count it if it's not 0, then continue with the next packet
+ * or return the number of accepted packets.
+ */
+static int
+emit_batch_return(struct sljit_compiler *compiler, int src, sljit_sw srcw,
+    struct sljit_label *loop)
+{
+	struct sljit_label *label;
+	struct sljit_jump *jump;
+	int status;
+
+	/* tmp1 = stack->res++; */
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    BJ_TMP1REG, 0,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, res));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op2(compiler,
+	    SLJIT_ADD,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, res),
+	    BJ_TMP1REG, 0,
+	    SLJIT_IMM, sizeof(size_t));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* *tmp1 = src; */
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_UI,
+	    BJ_TMP2REG, 0,
+	    src, srcw);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    SLJIT_MEM1(BJ_TMP1REG), 0,
+	    BJ_TMP2REG, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* if (src != 0) stack->accepted++; */
+	jump = NULL;
+	if (src != SLJIT_IMM) {
+		jump = sljit_emit_cmp(compiler,
+		    SLJIT_C_EQUAL,
+		    BJ_TMP2REG, 0,
+		    SLJIT_IMM, 0);
+		if (jump == NULL)
+			return SLJIT_ERR_ALLOC_FAILED;
+	}
+
+	if (src != SLJIT_IMM || (uint32_t)srcw != 0) {
+		status = sljit_emit_op2(compiler,
+		    SLJIT_ADD,
+		    SLJIT_MEM1(SLJIT_LOCALS_REG),
+		    offsetof(struct bpfjit_stack, accepted),
+		    SLJIT_MEM1(SLJIT_LOCALS_REG),
+		    offsetof(struct bpfjit_stack, accepted),
+		    SLJIT_IMM, 1);
+		if (status != SLJIT_SUCCESS)
+			return status;
+	}
+
+	if (jump != NULL) {
+		label = sljit_emit_label(compiler);
+		if (label == NULL)
+			return SLJIT_ERR_ALLOC_FAILED;
+		sljit_set_label(jump, label);
+	}
+
+	/* if (++args < stack->end) goto loop; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_ADD,
+	    BJ_ARGS, 0,
+	    BJ_ARGS, 0,
+	    SLJIT_IMM, sizeof(struct bpf_args));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	jump = sljit_emit_cmp(compiler,
+	    SLJIT_C_LESS,
+	    BJ_ARGS, 0,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, end));
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(jump, loop);
+
+	return sljit_emit_return(compiler,
+	    SLJIT_MOV,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, accepted));
+}
+
+/*
+ * Prologue of batch code, it leaves the address
+ * of the first instruction of the loop in *loop.
+ */
+static int
+emit_batch_enter(struct sljit_compiler *compiler, struct sljit_label **loop)
+{
+	struct sljit_label *label;
+	struct sljit_jump *jump;
+	int status;
+
+	/* if (n == 0) return 0; */
+	jump = sljit_emit_cmp(compiler,
+	    SLJIT_C_NOT_EQUAL,
+	    BJ_BATCH_N, 0,
+	    SLJIT_IMM, 0);
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	status = sljit_emit_return(compiler,
+	    SLJIT_MOV,
+	    SLJIT_IMM, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(jump, label);
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, res),
+	    BJ_BATCH_RES, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, accepted),
+	    SLJIT_IMM, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* stack->end = args + n; */
+	status = sljit_emit_op2(compiler,
+	    SLJIT_MUL,
+	    BJ_TMP1REG, 0,
+	    BJ_BATCH_N, 0,
+	    SLJIT_IMM, sizeof(struct bpf_args));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op2(compiler,
+	    SLJIT_ADD,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, end),
+	    BJ_TMP1REG, 0,
+	    BJ_BATCH_ARGS, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    BJ_ARGS, 0,
+	    BJ_BATCH_ARGS, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	*loop = sljit_emit_label(compiler);
+	if (*loop == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Emit the prologue of multi code. Save the results array
+ * on the stack and clear the mask of matched programs.
+ */
+static int
+emit_multi_enter(struct sljit_compiler *compiler)
+{
+	int status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, res),
+	    BJ_MULTI_OUT, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	return sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, mask),
+	    SLJIT_IMM, 0);
+}
+
+/*
+ * Emit BJ_MISC_RESULT instruction: res[jt] = k or A and set bit jt
+ * of the mask if the result isn't 0.
+ */
+static int
+emit_multi_result(struct sljit_compiler *compiler, struct bpf_insn *pc)
+{
+	struct sljit_jump *jump;
+	struct sljit_label *label;
+	const sljit_sw bit = (sljit_sw)((size_t)1 << pc->jt);
+	int status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_P,
+	    BJ_TMP1REG, 0,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, res));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	if (pc->jf == 0) {
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV,
+		    SLJIT_MEM1(BJ_TMP1REG), pc->jt * sizeof(size_t),
+		    SLJIT_IMM, (uint32_t)pc->k);
+		if (status != SLJIT_SUCCESS)
+			return status;
+
+		if (pc->k == 0)
+			return SLJIT_SUCCESS;
+
+		return sljit_emit_op2(compiler,
+		    SLJIT_OR,
+		    SLJIT_MEM1(SLJIT_LOCALS_REG),
+		    offsetof(struct bpfjit_stack, mask),
+		    SLJIT_MEM1(SLJIT_LOCALS_REG),
+		    offsetof(struct bpfjit_stack, mask),
+		    SLJIT_IMM, bit);
+	}
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV_UI,
+	    BJ_TMP2REG, 0,
+	    BJ_AREG, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    SLJIT_MEM1(BJ_TMP1REG), pc->jt * sizeof(size_t),
+	    BJ_TMP2REG, 0);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	/* if (A != 0) mask |= bit; */
+	jump = sljit_emit_cmp(compiler,
+	    SLJIT_C_EQUAL,
+	    BJ_TMP2REG, 0,
+	    SLJIT_IMM, 0);
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+
+	status = sljit_emit_op2(compiler,
+	    SLJIT_OR,
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, mask),
+	    SLJIT_MEM1(SLJIT_LOCALS_REG),
+	    offsetof(struct bpfjit_stack, mask),
+	    SLJIT_IMM, bit);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(jump, label);
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Program j of multi code. Its ret0 jumps end at ret0[mp_ret0] and
+ * the next program, or the final BPF_RET, starts at insn mp_next.
+ */
+struct bpfjit_multi_prog {
+	size_t mp_ret0;
+	size_t mp_next;
+	struct sljit_label *mp_label; /* label of mp_next */
+};
+
+/*
+ * Emit a target of failed checks of program j in multi code.
+ * Checks don't cross programs, so program j returns 0. Store
+ * the result and continue with the next program at label next.
+ */
+static int
+emit_multi_fail(struct sljit_compiler *compiler,
+    struct sljit_jump **jumps, size_t njumps, size_t j,
+    struct sljit_label *next)
+{
+	struct sljit_label *label;
+	struct sljit_jump *jump;
+	struct bpf_insn res;
+	size_t i;
+	int status;
+
+	label = sljit_emit_label(compiler);
+	if (label == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	for (i = 0; i < njumps; i++)
+		sljit_set_label(jumps[i], label);
+
+	res.code = BPF_MISC|BJ_MISC_RESULT;
+	res.jt = j;
+	res.jf = 0;
+	res.k = 0;
+	status = emit_multi_result(compiler, &res);
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+	if (jump == NULL)
+		return SLJIT_ERR_ALLOC_FAILED;
+	sljit_set_label(jump, next);
+
+	return SLJIT_SUCCESS;
+}
+
+/*
+ * Flags of generate_code().
+ */
+#define BJ_GEN_PREDICATE 0x1u /* see bpfjit_generate_predicate() */
+#define BJ_GEN_DIRECT    0x2u /* see bpfjit_generate_direct_code() */
+#define BJ_GEN_BATCH     0x4u /* see bpfjit_generate_batch_code() */
+#define BJ_GEN_MULTI     0x8u /* see bpfjit_multi_create() */
+
+static bpfjit_function_t
+generate_code(bpf_ctx_t *bc, struct bpf_insn *insns, size_t insn_count,
+    size_t *counts, unsigned int flags)
+{
+	void *rv;
+	struct sljit_compiler *compiler;
+
+	size_t i;
+	int status;
+	int branching, negate;
+	unsigned int rval, mode, src, vn;
+	int op;
+	sljit_sw opw;
+	struct bpf_insn folded;
+
+	/* optimization related */
+	bpfjit_init_mask_t initmask;
+	int nscratches, nsaveds, ncopfuncs, nhsets, locals;
+	int memregs[BPF_MEMWORDS];
+	bool ldcache, pktregs, direct, batch, multi;
+	int lenop;
+	sljit_sw lenopw;
+
+	/* a list of jumps to out-of-bound return from a generated function */
+	struct sljit_jump **ret0;
+	size_t ret0_size, ret0_maxsize;
+
+	/* programs of multi code */
+	struct bpfjit_multi_prog *mprogs;
+	size_t nends, nlabels, nprogs, first;
+
+	struct bpf_insn *pc;
+	struct bpfjit_insn_data *insn_dat;
+
+	/* for local use */
+	struct sljit_label *label;
+	struct sljit_jump *jump;
+	struct bpfjit_jump *bjump, *jtf;
 
 	struct sljit_jump *to_mchain_jump;
+	struct sljit_label *loop;
+
+	uint32_t jt, jf, vt, vf;
+
+	rv = NULL;
+	compiler = NULL;
+	insn_dat = NULL;
+	ret0 = NULL;
+	mprogs = NULL;
+	nprogs = 0;
+
+	if (insn_count == 0 || insn_count > SIZE_MAX / sizeof(insn_dat[0]))
+		goto fail;
+
+	insn_dat = BJ_ALLOC(insn_count * sizeof(insn_dat[0]));
+	if (insn_dat == NULL)
+		goto fail;
+
+	if (!optimize_consts(insns, insn_dat, insn_count))
+		goto fail;
+
+	if (!optimize1(insns, insn_dat, insn_count,
+	    &initmask, &nscratches, &ncopfuncs)) {
+		goto fail;
+	}
+
+	/* Direct code has no bpf_args to pass to copfuncs. */
+	direct = (flags & BJ_GEN_DIRECT) != 0;
+	if (direct && ncopfuncs > 0)
+		goto fail;
+
+	/*
+	 * Batch code calls only inline copfuncs. So does multi code,
+	 * bpfjit_multi_call() may run a program again.
+	 */
+	batch = (flags & BJ_GEN_BATCH) != 0;
+	multi = (flags & BJ_GEN_MULTI) != 0;
+	optimize_cops(bc, insns, insn_dat, insn_count, batch,
+	    &ncopfuncs, &nhsets);
+	if ((batch || multi) && ncopfuncs > 0)
+		goto fail;
+
+	if ((flags & BJ_GEN_PREDICATE) &&
+	    !check_predicate(insns, insn_dat, insn_count)) {
+		goto fail;
+	}
+
+	if (!optimize_dead(insns, insn_dat, insn_count))
+		goto fail;
+
+	if (!optimize_loads(insns, insn_dat, insn_count, &ldcache))
+		goto fail;
+
+	if (ldcache)
+		nscratches = 5;
+
+	nsaveds = 3;
+	if (!optimize_memwords(insns, insn_dat, insn_count, initmask,
+	    ldcache, memregs, &nscratches, &nsaveds)) {
+		goto fail;
+	}
+
+	optimize_frame(insns, insn_dat, insn_count, initmask, ncopfuncs,
+	    memregs, &locals, &pktregs);
+
+	if (!pktregs && !direct && !batch && !multi && nsaveds == 3)
+		nsaveds = 2;
+
+	if (batch || multi) {
+		/* emit_batch_return() and emit_multi_result() use BJ_TMP2REG. */
+		if (nscratches < 3)
+			nscratches = 3;
+		locals = sizeof(struct bpfjit_stack);
+	}
+
+	/* emit_hset_cop() reads ctx from the stack. */
+	if (nhsets > 0)
+		locals = sizeof(struct bpfjit_stack);
+
+	if (direct) {
+		lenop = BJ_WIRELEN;
+		lenopw = 0;
+	} else {
+		lenop = SLJIT_MEM1(BJ_ARGS);
+		lenopw = offsetof(struct bpf_args, wirelen);
+	}
+
+	/* Profiled code counts edges of the original program. */
+	if (counts == NULL)
+		thread_jumps(insns, insn_dat, insn_count);
+
+	if (!optimize_checks(insns, insn_dat, insn_count))
+		goto fail;
+
+	if (!optimize_msh(insns, insn_dat, insn_count,
+	    ldcache, memregs, &nscratches)) {
+		goto fail;
+	}
+
+	optimize_switch(insns, insn_dat, insn_count, &nscratches);
+
+	optimize_returns(insns, insn_dat, insn_count);
+
+#if defined(_KERNEL)
+	/* bpf_filter() checks initialization of memwords. */
+	BJ_ASSERT((initmask & BJ_INIT_MMASK) == 0);
+#endif
+
+	ret0_size = 0;
+	ret0_maxsize = 64;
+	ret0 = BJ_ALLOC(ret0_maxsize * sizeof(ret0[0]));
+	if (ret0 == NULL)
+		goto fail;
+
+	if (multi) {
+		for (i = 0; i < insn_count; i++) {
+			if (insns[i].code == (BPF_MISC|BJ_MISC_RESULT) &&
+			    insns[i].jt >= nprogs) {
+				nprogs = insns[i].jt + 1;
+			}
+		}
+
+		if (nprogs == 0)
+			goto fail;
+
+		mprogs = BJ_ALLOC(nprogs * sizeof(mprogs[0]));
+		if (mprogs == NULL)
+			goto fail;
+
+		/* The next program follows the last result. */
+		for (i = 0; i < insn_count; i++) {
+			if (insns[i].code == (BPF_MISC|BJ_MISC_RESULT))
+				mprogs[insns[i].jt].mp_next = i + 1;
+		}
+	}
+	nends = nlabels = 0;
+
+	compiler = sljit_create_compiler();
+	if (compiler == NULL)
+		goto fail;
+
+#if !defined(_KERNEL) && defined(SLJIT_VERBOSE) && SLJIT_VERBOSE
+	sljit_compiler_verbose(compiler, stderr);
+#endif
+
+	status = sljit_emit_enter(compiler,
+	    (direct || batch || multi) ? 3 : 2, nscratches, nsaveds, locals);
+	if (status != SLJIT_SUCCESS)
+		goto fail;
+
+	loop = NULL;
+	if (batch) {
+		status = emit_batch_enter(compiler, &loop);
+		if (status != SLJIT_SUCCESS)
+			goto fail;
+	}
+
+	if (ncopfuncs > 0 || nhsets > 0) {
+		/* save ctx argument */
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV_P,
+		    SLJIT_MEM1(SLJIT_LOCALS_REG),
+		    offsetof(struct bpfjit_stack, ctx),
+		    BJ_CTX_ARG, 0);
+		if (status != SLJIT_SUCCESS)
+			goto fail;
+	}
+
+	if (multi) {
+		status = emit_multi_enter(compiler);
+		if (status != SLJIT_SUCCESS)
+			goto fail;
+	}
+
+	if (pktregs && !direct) {
+		status = load_buf_buflen(compiler);
+		if (status != SLJIT_SUCCESS)
+			goto fail;
+	}
+
+	for (i = 0; i < BPF_MEMWORDS; i++) {
+		if (initmask & BJ_INIT_MBIT(i)) {
+			memword_operand(memregs, i, &op, &opw);
+			status = sljit_emit_op1(compiler,
+			    SLJIT_MOV_UI,
+			    op, opw,
+			    SLJIT_IMM, 0);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+		}
+	}
+
+	if (initmask & BJ_INIT_ABIT) {
+		/* A = 0; */
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV,
+		    BJ_AREG, 0,
+		    SLJIT_IMM, 0);
+		if (status != SLJIT_SUCCESS)
+			goto fail;
+	}
+
+	if (initmask & BJ_INIT_XBIT) {
+		/* X = 0; */
+		status = sljit_emit_op1(compiler,
+		    SLJIT_MOV,
+		    BJ_XREG, 0,
+		    SLJIT_IMM, 0);
+		if (status != SLJIT_SUCCESS)
+			goto fail;
+	}
+
+	for (i = 0; i < insn_count; i++) {
+		/* Results of program j follow its instructions. */
+		if (multi && insns[i].code == (BPF_MISC|BJ_MISC_RESULT) &&
+		    insns[i].jt == nends) {
+			mprogs[nends++].mp_ret0 = ret0_size;
+		}
+
+		/* Failed checks of the previous program continue here. */
+		if (multi && nlabels < nends && i == mprogs[nlabels].mp_next) {
+			label = sljit_emit_label(compiler);
+			if (label == NULL)
+				goto fail;
+			mprogs[nlabels++].mp_label = label;
+		}
+
+		if (insn_dat[i].bj_unreachable)
+			continue;
+
+		to_mchain_jump = NULL;
+
+		if (BPF_CLASS(insns[i].code) == BPF_RET &&
+		    insn_dat[i].bj_aux.bj_retdata.bj_shared != i) {
+			status = emit_shared_return(compiler, insn_dat, i,
+			    &ret0, &ret0_size, &ret0_maxsize);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+
+			continue;
+		}
+
+		/*
+		 * Resolve jumps to the current insn.
+		 */
+		label = NULL;
+		SLIST_FOREACH(bjump, &insn_dat[i].bj_jumps, bj_entries) {
+			if (bjump->bj_jump != NULL) {
+				if (label == NULL)
+					label = sljit_emit_label(compiler);
+				if (label == NULL)
+					goto fail;
+				sljit_set_label(bjump->bj_jump, label);
+			}
+		}
+
+		if (read_pkt_insn(&insns[i], NULL) &&
+		    insn_dat[i].bj_aux.bj_rdata.bj_check_length > 0) {
+			/* if (buflen < bj_check_length) return 0; */
+			jump = sljit_emit_cmp(compiler,
+			    SLJIT_C_LESS,
+			    BJ_BUFLEN, 0,
+			    SLJIT_IMM,
+			    insn_dat[i].bj_aux.bj_rdata.bj_check_length);
+			if (jump == NULL)
+		  		goto fail;
+#ifdef _KERNEL
+			to_mchain_jump = jump;
+#else
+			if (!append_jump(jump, &ret0,
+			    &ret0_size, &ret0_maxsize))
+				goto fail;
+#endif
+		}
+
+		if (insn_dat[i].bj_dead)
+			continue;
+
+		pc = &insns[i];
+		switch (insn_dat[i].bj_fold) {
+		case BJ_FOLD_A:
+			if (BPF_CLASS(pc->code) == BPF_RET) {
+				folded = *pc;
+				folded.code = BPF_RET|BPF_K;
+				folded.k = insn_dat[i].bj_const;
+				pc = &folded;
+				break;
+			}
+			/* FALLTHROUGH */
+
+		case BJ_FOLD_X:
+			status = sljit_emit_op1(compiler,
+			    SLJIT_MOV,
+			    insn_dat[i].bj_fold == BJ_FOLD_A ? BJ_AREG : BJ_XREG,
+			    0,
+			    SLJIT_IMM, insn_dat[i].bj_const);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+
+			continue;
+
+		case BJ_FOLD_K:
+			folded = *pc;
+			folded.code &= ~BPF_X;
+			folded.k = insn_dat[i].bj_const;
+			pc = &folded;
+			break;
+		}
+
+		switch (BPF_CLASS(pc->code)) {
+
+		default:
+			goto fail;
+
+		case BPF_LD:
+			/* BPF_LD+BPF_IMM          A <- k */
+			if (pc->code == (BPF_LD|BPF_IMM)) {
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV,
+				    BJ_AREG, 0,
+				    SLJIT_IMM, (uint32_t)pc->k);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			/* BPF_LD+BPF_MEM          A <- M[k] */
+			if (pc->code == (BPF_LD|BPF_MEM)) {
+				if (pc->k >= BPF_MEMWORDS)
+					goto fail;
+				memword_operand(memregs, pc->k, &op, &opw);
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV_UI,
+				    BJ_AREG, 0,
+				    op, opw);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			/* BPF_LD+BPF_W+BPF_LEN    A <- len */
+			if (pc->code == (BPF_LD|BPF_W|BPF_LEN)) {
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV,
+				    BJ_AREG, 0,
+				    lenop, lenopw);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			mode = BPF_MODE(pc->code);
+			if (mode != BPF_ABS && mode != BPF_IND)
+				goto fail;
+
+			vn = insn_dat[i].bj_aux.bj_rdata.bj_vn;
+			if (vn & BJ_VN_SKIP)
+				continue;
+
+#ifdef BJ_LDCACHE
+			if (vn & BJ_VN_FROM_CACHE) {
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV,
+				    BJ_AREG, 0,
+				    BJ_LDCACHE, 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+#endif
+
+			if (insn_dat[i].bj_fuse)
+				continue; /* see emit_fused_jump() */
+
+			status = emit_pkt_read(compiler, pc,
+			    insn_dat[i].bj_aux.bj_rdata.bj_check_index,
+			    insn_dat[i].bj_aux.bj_rdata.bj_xbuf,
+			    to_mchain_jump, &ret0, &ret0_size, &ret0_maxsize);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+
+#ifdef BJ_LDCACHE
+			if (vn & BJ_VN_TO_CACHE) {
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV,
+				    BJ_LDCACHE, 0,
+				    BJ_AREG, 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+			}
+#endif
+
+			continue;
+
+		case BPF_LDX:
+			mode = BPF_MODE(pc->code);
+
+			/* BPF_LDX+BPF_W+BPF_IMM    X <- k */
+			if (mode == BPF_IMM) {
+				if (BPF_SIZE(pc->code) != BPF_W)
+					goto fail;
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV,
+				    BJ_XREG, 0,
+				    SLJIT_IMM, (uint32_t)pc->k);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			/* BPF_LDX+BPF_W+BPF_LEN    X <- len */
+			if (mode == BPF_LEN) {
+				if (BPF_SIZE(pc->code) != BPF_W)
+					goto fail;
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV,
+				    BJ_XREG, 0,
+				    lenop, lenopw);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			/* BPF_LDX+BPF_W+BPF_MEM    X <- M[k] */
+			if (mode == BPF_MEM) {
+				if (BPF_SIZE(pc->code) != BPF_W)
+					goto fail;
+				if (pc->k >= BPF_MEMWORDS)
+					goto fail;
+				memword_operand(memregs, pc->k, &op, &opw);
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV_UI,
+				    BJ_XREG, 0,
+				    op, opw);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			/* BPF_LDX+BPF_B+BPF_MSH    X <- 4*(P[k:1]&0xf) */
+			if (mode != BPF_MSH || BPF_SIZE(pc->code) != BPF_B)
+				goto fail;
+
+			status = emit_msh(compiler, pc,
+			    to_mchain_jump, &ret0, &ret0_size, &ret0_maxsize);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+
+#ifdef BJ_XBUF
+			if (insn_dat[i].bj_aux.bj_rdata.bj_xbuf) {
+				/* xbuf = buf + X; */
+				status = sljit_emit_op2(compiler,
+				    SLJIT_ADD,
+				    BJ_XBUF, 0,
+				    BJ_BUF, 0,
+				    BJ_XREG, 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+			}
+#endif
+
+			continue;
+
+		case BPF_ST:
+			if (pc->code != BPF_ST || pc->k >= BPF_MEMWORDS)
+				goto fail;
+
+			memword_operand(memregs, pc->k, &op, &opw);
+			status = sljit_emit_op1(compiler,
+			    SLJIT_MOV_UI,
+			    op, opw,
+			    BJ_AREG, 0);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+
+			continue;
+
+		case BPF_STX:
+			if (pc->code != BPF_STX || pc->k >= BPF_MEMWORDS)
+				goto fail;
+
+			memword_operand(memregs, pc->k, &op, &opw);
+			status = sljit_emit_op1(compiler,
+			    SLJIT_MOV_UI,
+			    op, opw,
+			    BJ_XREG, 0);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+
+			continue;
+
+		case BPF_ALU:
+			if (insn_dat[i].bj_fuse)
+				continue; /* see emit_fused_jump() */
+
+			if (pc->code == (BPF_ALU|BPF_NEG)) {
+				status = sljit_emit_op1(compiler,
+				    SLJIT_NEG,
+				    BJ_AREG, 0,
+				    BJ_AREG, 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			if (BPF_OP(pc->code) != BPF_DIV &&
+			    BPF_OP(pc->code) != BPF_MOD) {
+				status = sljit_emit_op2(compiler,
+				    bpf_alu_to_sljit_op(pc),
+				    BJ_AREG, 0,
+				    BJ_AREG, 0,
+				    kx_to_reg(pc), kx_to_reg_arg(pc));
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			/* BPF_DIV and BPF_MOD */
+
+			src = BPF_SRC(pc->code);
+			if (src != BPF_X && src != BPF_K)
+				goto fail;
+
+			/* division by zero? */
+			if (src == BPF_X) {
+				jump = sljit_emit_cmp(compiler,
+				    SLJIT_C_EQUAL|SLJIT_INT_OP,
+				    BJ_XREG, 0, 
+				    SLJIT_IMM, 0);
+				if (jump == NULL)
+					goto fail;
+				if (!append_jump(jump, &ret0,
+				    &ret0_size, &ret0_maxsize))
+					goto fail;
+			} else if (pc->k == 0) {
+				jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+				if (jump == NULL)
+					goto fail;
+				if (!append_jump(jump, &ret0,
+				    &ret0_size, &ret0_maxsize))
+					goto fail;
+			}
+
+			if (src == BPF_X) {
+				status = emit_division(compiler,
+				    BPF_OP(pc->code), BJ_XREG, 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+			} else if (pc->k != 0) {
+				if (pc->k & (pc->k - 1)) {
+				    status = emit_magic_division(compiler,
+				        BPF_OP(pc->code), (uint32_t)pc->k);
+				} else {
+				    status = emit_pow2_division(compiler,
+				        BPF_OP(pc->code), (uint32_t)pc->k);
+				}
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+			}
+
+			continue;
+
+		case BPF_JMP:
+			if (counts != NULL) {
+				status = emit_profiled_jump(compiler,
+				    insns, insn_dat, i, pc, counts);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			if (insn_dat[i].bj_aux.bj_jdata.bj_case)
+				continue;
+
+			if (insn_dat[i].bj_aux.bj_jdata.bj_ncases > 0) {
+				status = emit_switch(compiler, insns,
+				    insn_dat, i);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			jt = insn_dat[i].bj_aux.bj_jdata.bj_jt;
+			jf = insn_dat[i].bj_aux.bj_jdata.bj_jf;
+
+			negate = (jt == 0) ? 1 : 0;
+			branching = (jt == jf) ? 0 : 1;
+			jtf = insn_dat[i].bj_aux.bj_jdata.bj_jtf;
+
+			if ((flags & BJ_GEN_PREDICATE) && branching &&
+			    ret_value(&insns[i + 1 + jt],
+			        &insn_dat[i + 1 + jt], &vt) &&
+			    ret_value(&insns[i + 1 + jf],
+			        &insn_dat[i + 1 + jf], &vf) &&
+			    vt != vf) {
+				/* Both targets return, use setcc. */
+				status = emit_predicate_return(compiler,
+				    insns, insn_dat, i, pc, vt == 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			if (branching) {
+				jump = emit_cond_jump(compiler,
+				    insns, insn_dat, i, pc, negate);
+				if (jump == NULL)
+					goto fail;
+
+				BJ_ASSERT(jtf[negate].bj_jump == NULL);
+				jtf[negate].bj_jump = jump;
+			}
+
+			if (!branching || (jt != 0 && jf != 0)) {
+				jump = sljit_emit_jump(compiler, SLJIT_JUMP);
+				if (jump == NULL)
+					goto fail;
+
+				BJ_ASSERT(jtf[branching].bj_jump == NULL);
+				jtf[branching].bj_jump = jump;
+			}
+
+			continue;
+
+		case BPF_RET:
+			rval = BPF_RVAL(pc->code);
+			if (rval != BPF_K && rval != BPF_A)
+				goto fail;
+
+			/* Other instructions may jump here. */
+			label = sljit_emit_label(compiler);
+			if (label == NULL)
+				goto fail;
+			insn_dat[i].bj_aux.bj_retdata.bj_label = label;
+
+			if (rval == BPF_K) {
+				/* BPF_RET+BPF_K    accept k bytes */
+				op = SLJIT_IMM;
+				opw = (uint32_t)pc->k;
+			} else {
+				/* BPF_RET+BPF_A    accept A bytes */
+				op = BJ_AREG;
+				opw = 0;
+			}
+
+			if (batch) {
+				status = emit_batch_return(compiler,
+				    op, opw, loop);
+			} else if (multi) {
+				/* The last instruction of multi code. */
+				status = sljit_emit_return(compiler,
+				    SLJIT_MOV,
+				    SLJIT_MEM1(SLJIT_LOCALS_REG),
+				    offsetof(struct bpfjit_stack, mask));
+			} else {
+				status = sljit_emit_return(compiler,
+				    SLJIT_MOV_UI, op, opw);
+			}
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+
+			continue;
+
+		case BPF_MISC:
+			switch (BPF_MISCOP(pc->code)) {
+			case BPF_TAX:
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV_UI,
+				    BJ_XREG, 0,
+				    BJ_AREG, 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+
+			case BPF_TXA:
+				status = sljit_emit_op1(compiler,
+				    SLJIT_MOV,
+				    BJ_AREG, 0,
+				    BJ_XREG, 0);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+
+			case BPF_COP:
+			case BPF_COPX:
+				if (insn_dat[i].bj_aux.bj_cdata.bj_inline) {
+					status = emit_inline_cop(compiler,
+					    bc, pc);
+					if (status != SLJIT_SUCCESS)
+						goto fail;
+
+					continue;
+				}
+
+				status = emit_memword_copy(compiler, memregs,
+				    insn_dat[i].bj_aux.bj_cdata.bj_spill, true);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				jump = NULL;
+				status = emit_cop(compiler, bc, pc, &jump);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				status = emit_memword_copy(compiler, memregs,
+				    insn_dat[i].bj_aux.bj_cdata.bj_reload, false);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				if (jump != NULL && !append_jump(jump,
+				    &ret0, &ret0_size, &ret0_maxsize))
+					goto fail;
+
+				continue;
+
+			case BJ_MISC_RESULT:
+				if (!multi)
+					goto fail;
+
+				status = emit_multi_result(compiler, pc);
+				if (status != SLJIT_SUCCESS)
+					goto fail;
+
+				continue;
+			}
+
+			goto fail;
+		} /* switch */
+	} /* main loop */
+
+	BJ_ASSERT(ret0_size <= ret0_maxsize);
+
+	if (multi) {
+		/* The last instruction doesn't read the packet. */
+		BJ_ASSERT(nends == nprogs && nlabels == nprogs &&
+		    ret0_size == mprogs[nprogs - 1].mp_ret0);
+
+		first = 0;
+		for (i = 0; i < nprogs; first = mprogs[i++].mp_ret0) {
+			if (mprogs[i].mp_ret0 == first)
+				continue;
+			status = emit_multi_fail(compiler,
+			    &ret0[first], mprogs[i].mp_ret0 - first, i,
+			    mprogs[i].mp_label);
+			if (status != SLJIT_SUCCESS)
+				goto fail;
+		}
+	} else {
+		if (ret0_size > 0) {
+			label = sljit_emit_label(compiler);
+			if (label == NULL)
+				goto fail;
+			for (i = 0; i < ret0_size; i++)
+				sljit_set_label(ret0[i], label);
+		}
+
+		if (batch) {
+			status = emit_batch_return(compiler,
+			    SLJIT_IMM, 0, loop);
+		} else {
+			status = sljit_emit_return(compiler,
+			    SLJIT_MOV_UI,
+			    SLJIT_IMM, 0);
+		}
+		if (status != SLJIT_SUCCESS)
+			goto fail;
+	}
+
+	rv = sljit_generate_code(compiler);
+
+fail:
+	if (compiler != NULL)
+		sljit_free_compiler(compiler);
+
+	if (insn_dat != NULL)
+		BJ_FREE(insn_dat, insn_count * sizeof(insn_dat[0]));
+
+	if (ret0 != NULL)
+		BJ_FREE(ret0, ret0_maxsize * sizeof(ret0[0]));
+
+	if (mprogs != NULL)
+		BJ_FREE(mprogs, nprogs * sizeof(mprogs[0]));
+
+	return (bpfjit_function_t)rv;
+}
+
+bpfjit_function_t
+bpfjit_generate_code(bpf_ctx_t *bc, struct bpf_insn *insns, size_t insn_count)
+{
+
+	return generate_code(bc, insns, insn_count, NULL, 0);
+}
+
+bpfjit_function_t
+bpfjit_generate_profiled_code(bpf_ctx_t *bc, struct bpf_insn *insns,
+    size_t insn_count, size_t *counts)
+{
+
+	return generate_code(bc, insns, insn_count, counts, 0);
+}
+
+bpfjit_function_t
+bpfjit_recompile(bpf_ctx_t *bc, struct bpf_insn *insns,
+    size_t insn_count, const size_t *counts)
+{
+	struct bpf_insn *laid;
+	size_t laid_count;
+	bpfjit_function_t rv;
+
+	if (insn_count == 0)
+		return NULL;
+
+	laid = layout_insns(insns, insn_count, counts, &laid_count);
+	if (laid == NULL)
+		return generate_code(bc, insns, insn_count, NULL, 0);
+
+	rv = generate_code(bc, laid, laid_count, NULL, 0);
+	BJ_FREE(laid, laid_count * sizeof(laid[0]));
+	return rv;
+}
+
+bpfjit_predicate_t
+bpfjit_generate_predicate(bpf_ctx_t *bc, struct bpf_insn *insns,
+    size_t insn_count)
+{
+	struct bpf_insn *pred;
+	size_t i;
+	bpfjit_function_t code;
+
+	if (insn_count == 0 || insn_count > SIZE_MAX / sizeof(insns[0]))
+		return NULL;
+
+	pred = BJ_ALLOC(insn_count * sizeof(pred[0]));
+	if (pred == NULL)
+		return NULL;
+
+	for (i = 0; i < insn_count; i++) {
+		pred[i] = insns[i];
+		if (pred[i].code == (BPF_RET|BPF_K))
+			pred[i].k = (pred[i].k != 0);
+	}
+
+	code = generate_code(bc, pred, insn_count, NULL,
+	    BJ_GEN_PREDICATE);
+	BJ_FREE(pred, insn_count * sizeof(pred[0]));
+	return (bpfjit_predicate_t)(void *)code;
+}
+
+bpfjit_direct_t
+bpfjit_generate_direct_code(struct bpf_insn *insns, size_t insn_count)
+{
+
+	return (bpfjit_direct_t)(void *)generate_code(NULL, insns,
+	    insn_count, NULL, BJ_GEN_DIRECT);
+}
+
+bpfjit_batch_t
+bpfjit_generate_batch_code(bpf_ctx_t *bc, struct bpf_insn *insns,
+    size_t insn_count)
+{
+
+	return (bpfjit_batch_t)(void *)generate_code(bc, insns,
+	    insn_count, NULL, BJ_GEN_BATCH);
+}
+
+void
+bpfjit_free_code(bpfjit_function_t code)
+{
+
+	sljit_free_code((void *)code);
+}
+
+void
+bpfjit_free_direct_code(bpfjit_direct_t code)
+{
+
+	sljit_free_code((void *)code);
+}
+
+void
+bpfjit_free_batch_code(bpfjit_batch_t code)
+{
+
+	sljit_free_code((void *)code);
+}
+
+void
+bpfjit_free_predicate(bpfjit_predicate_t code)
+{
+
+	sljit_free_code((void *)code);
+}
+
+/*
+ * States of bpfjit_tiered.
+ */
+#define BJ_TIER_INTERP	0u /* below the threshold */
+#define BJ_TIER_QUEUED	1u /* passed to the hook */
+#define BJ_TIER_BUSY	2u /* being compiled */
+#define BJ_TIER_DONE	3u /* bt_code is set, or compilation failed */
+
+struct bpfjit_tiered {
+	bpfjit_function_t volatile bt_code;
+	volatile unsigned int bt_state;
+	size_t bt_calls; /* not updated atomically */
+	size_t bt_threshold;
+	bpfjit_tiered_hook_t bt_hook;
+	void *bt_arg;
+	bpf_ctx_t *bt_ctx;
+	struct bpf_insn *bt_insns;
+	size_t bt_insn_count;
+};
+
+/*
+ * Read P[x+k:width] for interpret().
+ */
+static bool
+interp_read(const bpf_args_t *args, uint32_t x, uint32_t k,
+    uint32_t width, uint32_t *val)
+{
+	const uint8_t *p;
+#ifdef _KERNEL
+	int err;
+
+	if (args->buflen == 0) {
+		if (x > UINT32_MAX - k)
+			return false;
+
+		switch (width) {
+		case 4:
+			*val = m_xword((const struct mbuf *)args->pkt,
+			    x + k, &err);
+			break;
+		case 2:
+			*val = m_xhalf((const struct mbuf *)args->pkt,
+			    x + k, &err);
+			break;
+		default:
+			*val = m_xbyte((const struct mbuf *)args->pkt,
+			    x + k, &err);
+			break;
+		}
+
+		return err == 0;
+	}
+#endif
+
+	if (k > args->buflen || x > args->buflen - k ||
+	    width > args->buflen - k - x) {
+		return false;
+	}
+
+	p = args->pkt + k + x;
+
+	switch (width) {
+	case 4:
+		*val = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		    (uint32_t)p[2] << 8 | p[3];
+		break;
+	case 2:
+		*val = (uint32_t)p[0] << 8 | p[1];
+		break;
+	default:
+		*val = p[0];
+		break;
+	}
+
+	return true;
+}
+
+/*
+ * Registers of interp_run(), A is in ir_state.regA.
+ */
+struct bpfjit_interp {
+	bpf_state_t ir_state;
+	uint32_t ir_x;
+	size_t ir_pc;
+};
+
+/*
+ * Run the program from ir_pc without compiling it. The interpreter
+ * follows generated code rather than bpf_filter(): it supports
+ * bpf_args_t and COP instructions and anything that generated code
+ * would reject returns 0. If stops isn't NULL, the interpreter stops
+ * before BPF_JMP instruction i with non-zero stops[i] and leaves i
+ * in ir_pc. Otherwise, ir_pc is set to insn_count.
+ */
+static size_t
+interp_run(bpf_ctx_t *bc, struct bpf_insn *insns, size_t insn_count,
+    bpf_args_t *args, struct bpfjit_interp *ir, const uint8_t *stops)
+{
+	bpf_state_t *state = &ir->ir_state;
+	struct bpf_insn *pc;
+	size_t i, off;
+	uint32_t A, X, k, v;
+	bool taken;
+
+	A = state->regA;
+	X = ir->ir_x;
+	i = ir->ir_pc;
+	ir->ir_pc = insn_count;
+
+	for (; i < insn_count; i++) {
+		pc = &insns[i];
+		k = pc->k;
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_LD:
+			switch (BPF_MODE(pc->code)) {
+			case BPF_IMM:
+				A = k;
+				continue;
+			case BPF_MEM:
+				if (k >= BPF_MEMWORDS)
+					return 0;
+				A = state->mem[k];
+				continue;
+			case BPF_LEN:
+				A = args->wirelen;
+				continue;
+			case BPF_ABS:
+			case BPF_IND:
+				if (BPF_SIZE(pc->code) != BPF_W &&
+				    BPF_SIZE(pc->code) != BPF_H &&
+				    BPF_SIZE(pc->code) != BPF_B) {
+					return 0;
+				}
+
+				v = (BPF_MODE(pc->code) == BPF_IND) ? X : 0;
+				if (!interp_read(args, v, k,
+				    read_width(pc), &A)) {
+					return 0;
+				}
+				continue;
+			}
+			return 0;
+
+		case BPF_LDX:
+			switch (BPF_MODE(pc->code)) {
+			case BPF_IMM:
+				X = k;
+				continue;
+			case BPF_MEM:
+				if (k >= BPF_MEMWORDS)
+					return 0;
+				X = state->mem[k];
+				continue;
+			case BPF_LEN:
+				X = args->wirelen;
+				continue;
+			case BPF_MSH:
+				if (!interp_read(args, 0, k, 1, &v))
+					return 0;
+				X = (v & 0xf) << 2;
+				continue;
+			}
+			return 0;
+
+		case BPF_ST:
+			if (k >= BPF_MEMWORDS)
+				return 0;
+			state->mem[k] = A;
+			continue;
+
+		case BPF_STX:
+			if (k >= BPF_MEMWORDS)
+				return 0;
+			state->mem[k] = X;
+			continue;
+
+		case BPF_ALU:
+			v = (BPF_SRC(pc->code) == BPF_X) ? X : k;
+
+			switch (BPF_OP(pc->code)) {
+			case BPF_ADD:
+				A += v;
+				continue;
+			case BPF_SUB:
+				A -= v;
+				continue;
+			case BPF_MUL:
+				A *= v;
+				continue;
+			case BPF_DIV:
+				if (v == 0)
+					return 0;
+				A /= v;
+				continue;
+			case BPF_MOD:
+				if (v == 0)
+					return 0;
+				A %= v;
+				continue;
+			case BPF_AND:
+				A &= v;
+				continue;
+			case BPF_OR:
+				A |= v;
+				continue;
+			case BPF_LSH:
+				A <<= v & 31;
+				continue;
+			case BPF_RSH:
+				A >>= v & 31;
+				continue;
+			case BPF_NEG:
+				A = -A;
+				continue;
+			}
+			return 0;
+
+		case BPF_JMP:
+			if (stops != NULL && stops[i] != 0) {
+				state->regA = A;
+				ir->ir_x = X;
+				ir->ir_pc = i;
+				return 0;
+			}
+
+			if (pc->code == (BPF_JMP|BPF_JA)) {
+				off = k;
+			} else {
+				v = (BPF_SRC(pc->code) == BPF_X) ? X : k;
+
+				switch (BPF_OP(pc->code)) {
+				case BPF_JGT:
+					taken = A > v;
+					break;
+				case BPF_JGE:
+					taken = A >= v;
+					break;
+				case BPF_JEQ:
+					taken = A == v;
+					break;
+				case BPF_JSET:
+					taken = (A & v) != 0;
+					break;
+				default:
+					return 0;
+				}
+
+				off = taken ? pc->jt : pc->jf;
+			}
+
+			if (off >= insn_count - (i + 1))
+				return 0;
+			i += off;
+			continue;
+
+		case BPF_RET:
+			switch (BPF_RVAL(pc->code)) {
+			case BPF_K:
+				return k;
+			case BPF_A:
+				return A;
+			}
+			return 0;
+
+		case BPF_MISC:
+			switch (BPF_MISCOP(pc->code)) {
+			case BPF_TAX:
+				X = A;
+				continue;
+			case BPF_TXA:
+				A = X;
+				continue;
+			case BPF_COP:
+			case BPF_COPX:
+				v = (BPF_MISCOP(pc->code) == BPF_COP) ? k : X;
+				if (bc == NULL || v >= bc->nfuncs)
+					return 0;
+
+				state->regA = A;
+				A = bc->copfuncs[v](bc, args, state);
+				continue;
+			}
+			return 0;
+		}
+
+		return 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Run the program without compiling it, uninitialized A, X and M[]
+ * are zeroes.
+ */
+static size_t
+interpret(bpf_ctx_t *bc, struct bpf_insn *insns, size_t insn_count,
+    bpf_args_t *args)
+{
+	struct bpfjit_interp ir;
+	size_t i;
+
+	for (i = 0; i < BPF_MEMWORDS; i++)
+		ir.ir_state.mem[i] = 0;
+	ir.ir_state.regA = 0;
+	ir.ir_x = 0;
+	ir.ir_pc = 0;
+
+	return interp_run(bc, insns, insn_count, args, &ir, NULL);
+}
+
+bpfjit_tiered_t *
+bpfjit_tiered_create(bpf_ctx_t *bc, struct bpf_insn *insns,
+    size_t insn_count, size_t threshold, bpfjit_tiered_hook_t hook,
+    void *arg)
+{
+	bpfjit_tiered_t *bt;
+	size_t i;
+
+	if (insn_count == 0 || insn_count > SIZE_MAX / sizeof(insns[0]))
+		return NULL;
+
+	bt = BJ_ALLOC(sizeof(*bt));
+	if (bt == NULL)
+		return NULL;
+
+	bt->bt_insns = BJ_ALLOC(insn_count * sizeof(insns[0]));
+	if (bt->bt_insns == NULL) {
+		BJ_FREE(bt, sizeof(*bt));
+		return NULL;
+	}
+
+	for (i = 0; i < insn_count; i++)
+		bt->bt_insns[i] = insns[i];
+
+	bt->bt_code = NULL;
+	bt->bt_state = BJ_TIER_INTERP;
+	bt->bt_calls = 0;
+	bt->bt_threshold = threshold;
+	bt->bt_hook = hook;
+	bt->bt_arg = arg;
+	bt->bt_ctx = bc;
+	bt->bt_insn_count = insn_count;
+
+	return bt;
+}
+
+size_t
+bpfjit_tiered_call(bpfjit_tiered_t *bt, bpf_args_t *args)
+{
+	bpfjit_function_t code;
+
+	code = bt->bt_code;
+	if (code != NULL)
+		return code(bt->bt_ctx, args);
+
+	if (bt->bt_calls < bt->bt_threshold) {
+		bt->bt_calls++;
+	} else if (bt->bt_state == BJ_TIER_INTERP) {
+		if (bt->bt_hook == NULL) {
+			code = bpfjit_tiered_compile(bt);
+			if (code != NULL)
+				return code(bt->bt_ctx, args);
+		} else if (BJ_CAS_UINT(&bt->bt_state, BJ_TIER_INTERP,
+		    BJ_TIER_QUEUED) == BJ_TIER_INTERP) {
+			bt->bt_hook(bt, bt->bt_arg);
+		}
+	}
+
+	return interpret(bt->bt_ctx, bt->bt_insns, bt->bt_insn_count, args);
+}
+
+bpfjit_function_t
+bpfjit_tiered_compile(bpfjit_tiered_t *bt)
+{
+	bpfjit_function_t code;
+	unsigned int state;
+
+	state = bt->bt_state;
+	if (state != BJ_TIER_INTERP && state != BJ_TIER_QUEUED)
+		return bt->bt_code;
+
+	if (BJ_CAS_UINT(&bt->bt_state, state, BJ_TIER_BUSY) != state)
+		return bt->bt_code;
+
+	code = bpfjit_generate_code(bt->bt_ctx,
+	    bt->bt_insns, bt->bt_insn_count);
+
+	/* Make the code visible before the pointer. */
+	BJ_MEMBAR_PRODUCER();
+	bt->bt_code = code;
+	bt->bt_state = BJ_TIER_DONE;
+
+	return code;
+}
+
+void
+bpfjit_tiered_destroy(bpfjit_tiered_t *bt)
+{
+
+	if (bt->bt_code != NULL)
+		bpfjit_free_code(bt->bt_code);
+
+	BJ_FREE(bt->bt_insns, bt->bt_insn_count * sizeof(bt->bt_insns[0]));
+	BJ_FREE(bt, sizeof(*bt));
+}
+
+/*
+ * Programs of multi code are concatenated. Program j > 0 starts with
+ * instructions that clear A, X and M[] words it reads. Every BPF_RET
+ * becomes BPF_JMP+BPF_JA to its BJ_MISC_RESULT instruction placed
+ * after the program, results jump to the next program and the last
+ * instruction returns the mask. Passes see one program but loads
+ * and bounds checks aren't shared past BJ_MISC_RESULT. A failed check
+ * stores 0 for its program and continues with the next program, see
+ * emit_multi_fail().
+ */
+#define BJ_MULTI_MAXPROGS	(sizeof(size_t) * CHAR_BIT)
+#define BJ_MULTI_MAXINSNS	(UINT32_MAX / 4 / BJ_MULTI_MAXPROGS)
+
+typedef size_t (*bpfjit_multi_code_t)(bpf_ctx_t *, bpf_args_t *,
+    size_t *);
+
+struct bpfjit_multi {
+	bpfjit_multi_code_t bm_code;
+	bpf_ctx_t *bm_ctx;
+};
+
+static struct bpf_insn *
+put_insn(struct bpf_insn *pc, uint16_t code, uint8_t jt, uint8_t jf,
+    uint32_t k)
+{
+
+	pc->code = code;
+	pc->jt = jt;
+	pc->jf = jf;
+	pc->k = k;
+	return pc + 1;
+}
+
+/*
+ * Return a mask of M[] words read by the program or BJ_INIT_ABIT
+ * if multi code can't include it. Count its BPF_RET instructions.
+ */
+static bpfjit_init_mask_t
+multi_prog(struct bpf_insn *insns, size_t insn_count, size_t *nrets)
+{
+	struct bpf_insn *pc;
+	bpfjit_init_mask_t mem;
+	uint32_t jt, jf;
+	size_t i;
+
+	if (insn_count == 0 || insn_count > BJ_MULTI_MAXINSNS ||
+	    BPF_CLASS(insns[insn_count - 1].code) != BPF_RET) {
+		return BJ_INIT_ABIT;
+	}
+
+	mem = BJ_INIT_NOBITS;
+	*nrets = 0;
+	for (i = 0; i < insn_count; i++) {
+		pc = &insns[i];
+
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_RET:
+			(*nrets)++;
+			break;
 
-	uint32_t jt, jf;
+		case BPF_JMP:
+			jt = jf = pc->k;
+			if (pc->code != (BPF_JMP|BPF_JA)) {
+				jt = pc->jt;
+				jf = pc->jf;
+			}
+			if (jt >= insn_count - (i + 1) ||
+			    jf >= insn_count - (i + 1)) {
+				return BJ_INIT_ABIT;
+			}
+			break;
 
-	rv = NULL;
-	compiler = NULL;
-	insn_dat = NULL;
-	ret0 = NULL;
+		case BPF_MISC:
+			if (BPF_MISCOP(pc->code) == BJ_MISC_RESULT)
+				return BJ_INIT_ABIT;
+			break;
+		}
 
-	if (insn_count == 0 || insn_count > SIZE_MAX / sizeof(insn_dat[0]))
-		goto fail;
+		if ((pc->code == (BPF_LD|BPF_MEM) ||
+		    pc->code == (BPF_LDX|BPF_W|BPF_MEM)) &&
+		    pc->k < BPF_MEMWORDS) {
+			mem |= BJ_INIT_MBIT(pc->k);
+		}
+	}
 
-	insn_dat = BJ_ALLOC(insn_count * sizeof(insn_dat[0]));
-	if (insn_dat == NULL)
-		goto fail;
+	return mem;
+}
 
-	if (!optimize1(insns, insn_dat, insn_count,
-	    &initmask, &nscratches, &ncopfuncs)) {
-		goto fail;
+bpfjit_multi_t *
+bpfjit_multi_create(bpf_ctx_t *bc, struct bpf_insn *const *progs,
+    const size_t *insn_counts, size_t nprogs)
+{
+	bpfjit_multi_t *bm;
+	struct bpf_insn *insns, *pc, *res;
+	bpfjit_init_mask_t mem[BJ_MULTI_MAXPROGS];
+	size_t nrets[BJ_MULTI_MAXPROGS];
+	size_t i, j, k, r, n, insn_count;
+
+	if (nprogs == 0 || nprogs > BJ_MULTI_MAXPROGS)
+		return NULL;
+
+	insn_count = 1;
+	for (j = 0; j < nprogs; j++) {
+		mem[j] = multi_prog(progs[j], insn_counts[j], &nrets[j]);
+		if (mem[j] & BJ_INIT_ABIT)
+			return NULL;
+
+		if (j > 0) {
+			insn_count += 2;
+			for (k = 0; k < BPF_MEMWORDS; k++) {
+				if (mem[j] & BJ_INIT_MBIT(k))
+					insn_count++;
+			}
+		}
+
+		insn_count += insn_counts[j] + 2 * nrets[j] - 1;
 	}
 
-#if defined(_KERNEL)
-	/* bpf_filter() checks initialization of memwords. */
-	BJ_ASSERT((initmask & BJ_INIT_MMASK) == 0);
-#endif
+	if (insn_count > SIZE_MAX / sizeof(insns[0]))
+		return NULL;
 
-	ret0_size = 0;
-	ret0_maxsize = 64;
-	ret0 = BJ_ALLOC(ret0_maxsize * sizeof(ret0[0]));
-	if (ret0 == NULL)
-		goto fail;
+	bm = BJ_ALLOC(sizeof(*bm));
+	if (bm == NULL)
+		return NULL;
 
-	compiler = sljit_create_compiler();
-	if (compiler == NULL)
+	bm->bm_ctx = bc;
+	bm->bm_code = NULL;
+
+	insns = BJ_ALLOC(insn_count * sizeof(insns[0]));
+	if (insns == NULL)
 		goto fail;
 
-#if !defined(_KERNEL) && defined(SLJIT_VERBOSE) && SLJIT_VERBOSE
-	sljit_compiler_verbose(compiler, stderr);
-#endif
+	pc = insns;
+	for (j = 0; j < nprogs; j++) {
+		n = insn_counts[j];
 
-	status = sljit_emit_enter(compiler,
-	    2, nscratches, 3, sizeof(struct bpfjit_stack));
-	if (status != SLJIT_SUCCESS)
-		goto fail;
+		if (j > 0) {
+			pc = put_insn(pc, BPF_LD|BPF_IMM, 0, 0, 0);
+			for (k = 0; k < BPF_MEMWORDS; k++) {
+				if (mem[j] & BJ_INIT_MBIT(k))
+					pc = put_insn(pc, BPF_ST, 0, 0, k);
+			}
+			pc = put_insn(pc, BPF_LDX|BPF_W|BPF_IMM, 0, 0, 0);
+		}
 
-	if (ncopfuncs > 0) {
-		/* save ctx argument */
-		status = sljit_emit_op1(compiler,
-		    SLJIT_MOV_P,
-		    SLJIT_MEM1(SLJIT_LOCALS_REG),
-		    offsetof(struct bpfjit_stack, ctx),
-		    BJ_CTX_ARG, 0);
-		if (status != SLJIT_SUCCESS)
-			goto fail;
+		/* Results follow the program, one per BPF_RET. */
+		res = pc + n;
+		for (i = r = 0; i < n; i++) {
+			if (BPF_CLASS(progs[j][i].code) != BPF_RET) {
+				pc[i] = progs[j][i];
+				continue;
+			}
+
+			put_insn(&pc[i], BPF_JMP|BPF_JA, 0, 0,
+			    &res[2 * r] - &pc[i + 1]);
+			put_insn(&res[2 * r], BPF_MISC|BJ_MISC_RESULT, j,
+			    BPF_RVAL(progs[j][i].code) == BPF_A,
+			    progs[j][i].k);
+			if (++r < nrets[j]) {
+				put_insn(&res[2 * r - 1], BPF_JMP|BPF_JA, 0, 0,
+				    &res[2 * nrets[j] - 1] - &res[2 * r]);
+			}
+		}
+
+		pc = &res[2 * nrets[j] - 1];
 	}
 
-	status = load_buf_buflen(compiler);
-	if (status != SLJIT_SUCCESS)
-		goto fail;
+	/* k isn't 0, see ret0_insn(). */
+	pc = put_insn(pc, BPF_RET|BPF_K, 0, 0, 1);
+	BJ_ASSERT(pc == &insns[insn_count]);
 
-	/* Copy args->buflen to the register. */
-	status = sljit_emit_op1(compiler,
-	    SLJIT_MOV,
-	    BJ_BUFLEN, 0,
-	    SLJIT_MEM1(BJ_ARGS),
-	    offsetof(struct bpf_args, buflen));
-	if (status != SLJIT_SUCCESS)
+	bm->bm_code = (bpfjit_multi_code_t)(void *)generate_code(bc,
+	    insns, insn_count, NULL, BJ_GEN_MULTI);
+	BJ_FREE(insns, insn_count * sizeof(insns[0]));
+	if (bm->bm_code == NULL)
 		goto fail;
 
-	for (i = 0; i < BPF_MEMWORDS; i++) {
-		if (initmask & BJ_INIT_MBIT(i)) {
-			status = sljit_emit_op1(compiler,
-			    SLJIT_MOV_UI,
-			    SLJIT_MEM1(SLJIT_LOCALS_REG),
-			    offsetof(struct bpf_state, mem) +
-			        i * sizeof(uint32_t),
-			    SLJIT_IMM, 0);
-			if (status != SLJIT_SUCCESS)
-				goto fail;
-		}
-	}
+	return bm;
 
-	if (initmask & BJ_INIT_ABIT) {
-		/* A = 0; */
-		status = sljit_emit_op1(compiler,
-		    SLJIT_MOV,
-		    BJ_AREG, 0,
-		    SLJIT_IMM, 0);
-		if (status != SLJIT_SUCCESS)
-			goto fail;
-	}
+fail:
+	bpfjit_multi_destroy(bm);
+	return NULL;
+}
 
-	if (initmask & BJ_INIT_XBIT) {
-		/* X = 0; */
-		status = sljit_emit_op1(compiler,
-		    SLJIT_MOV,
-		    BJ_XREG, 0,
-		    SLJIT_IMM, 0);
-		if (status != SLJIT_SUCCESS)
-			goto fail;
-	}
+size_t
+bpfjit_multi_call(bpfjit_multi_t *bm, bpf_args_t *args, size_t *res)
+{
 
-	for (i = 0; i < insn_count; i++) {
-		if (insn_dat[i].bj_unreachable)
-			continue;
+	return bm->bm_code(bm->bm_ctx, args, res);
+}
 
-		to_mchain_jump = NULL;
+void
+bpfjit_multi_destroy(bpfjit_multi_t *bm)
+{
 
-		/*
-		 * Resolve jumps to the current insn.
-		 */
-		label = NULL;
-		SLIST_FOREACH(bjump, &insn_dat[i].bj_jumps, bj_entries) {
-			if (bjump->bj_jump != NULL) {
-				if (label == NULL)
-					label = sljit_emit_label(compiler);
-				if (label == NULL)
-					goto fail;
-				sljit_set_label(bjump->bj_jump, label);
-			}
+	if (bm->bm_code != NULL)
+		sljit_free_code((void *)bm->bm_code);
+
+	BJ_FREE(bm, sizeof(*bm));
+}
+
+/*
+ * A filter set keeps the first program as a skeleton. Key j is
+ * the j-th BPF_JMP+BPF_JEQ+BPF_K instruction whose k differs between
+ * programs, fs_key[i] is j + 1 for that instruction and 0 otherwise.
+ * A slot of the hash table holds ids of programs that compare key j
+ * with val, they are fs_ids[fs_start .. fs_start + fs_count - 1]
+ * in ascending order.
+ *
+ * bpfjit_fset_call() runs the skeleton in interp_run() which stops
+ * at keys. Programs that follow the same path form a group, either
+ * a slot picked by the first key that jumped to jt or all programs
+ * before that. A key that splits the group forks the walk and adds
+ * a constraint to each side. Every program follows one path, so
+ * a call reaches each program's BPF_RET once.
+ */
+#define BJ_FSET_MAXKEYS	32
+#define BJ_FSET_MAXSLOTS	((size_t)1 << 31)
+
+struct bpfjit_fset_slot {
+	uint32_t fs_val;
+	uint32_t fs_key; /* key + 1, 0 if the slot is empty */
+	size_t fs_start;
+	size_t fs_count;
+};
+
+struct bpfjit_fset {
+	struct bpf_insn *fs_insns;
+	uint8_t *fs_key;
+	size_t fs_insn_count;
+	size_t fs_nprogs;
+	size_t fs_nkeys;
+	uint32_t *fs_kv; /* k of key j in program f is fs_kv[f * nkeys + j] */
+	size_t *fs_ids;
+	struct bpfjit_fset_slot *fs_slots;
+	size_t fs_nslots;
+	unsigned int fs_shift;
+};
+
+struct bpfjit_fset_cons {
+	uint32_t fc_val;
+	uint8_t fc_key;
+	bool fc_eq;
+};
+
+struct bpfjit_fset_walk {
+	size_t *fw_ids;
+	size_t fw_maxids;
+	size_t fw_nids;
+	struct bpfjit_fset_cons fw_cons[BJ_FSET_MAXKEYS];
+};
+
+/*
+ * Return the slot of (key, val) or the empty slot where it belongs.
+ */
+static size_t
+fset_find(const bpfjit_fset_t *fs, size_t key, uint32_t val)
+{
+	const struct bpfjit_fset_slot *slot;
+	size_t h;
+
+	h = (uint32_t)((val + (uint32_t)key * 0x85ebca6bu) * 0x9e3779b1u) >>
+	    fs->fs_shift;
+	for (;; h = (h + 1) & (fs->fs_nslots - 1)) {
+		slot = &fs->fs_slots[h];
+		if (slot->fs_key == 0 ||
+		    (slot->fs_key == key + 1 && slot->fs_val == val)) {
+			return h;
 		}
+	}
+}
 
-		if (read_pkt_insn(&insns[i], NULL) &&
-		    insn_dat[i].bj_aux.bj_rdata.bj_check_length > 0) {
-			/* if (buflen < bj_check_length) return 0; */
-			jump = sljit_emit_cmp(compiler,
-			    SLJIT_C_LESS,
-			    BJ_BUFLEN, 0,
-			    SLJIT_IMM,
-			    insn_dat[i].bj_aux.bj_rdata.bj_check_length);
-			if (jump == NULL)
-		  		goto fail;
-#ifdef _KERNEL
-			to_mchain_jump = jump;
-#else
-			if (!append_jump(jump, &ret0,
-			    &ret0_size, &ret0_maxsize))
-				goto fail;
-#endif
+static bool
+fset_member(const bpfjit_fset_t *fs, const struct bpfjit_fset_walk *fw,
+    size_t ncons, size_t f)
+{
+	const struct bpfjit_fset_cons *fc;
+	size_t c;
+
+	for (c = 0; c < ncons; c++) {
+		fc = &fw->fw_cons[c];
+		if ((fs->fs_kv[f * fs->fs_nkeys + fc->fc_key] == fc->fc_val) !=
+		    fc->fc_eq) {
+			return false;
 		}
+	}
 
-		pc = &insns[i];
-		switch (BPF_CLASS(pc->code)) {
+	return true;
+}
 
-		default:
-			goto fail;
+static void
+fset_add(const bpfjit_fset_t *fs, struct bpfjit_fset_walk *fw,
+    size_t ncons, size_t f)
+{
 
-		case BPF_LD:
-			/* BPF_LD+BPF_IMM          A <- k */
-			if (pc->code == (BPF_LD|BPF_IMM)) {
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV,
-				    BJ_AREG, 0,
-				    SLJIT_IMM, (uint32_t)pc->k);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+	if (!fset_member(fs, fw, ncons, f))
+		return;
 
-				continue;
-			}
+	if (fw->fw_nids < fw->fw_maxids)
+		fw->fw_ids[fw->fw_nids] = f;
+	fw->fw_nids++;
+}
 
-			/* BPF_LD+BPF_MEM          A <- M[k] */
-			if (pc->code == (BPF_LD|BPF_MEM)) {
-				if (pc->k >= BPF_MEMWORDS)
-					goto fail;
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV_UI,
-				    BJ_AREG, 0,
-				    SLJIT_MEM1(SLJIT_LOCALS_REG),
-				    offsetof(struct bpf_state, mem) +
-				        pc->k * sizeof(uint32_t));
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+/*
+ * Walk the skeleton for a group of programs, group is NULL for all
+ * programs.
+ */
+static void
+fset_walk(const bpfjit_fset_t *fs, bpf_args_t *args,
+    struct bpfjit_interp *ir, const struct bpfjit_fset_slot *group,
+    struct bpfjit_fset_walk *fw, size_t ncons)
+{
+	struct bpfjit_interp fork;
+	const struct bpfjit_fset_slot *slot;
+	const struct bpf_insn *pc;
+	size_t i, f, key, nt, nf;
+	uint32_t A;
+
+	for (;;) {
+		if (interp_run(NULL, fs->fs_insns, fs->fs_insn_count,
+		    args, ir, fs->fs_key) != 0) {
+			break;
+		}
 
-				continue;
+		i = ir->ir_pc;
+		if (i == fs->fs_insn_count)
+			return;
+
+		pc = &fs->fs_insns[i];
+		key = fs->fs_key[i] - 1;
+		A = ir->ir_state.regA;
+
+		slot = group;
+		nt = nf = 0;
+		if (group == NULL) {
+			/* Assume some programs don't compare key with A. */
+			slot = &fs->fs_slots[fset_find(fs, key, A)];
+			nt = slot->fs_key != 0;
+			nf = 1;
+		} else {
+			for (f = 0; f < group->fs_count &&
+			    (nt == 0 || nf == 0); f++) {
+				if (!fset_member(fs, fw, ncons,
+				    fs->fs_ids[group->fs_start + f])) {
+					continue;
+				}
+
+				if (fs->fs_kv[fs->fs_ids[group->fs_start + f] *
+				    fs->fs_nkeys + key] == A) {
+					nt++;
+				} else {
+					nf++;
+				}
 			}
 
-			/* BPF_LD+BPF_W+BPF_LEN    A <- len */
-			if (pc->code == (BPF_LD|BPF_W|BPF_LEN)) {
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV,
-				    BJ_AREG, 0,
-				    SLJIT_MEM1(BJ_ARGS),
-				    offsetof(struct bpf_args, wirelen));
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+			if (nt == 0 && nf == 0)
+				return;
+		}
 
-				continue;
-			}
+		if (nf == 0) {
+			ir->ir_pc = i + 1 + pc->jt;
+			continue;
+		}
 
-			mode = BPF_MODE(pc->code);
-			if (mode != BPF_ABS && mode != BPF_IND)
-				goto fail;
+		if (nt != 0) {
+			fork = *ir;
+			fork.ir_pc = i + 1 + pc->jt;
+			fw->fw_cons[ncons].fc_key = key;
+			fw->fw_cons[ncons].fc_val = A;
+			fw->fw_cons[ncons].fc_eq = true;
+			fset_walk(fs, args, &fork, slot, fw, ncons + 1);
 
-			status = emit_pkt_read(compiler, pc,
-			    to_mchain_jump, &ret0, &ret0_size, &ret0_maxsize);
-			if (status != SLJIT_SUCCESS)
-				goto fail;
+			fw->fw_cons[ncons].fc_eq = false;
+			ncons++;
+		}
 
-			continue;
+		ir->ir_pc = i + 1 + pc->jf;
+	}
 
-		case BPF_LDX:
-			mode = BPF_MODE(pc->code);
+	if (group == NULL) {
+		for (f = 0; f < fs->fs_nprogs; f++)
+			fset_add(fs, fw, ncons, f);
+	} else {
+		for (f = group->fs_start;
+		    f < group->fs_start + group->fs_count; f++) {
+			fset_add(fs, fw, ncons, fs->fs_ids[f]);
+		}
+	}
+}
 
-			/* BPF_LDX+BPF_W+BPF_IMM    X <- k */
-			if (mode == BPF_IMM) {
-				if (BPF_SIZE(pc->code) != BPF_W)
-					goto fail;
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV,
-				    BJ_XREG, 0,
-				    SLJIT_IMM, (uint32_t)pc->k);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+/*
+ * Check the skeleton and mark keys, return the number of keys
+ * or BJ_FSET_MAXKEYS + 1 if programs can't form a set.
+ */
+static size_t
+fset_keys(struct bpf_insn *const *progs, size_t insn_count,
+    size_t nprogs, uint8_t *keys)
+{
+	const struct bpf_insn *pc, *other;
+	size_t i, f, nkeys;
+	uint32_t jt, jf;
+	bool differ;
 
-				continue;
+	if (BPF_CLASS(progs[0][insn_count - 1].code) != BPF_RET)
+		return BJ_FSET_MAXKEYS + 1;
+
+	nkeys = 0;
+	for (i = 0; i < insn_count; i++) {
+		pc = &progs[0][i];
+		differ = false;
+
+		for (f = 1; f < nprogs; f++) {
+			other = &progs[f][i];
+			if (other->code != pc->code ||
+			    other->jt != pc->jt || other->jf != pc->jf) {
+				return BJ_FSET_MAXKEYS + 1;
 			}
+			differ = differ || other->k != pc->k;
+		}
 
-			/* BPF_LDX+BPF_W+BPF_LEN    X <- len */
-			if (mode == BPF_LEN) {
-				if (BPF_SIZE(pc->code) != BPF_W)
-					goto fail;
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV,
-				    BJ_XREG, 0,
-				    SLJIT_MEM1(BJ_ARGS),
-				    offsetof(struct bpf_args, wirelen));
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+		keys[i] = 0;
+		if (differ) {
+			if (pc->code != (BPF_JMP|BPF_JEQ|BPF_K) ||
+			    nkeys == BJ_FSET_MAXKEYS) {
+				return BJ_FSET_MAXKEYS + 1;
+			}
+			keys[i] = ++nkeys;
+		}
 
-				continue;
+		switch (BPF_CLASS(pc->code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			if (BPF_MODE(pc->code) == BPF_MEM &&
+			    pc->k >= BPF_MEMWORDS) {
+				return BJ_FSET_MAXKEYS + 1;
 			}
+			break;
 
-			/* BPF_LDX+BPF_W+BPF_MEM    X <- M[k] */
-			if (mode == BPF_MEM) {
-				if (BPF_SIZE(pc->code) != BPF_W)
-					goto fail;
-				if (pc->k >= BPF_MEMWORDS)
-					goto fail;
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV_UI,
-				    BJ_XREG, 0,
-				    SLJIT_MEM1(SLJIT_LOCALS_REG),
-				    offsetof(struct bpf_state, mem) +
-				        pc->k * sizeof(uint32_t));
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+		case BPF_ST:
+		case BPF_STX:
+			if (pc->k >= BPF_MEMWORDS)
+				return BJ_FSET_MAXKEYS + 1;
+			break;
 
-				continue;
+		case BPF_JMP:
+			jt = jf = pc->k;
+			if (pc->code != (BPF_JMP|BPF_JA)) {
+				jt = pc->jt;
+				jf = pc->jf;
+			}
+			if (jt >= insn_count - (i + 1) ||
+			    jf >= insn_count - (i + 1)) {
+				return BJ_FSET_MAXKEYS + 1;
 			}
+			break;
 
-			/* BPF_LDX+BPF_B+BPF_MSH    X <- 4*(P[k:1]&0xf) */
-			if (mode != BPF_MSH || BPF_SIZE(pc->code) != BPF_B)
-				goto fail;
+		case BPF_MISC:
+			if (BPF_MISCOP(pc->code) == BPF_COP ||
+			    BPF_MISCOP(pc->code) == BPF_COPX) {
+				return BJ_FSET_MAXKEYS + 1;
+			}
+			break;
+		}
+	}
 
-			status = emit_msh(compiler, pc,
-			    to_mchain_jump, &ret0, &ret0_size, &ret0_maxsize);
-			if (status != SLJIT_SUCCESS)
-				goto fail;
+	return nkeys;
+}
 
-			continue;
+bpfjit_fset_t *
+bpfjit_fset_create(struct bpf_insn *const *progs, size_t insn_count,
+    size_t nprogs)
+{
+	bpfjit_fset_t *fs;
+	struct bpfjit_fset_slot *slot;
+	size_t i, f, j, nkeys, start;
 
-		case BPF_ST:
-			if (pc->code != BPF_ST || pc->k >= BPF_MEMWORDS)
-				goto fail;
+	if (nprogs == 0 || insn_count == 0 ||
+	    insn_count > SIZE_MAX / sizeof(fs->fs_insns[0])) {
+		return NULL;
+	}
 
-			status = sljit_emit_op1(compiler,
-			    SLJIT_MOV_UI,
-			    SLJIT_MEM1(SLJIT_LOCALS_REG),
-			    offsetof(struct bpf_state, mem) + 
-			        pc->k * sizeof(uint32_t),
-			    BJ_AREG, 0);
-			if (status != SLJIT_SUCCESS)
-				goto fail;
+	fs = BJ_ALLOC(sizeof(*fs));
+	if (fs == NULL)
+		return NULL;
+
+	fs->fs_insn_count = insn_count;
+	fs->fs_nprogs = nprogs;
+	fs->fs_nkeys = 0;
+	fs->fs_insns = NULL;
+	fs->fs_kv = NULL;
+	fs->fs_ids = NULL;
+	fs->fs_slots = NULL;
+	fs->fs_nslots = 0;
+
+	fs->fs_key = BJ_ALLOC(insn_count * sizeof(fs->fs_key[0]));
+	if (fs->fs_key == NULL)
+		goto fail;
 
-			continue;
+	nkeys = fset_keys(progs, insn_count, nprogs, fs->fs_key);
+	if (nkeys > BJ_FSET_MAXKEYS ||
+	    nprogs > BJ_FSET_MAXSLOTS / 2 / BJ_FSET_MAXKEYS ||
+	    nprogs * nkeys > SIZE_MAX / 4 / sizeof(fs->fs_slots[0])) {
+		goto fail;
+	}
 
-		case BPF_STX:
-			if (pc->code != BPF_STX || pc->k >= BPF_MEMWORDS)
-				goto fail;
+	fs->fs_insns = BJ_ALLOC(insn_count * sizeof(fs->fs_insns[0]));
+	if (fs->fs_insns == NULL)
+		goto fail;
 
-			status = sljit_emit_op1(compiler,
-			    SLJIT_MOV_UI,
-			    SLJIT_MEM1(SLJIT_LOCALS_REG),
-			    offsetof(struct bpf_state, mem) + 
-			        pc->k * sizeof(uint32_t),
-			    BJ_XREG, 0);
-			if (status != SLJIT_SUCCESS)
-				goto fail;
+	for (i = 0; i < insn_count; i++)
+		fs->fs_insns[i] = progs[0][i];
 
-			continue;
+	if (nkeys == 0)
+		return fs;
 
-		case BPF_ALU:
-			if (pc->code == (BPF_ALU|BPF_NEG)) {
-				status = sljit_emit_op1(compiler,
-				    SLJIT_NEG,
-				    BJ_AREG, 0,
-				    BJ_AREG, 0);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+	fs->fs_nkeys = nkeys;
+	fs->fs_kv = BJ_ALLOC(nprogs * nkeys * sizeof(fs->fs_kv[0]));
+	if (fs->fs_kv == NULL)
+		goto fail;
 
-				continue;
-			}
+	fs->fs_ids = BJ_ALLOC(nprogs * nkeys * sizeof(fs->fs_ids[0]));
+	if (fs->fs_ids == NULL)
+		goto fail;
 
-			if (BPF_OP(pc->code) != BPF_DIV) {
-				status = sljit_emit_op2(compiler,
-				    bpf_alu_to_sljit_op(pc),
-				    BJ_AREG, 0,
-				    BJ_AREG, 0,
-				    kx_to_reg(pc), kx_to_reg_arg(pc));
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+	fs->fs_nslots = 2;
+	fs->fs_shift = 31;
+	while (fs->fs_nslots < 2 * nprogs * nkeys) {
+		fs->fs_nslots *= 2;
+		fs->fs_shift--;
+	}
 
-				continue;
-			}
+	fs->fs_slots = BJ_ALLOC(fs->fs_nslots * sizeof(fs->fs_slots[0]));
+	if (fs->fs_slots == NULL)
+		goto fail;
 
-			/* BPF_DIV */
+	for (i = 0; i < fs->fs_nslots; i++) {
+		fs->fs_slots[i].fs_key = 0;
+		fs->fs_slots[i].fs_count = 0;
+	}
 
-			src = BPF_SRC(pc->code);
-			if (src != BPF_X && src != BPF_K)
-				goto fail;
+	for (i = 0; i < insn_count; i++) {
+		if (fs->fs_key[i] == 0)
+			continue;
 
-			/* division by zero? */
-			if (src == BPF_X) {
-				jump = sljit_emit_cmp(compiler,
-				    SLJIT_C_EQUAL|SLJIT_INT_OP,
-				    BJ_XREG, 0, 
-				    SLJIT_IMM, 0);
-				if (jump == NULL)
-					goto fail;
-				if (!append_jump(jump, &ret0,
-				    &ret0_size, &ret0_maxsize))
-					goto fail;
-			} else if (pc->k == 0) {
-				jump = sljit_emit_jump(compiler, SLJIT_JUMP);
-				if (jump == NULL)
-					goto fail;
-				if (!append_jump(jump, &ret0,
-				    &ret0_size, &ret0_maxsize))
-					goto fail;
-			}
+		j = fs->fs_key[i] - 1;
+		for (f = 0; f < nprogs; f++) {
+			fs->fs_kv[f * nkeys + j] = progs[f][i].k;
 
-			if (src == BPF_X) {
-				status = emit_division(compiler, BJ_XREG, 0);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
-			} else if (pc->k != 0) {
-				if (pc->k & (pc->k - 1)) {
-				    status = emit_division(compiler,
-				        SLJIT_IMM, (uint32_t)pc->k);
-				} else {
-				    status = emit_pow2_division(compiler,
-				        (uint32_t)pc->k);
-				}
-				if (status != SLJIT_SUCCESS)
-					goto fail;
-			}
+			slot = &fs->fs_slots[fset_find(fs, j, progs[f][i].k)];
+			slot->fs_key = j + 1;
+			slot->fs_val = progs[f][i].k;
+			slot->fs_count++;
+		}
+	}
 
-			continue;
+	start = 0;
+	for (i = 0; i < fs->fs_nslots; i++) {
+		slot = &fs->fs_slots[i];
+		slot->fs_start = start;
+		start += slot->fs_count;
+		slot->fs_count = 0;
+	}
 
-		case BPF_JMP:
-			if (pc->code == (BPF_JMP|BPF_JA)) {
-				jt = jf = pc->k;
-			} else {
-				jt = pc->jt;
-				jf = pc->jf;
-			}
+	for (j = 0; j < nkeys; j++) {
+		for (f = 0; f < nprogs; f++) {
+			slot = &fs->fs_slots[fset_find(fs, j,
+			    fs->fs_kv[f * nkeys + j])];
+			fs->fs_ids[slot->fs_start + slot->fs_count++] = f;
+		}
+	}
 
-			negate = (jt == 0) ? 1 : 0;
-			branching = (jt == jf) ? 0 : 1;
-			jtf = insn_dat[i].bj_aux.bj_jdata.bj_jtf;
+	return fs;
 
-			if (branching) {
-				if (BPF_OP(pc->code) != BPF_JSET) {
-					jump = sljit_emit_cmp(compiler,
-					    bpf_jmp_to_sljit_cond(pc, negate),
-					    BJ_AREG, 0,
-					    kx_to_reg(pc), kx_to_reg_arg(pc));
-				} else {
-					status = sljit_emit_op2(compiler,
-					    SLJIT_AND,
-					    BJ_TMP1REG, 0,
-					    BJ_AREG, 0,
-					    kx_to_reg(pc), kx_to_reg_arg(pc));
-					if (status != SLJIT_SUCCESS)
-						goto fail;
+fail:
+	bpfjit_fset_destroy(fs);
+	return NULL;
+}
 
-					jump = sljit_emit_cmp(compiler,
-					    bpf_jmp_to_sljit_cond(pc, negate),
-					    BJ_TMP1REG, 0,
-					    SLJIT_IMM, 0);
-				}
+size_t
+bpfjit_fset_call(const bpfjit_fset_t *fs, bpf_args_t *args,
+    size_t *ids, size_t maxids)
+{
+	struct bpfjit_fset_walk fw;
+	struct bpfjit_interp ir;
+	size_t i;
 
-				if (jump == NULL)
-					goto fail;
+	for (i = 0; i < BPF_MEMWORDS; i++)
+		ir.ir_state.mem[i] = 0;
+	ir.ir_state.regA = 0;
+	ir.ir_x = 0;
+	ir.ir_pc = 0;
 
-				BJ_ASSERT(jtf[negate].bj_jump == NULL);
-				jtf[negate].bj_jump = jump;
-			}
+	fw.fw_ids = ids;
+	fw.fw_maxids = maxids;
+	fw.fw_nids = 0;
+	fset_walk(fs, args, &ir, NULL, &fw, 0);
 
-			if (!branching || (jt != 0 && jf != 0)) {
-				jump = sljit_emit_jump(compiler, SLJIT_JUMP);
-				if (jump == NULL)
-					goto fail;
+	return fw.fw_nids;
+}
 
-				BJ_ASSERT(jtf[branching].bj_jump == NULL);
-				jtf[branching].bj_jump = jump;
-			}
+void
+bpfjit_fset_destroy(bpfjit_fset_t *fs)
+{
 
-			continue;
+	if (fs->fs_slots != NULL) {
+		BJ_FREE(fs->fs_slots,
+		    fs->fs_nslots * sizeof(fs->fs_slots[0]));
+	}
 
-		case BPF_RET:
-			rval = BPF_RVAL(pc->code);
-			if (rval == BPF_X)
-				goto fail;
+	if (fs->fs_ids != NULL) {
+		BJ_FREE(fs->fs_ids,
+		    fs->fs_nprogs * fs->fs_nkeys * sizeof(fs->fs_ids[0]));
+	}
 
-			/* BPF_RET+BPF_K    accept k bytes */
-			if (rval == BPF_K) {
-				status = sljit_emit_return(compiler,
-				    SLJIT_MOV_UI,
-				    SLJIT_IMM, (uint32_t)pc->k);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
-			}
+	if (fs->fs_kv != NULL) {
+		BJ_FREE(fs->fs_kv,
+		    fs->fs_nprogs * fs->fs_nkeys * sizeof(fs->fs_kv[0]));
+	}
 
-			/* BPF_RET+BPF_A    accept A bytes */
-			if (rval == BPF_A) {
-				status = sljit_emit_return(compiler,
-				    SLJIT_MOV_UI,
-				    BJ_AREG, 0);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
-			}
+	if (fs->fs_insns != NULL) {
+		BJ_FREE(fs->fs_insns,
+		    fs->fs_insn_count * sizeof(fs->fs_insns[0]));
+	}
 
-			continue;
+	if (fs->fs_key != NULL) {
+		BJ_FREE(fs->fs_key,
+		    fs->fs_insn_count * sizeof(fs->fs_key[0]));
+	}
 
-		case BPF_MISC:
-			switch (BPF_MISCOP(pc->code)) {
-			case BPF_TAX:
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV_UI,
-				    BJ_XREG, 0,
-				    BJ_AREG, 0);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+	BJ_FREE(fs, sizeof(*fs));
+}
 
-				continue;
+static bool
+hset_member(const bpfjit_hset_t *hs, uint32_t k)
+{
+	size_t h;
 
-			case BPF_TXA:
-				status = sljit_emit_op1(compiler,
-				    SLJIT_MOV,
-				    BJ_AREG, 0,
-				    BJ_XREG, 0);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+	if (k == 0)
+		return hs->hs_zero != 0;
 
-				continue;
+	for (h = (uint32_t)(k * BJ_HSET_MUL) >> hs->hs_shift;
+	    hs->hs_keys[h] != 0; h++) {
+		if (hs->hs_keys[h] == k)
+			return true;
+	}
 
-			case BPF_COP:
-			case BPF_COPX:
-				jump = NULL;
-				status = emit_cop(compiler, bc, pc, &jump);
-				if (status != SLJIT_SUCCESS)
-					goto fail;
+	return false;
+}
 
-				if (jump != NULL && !append_jump(jump,
-				    &ret0, &ret0_size, &ret0_maxsize))
-					goto fail;
+uint32_t
+bpfjit_hset_cop(bpf_ctx_t *bc, bpf_args_t *args, bpf_state_t *state)
+{
 
-				continue;
-			}
+	(void)args;
+	return bc->hset != NULL && hset_member(bc->hset, state->regA);
+}
 
-			goto fail;
-		} /* switch */
-	} /* main loop */
+/*
+ * The hash range has at least twice as many slots as keys.
+ */
+bpfjit_hset_t *
+bpfjit_hset_create(const uint32_t *keys, size_t nkeys)
+{
+	bpfjit_hset_t *hs;
+	uint32_t *slots;
+	size_t i, h, range, nslots, last;
 
-	BJ_ASSERT(ret0_size <= ret0_maxsize);
+	if (nkeys > (SIZE_MAX / sizeof(slots[0]) - 2) / 3 ||
+	    nkeys > UINT32_MAX / 2) {
+		return NULL;
+	}
 
-	if (ret0_size > 0) {
-		label = sljit_emit_label(compiler);
-		if (label == NULL)
-			goto fail;
-		for (i = 0; i < ret0_size; i++)
-			sljit_set_label(ret0[i], label);
+	hs = BJ_ALLOC(sizeof(*hs));
+	if (hs == NULL)
+		return NULL;
+
+	hs->hs_zero = 0;
+	hs->hs_shift = 31;
+	for (range = 2; range < 2 * nkeys; range *= 2)
+		hs->hs_shift--;
+
+	/* Insert into a table where no probe can run past its end. */
+	nslots = range + nkeys + 1;
+	slots = BJ_ALLOC(nslots * sizeof(slots[0]));
+	if (slots == NULL) {
+		BJ_FREE(hs, sizeof(*hs));
+		return NULL;
 	}
 
-	status = sljit_emit_return(compiler,
-	    SLJIT_MOV_UI,
-	    SLJIT_IMM, 0);
-	if (status != SLJIT_SUCCESS)
-		goto fail;
+	for (i = 0; i < nslots; i++)
+		slots[i] = 0;
 
-	rv = sljit_generate_code(compiler);
+	last = range - 1;
+	for (i = 0; i < nkeys; i++) {
+		if (keys[i] == 0) {
+			hs->hs_zero = 1;
+			continue;
+		}
 
-fail:
-	if (compiler != NULL)
-		sljit_free_compiler(compiler);
+		h = (uint32_t)(keys[i] * BJ_HSET_MUL) >> hs->hs_shift;
+		while (slots[h] != 0 && slots[h] != keys[i])
+			h++;
 
-	if (insn_dat != NULL)
-		BJ_FREE(insn_dat, insn_count * sizeof(insn_dat[0]));
+		slots[h] = keys[i];
+		if (h > last)
+			last = h;
+	}
 
-	if (ret0 != NULL)
-		BJ_FREE(ret0, ret0_maxsize * sizeof(ret0[0]));
+	/* Keep one empty slot after the last key. */
+	hs->hs_nslots = last + 2;
+	hs->hs_keys = BJ_ALLOC(hs->hs_nslots * sizeof(hs->hs_keys[0]));
+	if (hs->hs_keys != NULL) {
+		for (i = 0; i < hs->hs_nslots; i++)
+			hs->hs_keys[i] = slots[i];
+	}
 
-	return (bpfjit_function_t)rv;
+	BJ_FREE(slots, nslots * sizeof(slots[0]));
+
+	if (hs->hs_keys == NULL) {
+		BJ_FREE(hs, sizeof(*hs));
+		return NULL;
+	}
+
+	return hs;
 }
 
 void
-bpfjit_free_code(bpfjit_function_t code)
+bpfjit_hset_destroy(bpfjit_hset_t *hs)
 {
 
-	sljit_free_code((void *)code);
+	BJ_FREE(hs->hs_keys, hs->hs_nslots * sizeof(hs->hs_keys[0]));
+	BJ_FREE(hs, sizeof(*hs));
 }
@@ -49,6 +49,10 @@
 #define BPF_COPX 0x40
 #endif
 
+#ifndef BPF_MOD
+#define BPF_MOD  0x90
+#endif
+
 struct bpf_ctx;
 typedef struct bpf_ctx bpf_ctx_t;
 
@@ -67,11 +71,54 @@ struct bpf_args {
 	void *		arg;
 };
 
+struct sljit_compiler;
+
+/*
+ * Registers available to an inline copfunc. The emitted code reads
+ * A from a and leaves the result there. It may read args, a pointer
+ * to bpf_args_t, and it may overwrite tmp[0] and tmp[1]. It must
+ * not touch other registers, the stack or M[] and it must fall
+ * through to its end.
+ */
+struct bpfjit_cop_regs {
+	int	a;
+	int	args;
+	int	tmp[2];
+};
+
+/*
+ * Emitter of an inline copfunc, it returns SLJIT_SUCCESS or an sljit
+ * error code. The code should compute the same value as the copfunc
+ * with the same index, BPF_COPX and interpreters call the copfunc.
+ */
+typedef int (*bpfjit_copemit_t)(struct sljit_compiler *,
+    const struct bpfjit_cop_regs *);
+
+struct bpfjit_hset;
+typedef struct bpfjit_hset bpfjit_hset_t;
+
 struct bpf_ctx {
 	const bpf_copfunc_t *	copfuncs;
 	size_t			nfuncs;
+	const bpfjit_copemit_t *copemits; /* NULL or nfuncs entries */
+	const bpfjit_hset_t *	hset; /* NULL or set of bpfjit_hset_cop() */
 };
 
+/*
+ * Built-in copfunc, it returns 1 if A is in bc->hset and 0 otherwise.
+ * Generated code inlines BPF_COP of bpfjit_hset_cop() as a probe of
+ * hset of the bpf_ctx_t passed to the code. Batch code has no ctx
+ * argument, it can't call bpfjit_hset_cop().
+ */
+uint32_t
+bpfjit_hset_cop(bpf_ctx_t *, bpf_args_t *, bpf_state_t *);
+
+bpfjit_hset_t *
+bpfjit_hset_create(const uint32_t *, size_t);
+
+void
+bpfjit_hset_destroy(bpfjit_hset_t *);
+
 struct bpf_state {
 	uint32_t	mem[BPF_MEMWORDS];
 	uint32_t	regA;
@@ -82,9 +129,148 @@ typedef size_t (*bpfjit_function_t)(bpf_ctx_t *, bpf_args_t *);
 bpfjit_function_t
 bpfjit_generate_code(bpf_ctx_t *, struct bpf_insn *, size_t);
 
+/*
+ * Generated code counts taken edges of every BPF_JMP instruction
+ * at index i in counts[2*i] (jt) and counts[2*i+1] (jf). The array
+ * has 2*insn_count elements and it must outlive the code. Counters
+ * aren't updated atomically.
+ */
+bpfjit_function_t
+bpfjit_generate_profiled_code(bpf_ctx_t *, struct bpf_insn *, size_t,
+    size_t *);
+
+/*
+ * Compile the program again with blocks laid out by counts
+ * collected by code from bpfjit_generate_profiled_code().
+ */
+bpfjit_function_t
+bpfjit_recompile(bpf_ctx_t *, struct bpf_insn *, size_t, const size_t *);
+
 void
 bpfjit_free_code(bpfjit_function_t code);
 
+/*
+ * Predicates return 1 if the program accepts a packet and 0 if
+ * it rejects it. Compilation fails unless every BPF_RET instruction
+ * returns a constant, either k or a known value of A.
+ */
+typedef int (*bpfjit_predicate_t)(bpf_ctx_t *, bpf_args_t *);
+
+bpfjit_predicate_t
+bpfjit_generate_predicate(bpf_ctx_t *, struct bpf_insn *, size_t);
+
+void
+bpfjit_free_predicate(bpfjit_predicate_t code);
+
+/*
+ * Direct code takes the packet, wirelen and buflen in argument
+ * registers instead of bpf_args. Compilation fails if the program
+ * calls a copfunc.
+ */
+typedef size_t (*bpfjit_direct_t)(const uint8_t *, size_t, size_t);
+
+bpfjit_direct_t
+bpfjit_generate_direct_code(struct bpf_insn *, size_t);
+
+void
+bpfjit_free_direct_code(bpfjit_direct_t code);
+
+/*
+ * Batch code runs the program for n packets described by args[0..n-1]
+ * and stores results in res[0..n-1]. It returns the number of packets
+ * accepted with non-zero results. Compilation fails if the program
+ * calls a copfunc that isn't inlined, see struct bpfjit_cop_regs.
+ */
+typedef size_t (*bpfjit_batch_t)(const bpf_args_t *, size_t, size_t *);
+
+bpfjit_batch_t
+bpfjit_generate_batch_code(bpf_ctx_t *, struct bpf_insn *, size_t);
+
+void
+bpfjit_free_batch_code(bpfjit_batch_t code);
+
+/*
+ * Up to sizeof(size_t) * CHAR_BIT programs compiled into one function.
+ * bpfjit_multi_call() stores the result of program j in res[j] and
+ * returns a mask with bit j set if the result isn't 0. A packet too
+ * short for program j doesn't stop other programs. Creation fails
+ * if a program calls a copfunc that isn't inlined or if it doesn't
+ * end with BPF_RET.
+ */
+struct bpfjit_multi;
+typedef struct bpfjit_multi bpfjit_multi_t;
+
+bpfjit_multi_t *
+bpfjit_multi_create(bpf_ctx_t *, struct bpf_insn *const *,
+    const size_t *, size_t);
+
+size_t
+bpfjit_multi_call(bpfjit_multi_t *, bpf_args_t *, size_t *);
+
+void
+bpfjit_multi_destroy(bpfjit_multi_t *);
+
+/*
+ * A set of programs that differ only in k of BPF_JMP+BPF_JEQ+BPF_K
+ * instructions, e.g. "host X" filters for many X. All programs have
+ * insn_count instructions. The set runs the shared skeleton once per
+ * packet and looks up A in a hash table of keys at every instruction
+ * that differs, so a call costs about the same as one program.
+ * bpfjit_fset_call() stores up to maxids ids of programs that don't
+ * return 0 in ids, in no particular order, and returns the number of
+ * such programs. Creation fails if programs differ elsewhere, if they
+ * differ at more than 32 instructions, or if the skeleton has COP or
+ * COPX instructions or invalid jumps or M[] words.
+ */
+struct bpfjit_fset;
+typedef struct bpfjit_fset bpfjit_fset_t;
+
+bpfjit_fset_t *
+bpfjit_fset_create(struct bpf_insn *const *, size_t insn_count,
+    size_t nprogs);
+
+size_t
+bpfjit_fset_call(const bpfjit_fset_t *, bpf_args_t *,
+    size_t *ids, size_t maxids);
+
+void
+bpfjit_fset_destroy(bpfjit_fset_t *);
+
+/*
+ * Tiered execution. A handle runs its program in an interpreter
+ * until it's called threshold times, then the program is compiled
+ * and later calls run generated code. If hook is NULL, the call
+ * that crosses the threshold compiles the program. Otherwise, that
+ * call passes the handle to hook once, and the hook should arrange
+ * bpfjit_tiered_compile() to be called, e.g. from a worker thread.
+ * Calls can run concurrently with compilation. The handle keeps
+ * a copy of the program but bpf_ctx_t must outlive it.
+ */
+struct bpfjit_tiered;
+typedef struct bpfjit_tiered bpfjit_tiered_t;
+
+typedef void (*bpfjit_tiered_hook_t)(bpfjit_tiered_t *, void *);
+
+bpfjit_tiered_t *
+bpfjit_tiered_create(bpf_ctx_t *, struct bpf_insn *, size_t,
+    size_t threshold, bpfjit_tiered_hook_t hook, void *arg);
+
+size_t
+bpfjit_tiered_call(bpfjit_tiered_t *, bpf_args_t *);
+
+/*
+ * Compile the program unless it's already compiled or being
+ * compiled by another thread. Return generated code or NULL.
+ */
+bpfjit_function_t
+bpfjit_tiered_compile(bpfjit_tiered_t *);
+
+/*
+ * No calls or compilations may be in progress.
+ */
+void
+bpfjit_tiered_destroy(bpfjit_tiered_t *);
+
 static inline size_t
 bpfjit_call(bpfjit_function_t f, const uint8_t *p,
     unsigned int wirelen, unsigned int buflen)
@@ -98,4 +284,17 @@ bpfjit_call(bpfjit_function_t f, const uint8_t *p,
 	return f(NULL, &args);
 }
 
+static inline int
+bpfjit_match(bpfjit_predicate_t f, const uint8_t *p,
+    unsigned int wirelen, unsigned int buflen)
+{
+	bpf_args_t args;
+
+	args.pkt = p;
+	args.wirelen = wirelen;
+	args.buflen = buflen;
+
+	return f(NULL, &args);
+}
+
 #endif /* !_NET_BPFJIT_H_ */
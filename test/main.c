@@ -43,6 +43,11 @@ int main(void)
 	test_opt();
 	test_cop();
 	test_copx();
+	test_tiered();
+	test_direct();
+	test_batch();
+	test_multi();
+	test_fset();
 
 	return exit_status;
 }
@@ -30,6 +30,7 @@
 #include <bpfjit.h>
 
 #include <stdint.h>
+#include <string.h>
 
 #include "util.h"
 #include "tests.h"
@@ -1014,6 +1015,136 @@ test_alu_modulo_x(void)
 	bpfjit_free_code(code);
 }
 
+/*
+ * Operands of the tests above are known at compile time and bpfjit
+ * folds them. Here, operands are loaded from a packet.
+ */
+static void
+test_alu_runtime(void)
+{
+	static const uint16_t ops[] = {
+		BPF_ADD, BPF_SUB, BPF_MUL, BPF_DIV, BPF_MOD,
+		BPF_AND, BPF_OR, BPF_LSH, BPF_RSH, BPF_NEG
+	};
+
+	static const uint32_t vals[] = {
+		0, 1, 3, 10, 31, 0x7fffff77, 0x80000000, 0xdeadbeef
+	};
+
+	struct bpf_insn insns[5];
+	uint8_t pkt[8];
+	size_t o, a, x, src;
+	bpfjit_function_t code;
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	for (o = 0; o < sizeof(ops) / sizeof(ops[0]); o++) {
+		for (src = 0; src < 2; src++) {
+			memset(insns, 0, sizeof(insns));
+			insns[0].code = BPF_LD+BPF_W+BPF_ABS;
+			insns[0].k = 4;
+			insns[1].code = BPF_MISC+BPF_TAX;
+			insns[2].code = BPF_LD+BPF_W+BPF_ABS;
+			insns[2].k = 0;
+			insns[3].code = BPF_ALU+ops[o]+(src ? BPF_X : BPF_K);
+			insns[4].code = BPF_RET+BPF_A;
+
+			for (x = 0; x < sizeof(vals) / sizeof(vals[0]); x++) {
+				if ((ops[o] == BPF_DIV || ops[o] == BPF_MOD) &&
+				    !src && vals[x] == 0) {
+					continue;
+				}
+				if (ops[o] == BPF_NEG && src)
+					continue;
+				if ((ops[o] == BPF_LSH || ops[o] == BPF_RSH) &&
+				    vals[x] >= 32) {
+					continue; /* undefined in C */
+				}
+
+				insns[3].k = vals[x];
+				pkt[4] = vals[x] >> 24;
+				pkt[5] = vals[x] >> 16;
+				pkt[6] = vals[x] >> 8;
+				pkt[7] = vals[x];
+
+				CHECK(bpf_validate(insns, insn_count));
+
+				code = bpfjit_generate_code(NULL,
+				    insns, insn_count);
+				REQUIRE(code != NULL);
+
+				for (a = 0; a < sizeof(vals) / sizeof(vals[0]);
+				    a++) {
+					pkt[0] = vals[a] >> 24;
+					pkt[1] = vals[a] >> 16;
+					pkt[2] = vals[a] >> 8;
+					pkt[3] = vals[a];
+
+					CHECK(bpfjit_call(code, pkt, 8, 8) ==
+					    bpf_filter(insns, pkt, 8, 8));
+				}
+
+				bpfjit_free_code(code);
+			}
+		}
+	}
+}
+
+/*
+ * Divisions by constants which aren't powers of two are compiled
+ * to multiplications, check them against a wide range of values.
+ */
+static void
+test_alu_div_magic(void)
+{
+	static const uint32_t divs[] = {
+		3, 5, 6, 7, 10, 12, 25, 60, 100, 641, 1000, 10000,
+		UINT32_C(7609801), UINT32_C(0x7fffffff),
+		UINT32_C(0x80000001), UINT32_C(0xfffffffe),
+		UINT32_C(0xffffffff)
+	};
+
+	struct bpf_insn insns[3];
+	uint8_t pkt[4];
+	size_t d, i, op;
+	uint32_t a, res;
+	bpfjit_function_t code;
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	for (d = 0; d < sizeof(divs) / sizeof(divs[0]); d++) {
+		for (op = 0; op < 2; op++) {
+			memset(insns, 0, sizeof(insns));
+			insns[0].code = BPF_LD+BPF_W+BPF_ABS;
+			insns[1].code = BPF_ALU+BPF_K+(op ? BPF_MOD : BPF_DIV);
+			insns[1].k = divs[d];
+			insns[2].code = BPF_RET+BPF_A;
+
+			code = bpfjit_generate_code(NULL, insns, insn_count);
+			REQUIRE(code != NULL);
+
+			for (i = 0; i < 4096; i++) {
+				/* Spread values over the whole range. */
+				a = i * UINT32_C(0x9e3779b9) + (i >> 4);
+				if (i < 4)
+					a = divs[d] * i - (i > 0);
+				if (i == 4)
+					a = UINT32_MAX;
+
+				pkt[0] = a >> 24;
+				pkt[1] = a >> 16;
+				pkt[2] = a >> 8;
+				pkt[3] = a;
+
+				res = op ? a % divs[d] : a / divs[d];
+				CHECK(bpfjit_call(code, pkt, 4, 4) == res);
+			}
+
+			bpfjit_free_code(code);
+		}
+	}
+}
+
 void
 test_alu(void)
 {
@@ -1057,4 +1188,7 @@ test_alu(void)
 	test_alu_modulo_x();
 
 	test_alu_neg();
+
+	test_alu_runtime();
+	test_alu_div_magic();
 }
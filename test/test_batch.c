@@ -0,0 +1,248 @@
+/*-
+ * Copyright (c) 2013 Alexander Nasonov.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <bpfjit.h>
+#include <sljitLir.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "tests.h"
+
+#define NPKTS 40
+
+static uint32_t
+addWL(bpf_ctx_t *bc, bpf_args_t *args, bpf_state_t *state)
+{
+
+	(void)bc;
+	return state->regA + args->wirelen;
+}
+
+static int
+emit_addWL(struct sljit_compiler *compiler,
+    const struct bpfjit_cop_regs *regs)
+{
+	int status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    regs->tmp[0], 0,
+	    SLJIT_MEM1(regs->args),
+	    offsetof(struct bpf_args, wirelen));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	return sljit_emit_op2(compiler,
+	    SLJIT_ADD|SLJIT_INT_OP,
+	    regs->a, 0,
+	    regs->a, 0,
+	    regs->tmp[0], 0);
+}
+
+static const bpf_copfunc_t copfuncs[] = {
+	&addWL,
+	&addWL
+};
+
+static const bpfjit_copemit_t copemits[] = {
+	&emit_addWL,
+	NULL
+};
+
+static bpf_ctx_t ctx = {
+	copfuncs, sizeof(copfuncs) / sizeof(copfuncs[0]), copemits, NULL
+};
+
+/*
+ * Run batch code for NPKTS copies of pkt with different buflen and
+ * wirelen values and compare results with bpf_filter().
+ */
+static void
+check_batch(bpf_ctx_t *bc, struct bpf_insn *insns, size_t insn_count,
+    const uint8_t *pkt, size_t pktsize)
+{
+	bpfjit_batch_t code;
+	bpf_args_t args[NPKTS];
+	size_t res[NPKTS + 1];
+	size_t i, accepted;
+
+	code = bpfjit_generate_batch_code(bc, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	accepted = 0;
+	for (i = 0; i < NPKTS; i++) {
+		args[i].pkt = pkt;
+		args[i].buflen = i % (pktsize + 1);
+		args[i].wirelen = pktsize + i;
+		args[i].arg = NULL;
+		if (bpf_filter(insns, pkt, args[i].wirelen, args[i].buflen))
+			accepted++;
+	}
+
+	res[NPKTS] = 12345;
+	CHECK(code(args, NPKTS, res) == accepted);
+	CHECK(res[NPKTS] == 12345);
+
+	for (i = 0; i < NPKTS; i++) {
+		CHECK(res[i] == bpf_filter(insns, pkt,
+		    args[i].wirelen, args[i].buflen));
+	}
+
+	/* An empty batch doesn't touch res. */
+	res[0] = 12345;
+	CHECK(code(args, 0, res) == 0);
+	CHECK(res[0] == 12345);
+
+	bpfjit_free_batch_code(code);
+}
+
+static void
+test_batch_host(void)
+{
+	size_t insn_count = sizeof(host_insns) / sizeof(host_insns[0]);
+
+	CHECK(bpf_validate(host_insns, insn_count));
+	check_batch(NULL, host_insns, insn_count,
+	    host_pkt, sizeof(host_pkt));
+}
+
+static void
+test_batch_mem(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_STMT(BPF_ST, 3),
+		BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 0),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 1),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_K, 0x1000, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 0),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 3),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	uint8_t pkt[24];
+	size_t i;
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	for (i = 0; i < sizeof(pkt); i++)
+		pkt[i] = 11 * i + 1;
+
+	CHECK(bpf_validate(insns, insn_count));
+	check_batch(NULL, insns, insn_count, pkt, sizeof(pkt));
+}
+
+/*
+ * Packets take different paths and return different values of A.
+ */
+static void
+test_batch_paths(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP+BPF_JGE+BPF_K, 50, 0, 4),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 2),
+		BPF_STMT(BPF_ALU+BPF_RSH+BPF_K, 3),
+		BPF_STMT(BPF_ALU+BPF_MUL+BPF_K, 5),
+		BPF_JUMP(BPF_JMP+BPF_JA, 3, 0, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 20),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x10, 0, 2),
+		BPF_STMT(BPF_ALU+BPF_NEG, 0),
+		BPF_STMT(BPF_ALU+BPF_MOD+BPF_K, 1000),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	uint8_t pkt[24];
+	size_t i;
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	for (i = 0; i < sizeof(pkt); i++)
+		pkt[i] = 7 * i + 3;
+
+	CHECK(bpf_validate(insns, insn_count));
+	check_batch(NULL, insns, insn_count, pkt, sizeof(pkt));
+}
+
+static void
+test_batch_cop(void)
+{
+	static struct bpf_insn insns1[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 7),
+		BPF_STMT(BPF_MISC+BPF_COP, 0), // addWL, inline
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static struct bpf_insn insns2[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 7),
+		BPF_STMT(BPF_MISC+BPF_COP, 1), // addWL, called
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_batch_t code;
+	bpf_args_t args[NPKTS];
+	size_t res[NPKTS];
+	uint8_t pkt[1] = { 0 };
+	size_t i;
+
+	size_t insn_count1 = sizeof(insns1) / sizeof(insns1[0]);
+	size_t insn_count2 = sizeof(insns2) / sizeof(insns2[0]);
+
+	code = bpfjit_generate_batch_code(&ctx, insns1, insn_count1);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < NPKTS; i++) {
+		args[i].pkt = pkt;
+		args[i].buflen = sizeof(pkt);
+		args[i].wirelen = i;
+		args[i].arg = NULL;
+	}
+
+	CHECK(code(args, NPKTS, res) == NPKTS);
+
+	for (i = 0; i < NPKTS; i++)
+		CHECK(res[i] == 7 + i);
+
+	bpfjit_free_batch_code(code);
+
+	CHECK(bpfjit_generate_batch_code(&ctx, insns2, insn_count2) == NULL);
+}
+
+void
+test_batch(void)
+{
+
+	test_batch_host();
+	test_batch_mem();
+	test_batch_paths();
+	test_batch_cop();
+}
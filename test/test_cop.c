@@ -28,9 +28,12 @@
  */
 
 #include <bpfjit.h>
+#include <sljitLir.h>
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "util.h"
 #include "tests.h"
@@ -92,7 +95,84 @@ static const bpf_copfunc_t copfuncs[] = {
 	&setARG
 };
 
-static bpf_ctx_t ctx = { copfuncs, sizeof(copfuncs) / sizeof(copfuncs[0]) };
+static bpf_ctx_t ctx = {
+	copfuncs, sizeof(copfuncs) / sizeof(copfuncs[0]), NULL, NULL
+};
+
+/*
+ * COP function that modifies M[].
+ */
+static uint32_t
+incM(bpf_ctx_t *bc, bpf_args_t *args, bpf_state_t *state)
+{
+
+	return ++state->mem[(uintptr_t)args->arg];
+}
+
+static const bpf_copfunc_t memfuncs[] = {
+	&retM,
+	&incM
+};
+
+static bpf_ctx_t memctx = {
+	memfuncs, sizeof(memfuncs) / sizeof(memfuncs[0]), NULL, NULL
+};
+
+/*
+ * COP function with an inline version.
+ */
+static uint32_t
+addWL(bpf_ctx_t *bc, bpf_args_t *args, bpf_state_t *state)
+{
+
+	return state->regA + args->wirelen;
+}
+
+static int
+emit_addWL(struct sljit_compiler *compiler,
+    const struct bpfjit_cop_regs *regs)
+{
+	int status;
+
+	status = sljit_emit_op1(compiler,
+	    SLJIT_MOV,
+	    regs->tmp[0], 0,
+	    SLJIT_MEM1(regs->args),
+	    offsetof(struct bpf_args, wirelen));
+	if (status != SLJIT_SUCCESS)
+		return status;
+
+	return sljit_emit_op2(compiler,
+	    SLJIT_ADD|SLJIT_INT_OP,
+	    regs->a, 0,
+	    regs->a, 0,
+	    regs->tmp[0], 0);
+}
+
+static const bpf_copfunc_t inlfuncs[] = {
+	&addWL,
+	&retM
+};
+
+static const bpfjit_copemit_t inlemits[] = {
+	&emit_addWL,
+	NULL
+};
+
+static bpf_ctx_t inlctx = {
+	inlfuncs, sizeof(inlfuncs) / sizeof(inlfuncs[0]), inlemits, NULL
+};
+
+/*
+ * Built-in set membership.
+ */
+static const bpf_copfunc_t hsetfuncs[] = {
+	&bpfjit_hset_cop
+};
+
+static bpf_ctx_t hsetctx = {
+	hsetfuncs, sizeof(hsetfuncs) / sizeof(hsetfuncs[0]), NULL, NULL
+};
 
 static void
 test_cop_no_ctx(void)
@@ -278,6 +358,47 @@ test_cop_mixed_with_ld(void)
 	bpfjit_free_code(code);
 }
 
+/*
+ * Check that memwords kept in registers are visible to COP functions.
+ */
+static void
+test_cop_mem_regs(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 10),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD+BPF_IMM, 20),
+		BPF_STMT(BPF_ST, 1),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 0),
+		BPF_STMT(BPF_LD+BPF_MEM, 1),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_ST, 2),
+		BPF_STMT(BPF_MISC+BPF_COP, 1), // incM
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 11, 0, 4),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 2),
+		BPF_STMT(BPF_LD+BPF_MEM, 0),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[1] = { 0 };
+	void *arg = (void*)(uintptr_t)0;
+	bpf_args_t args = { pkt, sizeof(pkt), sizeof(pkt), arg };
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(&memctx, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(code(&memctx, &args) == 41);
+
+	bpfjit_free_code(code);
+}
+
 static void
 test_cop_invalid_index(void)
 {
@@ -303,6 +424,211 @@ test_cop_invalid_index(void)
 	bpfjit_free_code(code);
 }
 
+static void
+test_cop_inline(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 3),
+		BPF_STMT(BPF_ST, 2),
+		BPF_STMT(BPF_MISC+BPF_COP, 0), // addWL
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 2),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[1] = { 0 };
+	bpf_args_t args = { pkt, 100, sizeof(pkt) };
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(&inlctx, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(code(&inlctx, &args) == 106);
+
+	bpfjit_free_code(code);
+}
+
+/*
+ * Check that M[] words are spilled for a call after an inline COP.
+ */
+static void
+test_cop_inline_mixed(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 7),
+		BPF_STMT(BPF_ST, 1),
+		BPF_STMT(BPF_LD+BPF_IMM, 2),
+		BPF_STMT(BPF_MISC+BPF_COP, 0), // addWL, inline
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_MISC+BPF_COP, 1), // retM, called
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 0),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[1] = { 0 };
+	void *arg = (void*)(uintptr_t)1;
+	bpf_args_t args = { pkt, 100, sizeof(pkt), arg };
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(&inlctx, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(code(&inlctx, &args) == 109);
+
+	bpfjit_free_code(code);
+}
+
+/*
+ * BPF_COPX always calls a copfunc.
+ */
+static void
+test_cop_inline_copx(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LDX+BPF_IMM, 0),
+		BPF_STMT(BPF_LD+BPF_IMM, 5),
+		BPF_STMT(BPF_MISC+BPF_COPX, 0), // addWL
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[1] = { 0 };
+	bpf_args_t args = { pkt, 100, sizeof(pkt) };
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(&inlctx, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(code(&inlctx, &args) == 105);
+
+	bpfjit_free_code(code);
+}
+
+#define HSET_KEYS 3000
+
+/*
+ * Compare inline and called bpfjit_hset_cop() with a linear search
+ * in keys for every key and for nearby words.
+ */
+static void
+check_hset(bpfjit_function_t code, bpfjit_function_t xcode,
+    const uint32_t *keys, size_t nkeys)
+{
+	uint8_t pkt[4];
+	bpf_args_t args = { pkt, sizeof(pkt), sizeof(pkt) };
+	uint32_t v;
+	size_t i, j, d, rv;
+
+	for (i = 0; i <= HSET_KEYS; i++) {
+		for (d = 0; d < 3; d++) {
+			v = (i < HSET_KEYS ? keys[i] : 0) + d;
+
+			rv = 0;
+			for (j = 0; j < nkeys; j++)
+				rv = rv || keys[j] == v;
+			if (hsetctx.hset == NULL)
+				rv = 0;
+
+			pkt[0] = v >> 24;
+			pkt[1] = v >> 16;
+			pkt[2] = v >> 8;
+			pkt[3] = v;
+			CHECK(code(&hsetctx, &args) == rv);
+			CHECK(xcode(&hsetctx, &args) == rv);
+		}
+	}
+}
+
+static void
+test_cop_hset(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 0),
+		BPF_STMT(BPF_MISC+BPF_COP, 0), // bpfjit_hset_cop, inline
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static struct bpf_insn xinsns[] = {
+		BPF_STMT(BPF_LDX+BPF_IMM, 0),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 0),
+		BPF_STMT(BPF_MISC+BPF_COPX, 0), // bpfjit_hset_cop, called
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static uint32_t keys[HSET_KEYS];
+	bpfjit_function_t code, xcode;
+	bpfjit_hset_t *hs[3];
+	bpf_ctx_t ctx;
+	uint32_t seed;
+	size_t i;
+
+	CHECK(bpf_validate(insns, sizeof(insns) / sizeof(insns[0])));
+	CHECK(bpf_validate(xinsns, sizeof(xinsns) / sizeof(xinsns[0])));
+
+	/* Code reads the set from the ctx it's called with. */
+	ctx = hsetctx;
+	code = bpfjit_generate_code(&ctx, insns,
+	    sizeof(insns) / sizeof(insns[0]));
+	REQUIRE(code != NULL);
+	memset(&ctx, 0, sizeof(ctx));
+
+	/* Batch code has no ctx. */
+	CHECK(bpfjit_generate_batch_code(&hsetctx, insns,
+	    sizeof(insns) / sizeof(insns[0])) == NULL);
+
+	xcode = bpfjit_generate_code(&hsetctx, xinsns,
+	    sizeof(xinsns) / sizeof(xinsns[0]));
+	REQUIRE(xcode != NULL);
+
+	/* Random words with duplicates and runs of consecutive words. */
+	seed = 1;
+	for (i = 0; i < HSET_KEYS; i++) {
+		seed = seed * 1103515245 + 12345;
+		keys[i] = (i % 7 == 6) ? keys[i - 1] + 1 : seed;
+		if (i % 100 == 1)
+			keys[i] = keys[i / 2];
+	}
+
+	hs[0] = bpfjit_hset_create(keys, HSET_KEYS / 2);
+	REQUIRE(hs[0] != NULL);
+
+	/* The second set has 0 and more keys. */
+	keys[HSET_KEYS - 1] = 0;
+	hs[1] = bpfjit_hset_create(keys, HSET_KEYS);
+	REQUIRE(hs[1] != NULL);
+
+	hs[2] = bpfjit_hset_create(keys, 0);
+	REQUIRE(hs[2] != NULL);
+
+	/* Replace sets without recompiling. */
+	hsetctx.hset = hs[0];
+	check_hset(code, xcode, keys, HSET_KEYS / 2);
+	hsetctx.hset = hs[1];
+	check_hset(code, xcode, keys, HSET_KEYS);
+	hsetctx.hset = hs[2];
+	check_hset(code, xcode, keys, 0);
+	hsetctx.hset = NULL;
+	check_hset(code, xcode, keys, HSET_KEYS);
+
+	for (i = 0; i < 3; i++)
+		bpfjit_hset_destroy(hs[i]);
+
+	bpfjit_free_code(code);
+	bpfjit_free_code(xcode);
+}
+
 void
 test_cop(void)
 {
@@ -314,6 +640,11 @@ test_cop(void)
 	test_cop_ret_wirelen();
 	test_cop_ret_nfuncs();
 	test_cop_mixed_with_ld();
+	test_cop_mem_regs();
 	test_cop_invalid_index();
+	test_cop_inline();
+	test_cop_inline_mixed();
+	test_cop_inline_copx();
+	test_cop_hset();
 	/* XXX test unreachable BPF_COP insn. */
 }
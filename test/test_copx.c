@@ -77,7 +77,9 @@ static const bpf_copfunc_t copfuncs[] = {
 	&retNF
 };
 
-static bpf_ctx_t ctx = { copfuncs, sizeof(copfuncs) / sizeof(copfuncs[0]) };
+static bpf_ctx_t ctx = {
+	copfuncs, sizeof(copfuncs) / sizeof(copfuncs[0]), NULL, NULL
+};
 
 static void
 test_copx_no_ctx(void)
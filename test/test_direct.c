@@ -0,0 +1,150 @@
+/*-
+ * Copyright (c) 2013 Alexander Nasonov.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <bpfjit.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+#include "tests.h"
+
+/*
+ * Compare direct code with bpf_filter() and bpfjit_call()
+ * for every buflen.
+ */
+static void
+check_direct(struct bpf_insn *insns, size_t insn_count,
+    const uint8_t *pkt, size_t pktsize)
+{
+	bpfjit_function_t code;
+	bpfjit_direct_t direct;
+	size_t i;
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	direct = bpfjit_generate_direct_code(insns, insn_count);
+	REQUIRE(direct != NULL);
+
+	for (i = 0; i <= pktsize; i++) {
+		CHECK(direct(pkt, pktsize + 7, i) ==
+		    bpf_filter(insns, pkt, pktsize + 7, i));
+		CHECK(direct(pkt, pktsize + 7, i) ==
+		    bpfjit_call(code, pkt, pktsize + 7, i));
+	}
+
+	bpfjit_free_direct_code(direct);
+	bpfjit_free_code(code);
+}
+
+static void
+test_direct_host(void)
+{
+	size_t insn_count = sizeof(host_insns) / sizeof(host_insns[0]);
+
+	check_direct(host_insns, insn_count, host_pkt, sizeof(host_pkt));
+}
+
+static void
+test_direct_len(void)
+{
+	static struct bpf_insn insns1[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_STMT(BPF_ST, 1),
+		BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 0),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 1),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 1),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	/* Doesn't read the packet. */
+	static struct bpf_insn insns2[] = {
+		BPF_STMT(BPF_LDX+BPF_W+BPF_LEN, 0),
+		BPF_STMT(BPF_MISC+BPF_TXA, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	uint8_t pkt[24];
+	size_t i;
+
+	size_t insn_count1 = sizeof(insns1) / sizeof(insns1[0]);
+	size_t insn_count2 = sizeof(insns2) / sizeof(insns2[0]);
+
+	for (i = 0; i < sizeof(pkt); i++)
+		pkt[i] = 5 * i + 2;
+
+	check_direct(insns1, insn_count1, pkt, sizeof(pkt));
+	check_direct(insns2, insn_count2, pkt, sizeof(pkt));
+}
+
+static void
+test_direct_cop(void)
+{
+	static struct bpf_insn insns1[] = {
+		BPF_STMT(BPF_MISC+BPF_COP, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	/* BPF_COP is unreachable. */
+	static struct bpf_insn insns2[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 3),
+		BPF_STMT(BPF_MISC+BPF_COP, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_direct_t direct;
+	uint8_t pkt[1] = { 0 };
+
+	size_t insn_count1 = sizeof(insns1) / sizeof(insns1[0]);
+	size_t insn_count2 = sizeof(insns2) / sizeof(insns2[0]);
+
+	CHECK(bpfjit_generate_direct_code(insns1, insn_count1) == NULL);
+
+	direct = bpfjit_generate_direct_code(insns2, insn_count2);
+	REQUIRE(direct != NULL);
+
+	CHECK(direct(pkt, 1, 1) == 3);
+
+	bpfjit_free_direct_code(direct);
+}
+
+void
+test_direct(void)
+{
+
+	test_direct_host();
+	test_direct_len();
+	test_direct_cop();
+}
@@ -0,0 +1,339 @@
+/*-
+ * Copyright (c) 2013 Alexander Nasonov.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <bpfjit.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+#include "tests.h"
+
+#define MAXPROGS 128
+
+#define HOST_INSNS (sizeof(host_insns) / sizeof(host_insns[0]))
+
+/* Programs compare with the first NKEYS addresses only. */
+static const uint32_t addrs[] = {
+	0x8003700f, 0x80037023, 0x0a000001, 0x0a000002, 0xc0a80001,
+	0x0a000003, 0x08080808
+};
+
+#define NADDRS (sizeof(addrs) / sizeof(addrs[0]))
+#define NKEYS 5
+
+/* host_pkt followed by a few bytes that programs don't read. */
+static uint8_t ip_pkt[sizeof(host_pkt) + 10];
+
+static void
+set_word(uint8_t *p, uint32_t v)
+{
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/*
+ * Call the set for every buflen and compare ids with programs
+ * that bpf_filter() accepts.
+ */
+static void
+check_fset(struct bpf_insn *const *progs, size_t insn_count,
+    size_t nprogs, const uint8_t *pkt, size_t pktsize)
+{
+	bpfjit_fset_t *fs;
+	bpf_args_t args;
+	size_t ids[MAXPROGS + 1];
+	uint8_t seen[MAXPROGS];
+	size_t i, j, n, naccept;
+
+	REQUIRE(nprogs <= MAXPROGS);
+
+	for (j = 0; j < nprogs; j++)
+		CHECK(bpf_validate(progs[j], insn_count));
+
+	fs = bpfjit_fset_create(progs, insn_count, nprogs);
+	REQUIRE(fs != NULL);
+
+	for (i = 0; i <= pktsize; i++) {
+		args.pkt = pkt;
+		args.buflen = i;
+		args.wirelen = pktsize;
+		args.arg = NULL;
+
+		memset(ids, 0xff, sizeof(ids));
+		n = bpfjit_fset_call(fs, &args, ids, nprogs);
+		CHECK(ids[nprogs] == SIZE_MAX);
+
+		memset(seen, 0, sizeof(seen));
+		for (j = 0; j < n && j < nprogs; j++) {
+			REQUIRE(ids[j] < nprogs);
+			CHECK(seen[ids[j]] == 0);
+			seen[ids[j]] = 1;
+		}
+
+		naccept = 0;
+		for (j = 0; j < nprogs; j++) {
+			if (bpf_filter(progs[j], pkt, pktsize, i) != 0) {
+				CHECK(seen[j] == 1);
+				naccept++;
+			} else {
+				CHECK(seen[j] == 0);
+			}
+		}
+
+		CHECK(n == naccept);
+	}
+
+	bpfjit_fset_destroy(fs);
+}
+
+/*
+ * Host pairs, many programs share a host or the whole pair.
+ */
+static void
+test_fset_host(void)
+{
+	static struct bpf_insn insns[MAXPROGS][HOST_INSNS];
+	struct bpf_insn *progs[MAXPROGS];
+	size_t i, j, src, dst;
+
+	for (j = 0; j < MAXPROGS; j++) {
+		memcpy(insns[j], host_insns, sizeof(host_insns));
+		insns[j][3].k = insns[j][8].k = addrs[j % NKEYS];
+		insns[j][5].k = insns[j][6].k = addrs[(j / 3) % NKEYS];
+		progs[j] = insns[j];
+	}
+
+	for (src = 0; src < NADDRS; src++) {
+		for (dst = 0; dst < NADDRS; dst++) {
+			set_word(&ip_pkt[26], addrs[src]);
+			set_word(&ip_pkt[30], addrs[dst]);
+			check_fset(progs, HOST_INSNS, MAXPROGS,
+			    ip_pkt, sizeof(ip_pkt));
+		}
+	}
+
+	/* Not IP. */
+	ip_pkt[12] = 0x86;
+	check_fset(progs, HOST_INSNS, MAXPROGS, ip_pkt, sizeof(ip_pkt));
+	ip_pkt[12] = 0x08;
+
+	/* Identical programs have no keys. */
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 3; j++)
+			progs[j] = insns[0];
+		set_word(&ip_pkt[26], addrs[i]);
+		set_word(&ip_pkt[30], addrs[1 - i]);
+		check_fset(progs, HOST_INSNS, 3, ip_pkt, sizeof(ip_pkt));
+		check_fset(progs, HOST_INSNS, 1, ip_pkt, sizeof(ip_pkt));
+	}
+}
+
+/*
+ * Programs reject one source host and return 2 for others, except
+ * that another source host returns the word at offset 30. A, X and
+ * M[] are carried across keys.
+ */
+static void
+test_fset_default(void)
+{
+	static const struct bpf_insn skel_insns[] = {
+		BPF_STMT(BPF_LDX+BPF_W+BPF_IMM, 5),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26),
+		BPF_STMT(BPF_ST, 3),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 6, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 0, 4),
+		BPF_STMT(BPF_LD+BPF_MEM, 3),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_LD+BPF_W+BPF_IND, 25),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_STMT(BPF_RET+BPF_K, 2),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	static struct bpf_insn insns[NKEYS * NKEYS][11];
+	struct bpf_insn *progs[NKEYS * NKEYS];
+	size_t j, src;
+
+	for (j = 0; j < NKEYS * NKEYS; j++) {
+		memcpy(insns[j], skel_insns, sizeof(skel_insns));
+		insns[j][3].k = addrs[j % NKEYS];
+		insns[j][4].k = addrs[j / NKEYS];
+		progs[j] = insns[j];
+	}
+
+	for (src = 0; src < NADDRS; src++) {
+		set_word(&ip_pkt[26], addrs[src]);
+		check_fset(progs, 11, NKEYS * NKEYS,
+		    ip_pkt, sizeof(ip_pkt));
+	}
+
+	set_word(&ip_pkt[26], 0x8003700f);
+	set_word(&ip_pkt[30], 0x80037023);
+}
+
+/*
+ * A that no program compares with takes jf in every program.
+ */
+static void
+test_fset_miss(void)
+{
+	static struct bpf_insn insns[2][4] = {
+		{
+			BPF_STMT(BPF_LD+BPF_IMM, 7),
+			BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 1),
+			BPF_STMT(BPF_RET+BPF_K, 1),
+			BPF_STMT(BPF_RET+BPF_K, 0)
+		}, {
+			BPF_STMT(BPF_LD+BPF_IMM, 7),
+			BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 2, 0, 1),
+			BPF_STMT(BPF_RET+BPF_K, 1),
+			BPF_STMT(BPF_RET+BPF_K, 0)
+		}
+	};
+
+	struct bpf_insn *progs[2] = { insns[0], insns[1] };
+
+	check_fset(progs, 4, 2, ip_pkt, sizeof(ip_pkt));
+
+	insns[1][1].k = 7;
+	check_fset(progs, 4, 2, ip_pkt, sizeof(ip_pkt));
+}
+
+static void
+test_fset_maxids(void)
+{
+	static struct bpf_insn insns[8][HOST_INSNS];
+	struct bpf_insn *progs[8];
+	bpfjit_fset_t *fs;
+	bpf_args_t args;
+	size_t ids[3];
+	size_t j;
+
+	/* Programs 0, 2, 4 and 6 accept the packet. */
+	for (j = 0; j < 8; j++) {
+		memcpy(insns[j], host_insns, sizeof(host_insns));
+		insns[j][3].k = insns[j][8].k = addrs[j % 2 == 0 ? 0 : 2];
+		progs[j] = insns[j];
+	}
+
+	fs = bpfjit_fset_create(progs, HOST_INSNS, 8);
+	REQUIRE(fs != NULL);
+
+	args.pkt = ip_pkt;
+	args.buflen = args.wirelen = sizeof(ip_pkt);
+	args.arg = NULL;
+
+	ids[2] = SIZE_MAX;
+	CHECK(bpfjit_fset_call(fs, &args, ids, 2) == 4);
+	CHECK(ids[0] % 2 == 0 && ids[0] < 8);
+	CHECK(ids[1] % 2 == 0 && ids[1] < 8);
+	CHECK(ids[0] != ids[1]);
+	CHECK(ids[2] == SIZE_MAX);
+
+	CHECK(bpfjit_fset_call(fs, &args, NULL, 0) == 4);
+
+	bpfjit_fset_destroy(fs);
+}
+
+static void
+test_fset_invalid(void)
+{
+	static struct bpf_insn insns[2][HOST_INSNS];
+	static struct bpf_insn many_insns[2][34];
+	struct bpf_insn *progs[2] = { insns[0], insns[1] };
+	size_t i, j;
+
+	memcpy(insns[0], host_insns, sizeof(host_insns));
+	memcpy(insns[1], host_insns, sizeof(host_insns));
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 0) == NULL);
+	CHECK(bpfjit_fset_create(progs, 0, 2) == NULL);
+
+	/* Programs differ outside of JEQ constants. */
+	insns[1][2].k = 27;
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+	insns[1][2].k = 26;
+	insns[1][3].jf = 1;
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+	insns[1][3].jf = 2;
+	insns[1][9].k = 1;
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+	insns[1][9].k = UINT32_MAX;
+	insns[1][3].code = insns[0][3].code = BPF_JMP+BPF_JGT+BPF_K;
+	insns[1][3].k = 1;
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+	insns[1][3].code = insns[0][3].code = BPF_JMP+BPF_JEQ+BPF_K;
+
+	/* Invalid skeleton. */
+	insns[0][3].jt = insns[1][3].jt = 7;
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+	insns[0][3].jt = insns[1][3].jt = 0;
+	insns[0][7] = insns[1][7] = (struct bpf_insn)
+	    BPF_STMT(BPF_MISC+BPF_COP, 0);
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+	insns[0][7] = insns[1][7] = (struct bpf_insn)
+	    BPF_STMT(BPF_ST, 16);
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+	insns[0][7] = insns[1][7] = host_insns[7];
+	insns[0][10] = insns[1][10] = (struct bpf_insn)
+	    BPF_STMT(BPF_LD+BPF_IMM, 0);
+	CHECK(bpfjit_fset_create(progs, HOST_INSNS, 2) == NULL);
+
+	progs[0] = many_insns[0];
+	progs[1] = many_insns[1];
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 33; j++) {
+			many_insns[i][j] = (struct bpf_insn)
+			    BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, i * 100 + j, 0, 0);
+		}
+		many_insns[i][33] = (struct bpf_insn)
+		    BPF_STMT(BPF_RET+BPF_K, 1);
+	}
+	CHECK(bpfjit_fset_create(progs, 34, 2) == NULL);
+	many_insns[1][0].k = 0;
+	check_fset(progs, 34, 2, ip_pkt, sizeof(ip_pkt));
+}
+
+void
+test_fset(void)
+{
+
+	memset(ip_pkt, 0x5a, sizeof(ip_pkt));
+	memcpy(ip_pkt, host_pkt, sizeof(host_pkt));
+
+	test_fset_host();
+	test_fset_default();
+	test_fset_miss();
+	test_fset_maxids();
+	test_fset_invalid();
+}
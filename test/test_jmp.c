@@ -30,6 +30,7 @@
 #include <bpfjit.h>
 
 #include <stdint.h>
+#include <string.h>
 
 #include "util.h"
 #include "tests.h"
@@ -555,6 +556,186 @@ test_jmp_modulo_x(void)
 	bpfjit_free_code(code);
 }
 
+/*
+ * A ladder of BPF_JEQ instructions that bpfjit compiles to a switch.
+ */
+static void
+test_jmp_eq_ladder_1(void)
+{
+	struct bpf_insn insns[1 + 40 + 1 + 25];
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+	size_t i, t, n = 40;
+	uint32_t key;
+	bpfjit_function_t code;
+	uint8_t pkt[2];
+
+	memset(insns, 0, sizeof(insns));
+	insns[0].code = BPF_LD+BPF_H+BPF_ABS;
+	insns[n + 1].code = BPF_RET+BPF_K;
+
+	for (i = 0; i < n; i++) {
+		if (i < 16) {
+			/* dense keys with a common destination */
+			key = 100 + i + (i > 7);
+			t = 0;
+		} else if (i == 32) {
+			/* duplicate key, never matches */
+			key = insns[1 + 20].k;
+			t = 24;
+		} else {
+			key = 5000 + 97 * i;
+			t = i % 24;
+		}
+
+		insns[1 + i].code = BPF_JMP+BPF_JEQ+BPF_K;
+		insns[1 + i].k = key;
+		insns[1 + i].jt = (n + 2 + t) - (1 + i) - 1;
+		insns[1 + i].jf = 0;
+	}
+
+	for (t = 0; t < 25; t++) {
+		insns[n + 2 + t].code = BPF_RET+BPF_K;
+		insns[n + 2 + t].k = 1000 + t;
+	}
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i <= UINT16_MAX; i++) {
+		pkt[0] = i >> 8;
+		pkt[1] = i;
+		CHECK(bpfjit_call(code, pkt, 2, 2) ==
+		    bpf_filter(insns, pkt, 2, 2));
+	}
+
+	CHECK(bpfjit_call(code, pkt, 1, 1) == 0);
+
+	bpfjit_free_code(code);
+}
+
+/*
+ * Cases of a ladder aren't adjacent.
+ */
+static void
+test_jmp_eq_ladder_2(void)
+{
+	struct bpf_insn insns[1 + 2 * 12 + 1];
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+	size_t i;
+	bpfjit_function_t code;
+	uint8_t pkt[1];
+
+	memset(insns, 0, sizeof(insns));
+	insns[0].code = BPF_LD+BPF_B+BPF_ABS;
+
+	for (i = 0; i < 12; i++) {
+		insns[1 + 2 * i].code = BPF_JMP+BPF_JEQ+BPF_K;
+		insns[1 + 2 * i].k = 3 * i * i;
+		insns[1 + 2 * i].jt = 0;
+		insns[1 + 2 * i].jf = 1;
+		insns[2 + 2 * i].code = BPF_RET+BPF_K;
+		insns[2 + 2 * i].k = 100 + i;
+	}
+
+	insns[insn_count - 1].code = BPF_RET+BPF_K;
+	insns[insn_count - 1].k = 7;
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i <= UINT8_MAX; i++) {
+		pkt[0] = i;
+		CHECK(bpfjit_call(code, pkt, 1, 1) ==
+		    bpf_filter(insns, pkt, 1, 1));
+	}
+
+	bpfjit_free_code(code);
+}
+
+/*
+ * Some cases of a ladder are also reached from the instruction
+ * before them.
+ */
+static void
+test_jmp_eq_ladder_3(void)
+{
+	struct bpf_insn insns[1 + 2 * 12 + 1];
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+	size_t i;
+	bpfjit_function_t code;
+	uint8_t pkt[2];
+
+	memset(insns, 0, sizeof(insns));
+	insns[0].code = BPF_LD+BPF_B+BPF_ABS;
+
+	for (i = 0; i < 12; i++) {
+		insns[1 + 2 * i].code = BPF_JMP+BPF_JEQ+BPF_K;
+		insns[1 + 2 * i].k = 3 * i * i;
+		insns[1 + 2 * i].jt = 0;
+		insns[1 + 2 * i].jf = 1;
+
+		if (i == 0 || i == 5) {
+			/* Fall through to the next case. */
+			insns[2 + 2 * i].code = BPF_LD+BPF_B+BPF_ABS;
+			insns[2 + 2 * i].k = 1;
+		} else {
+			insns[2 + 2 * i].code = BPF_RET+BPF_K;
+			insns[2 + 2 * i].k = 100 + i;
+		}
+	}
+
+	insns[insn_count - 1].code = BPF_RET+BPF_K;
+	insns[insn_count - 1].k = 7;
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i <= UINT16_MAX; i++) {
+		pkt[0] = i >> 8;
+		pkt[1] = i;
+		CHECK(bpfjit_call(code, pkt, 2, 2) ==
+		    bpf_filter(insns, pkt, 2, 2));
+	}
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_jmp_uninit(void)
+{
+	/* X is zero when a jump reads it before a store. */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 1, 0),
+		BPF_STMT(BPF_LDX+BPF_IMM, 1),
+		BPF_JUMP(BPF_JMP+BPF_JGE+BPF_X, 0, 1, 0),
+		BPF_STMT(BPF_RET+BPF_K, 0),
+		BPF_STMT(BPF_RET+BPF_K, UINT32_MAX)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[1] = { 0 };
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(bpfjit_call(code, pkt, 1, 1) == UINT32_MAX);
+	pkt[0] = 1;
+	CHECK(bpfjit_call(code, pkt, 1, 1) == UINT32_MAX);
+
+	bpfjit_free_code(code);
+}
+
 void
 test_jmp(void)
 {
@@ -570,4 +751,8 @@ test_jmp(void)
 	test_jmp_eq_x();
 	test_jmp_jset_x();
 	test_jmp_modulo_x();
+	test_jmp_eq_ladder_1();
+	test_jmp_eq_ladder_2();
+	test_jmp_eq_ladder_3();
+	test_jmp_uninit();
 }
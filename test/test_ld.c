@@ -89,6 +89,56 @@ test_ld_abs(void)
 	}
 }
 
+static void
+test_ld_abs_alignment(void)
+{
+	static struct bpf_insn insns[2][9] = {
+		{
+			BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 0),
+			BPF_STMT(BPF_ST, 0),
+			BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 1),
+			BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 0),
+			BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+			BPF_STMT(BPF_TAX, 0),
+			BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 3),
+			BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+			BPF_STMT(BPF_RET+BPF_A, 0)
+		},
+		{
+			BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 0),
+			BPF_STMT(BPF_ST, 0),
+			BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 1),
+			BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 0),
+			BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+			BPF_STMT(BPF_TAX, 0),
+			BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 3),
+			BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+			BPF_STMT(BPF_RET+BPF_A, 0)
+		}
+	};
+
+	size_t i, l;
+	uint8_t pkt[7] = { 0x81, 0x92, 0xa3, 0xb4, 0xc5, 0xd6, 0xe7 };
+
+	size_t insn_count = sizeof(insns[0]) / sizeof(insns[0][0]);
+
+	for (i = 0; i < 2; i++) {
+		bpfjit_function_t code;
+
+		CHECK(bpf_validate(insns[i], insn_count));
+
+		code = bpfjit_generate_code(NULL, insns[i], insn_count);
+		REQUIRE(code != NULL);
+
+		for (l = 0; l <= sizeof(pkt); l++) {
+			CHECK(bpfjit_call(code, pkt, l, l) ==
+			    bpf_filter(insns[i], pkt, l, l));
+		}
+
+		bpfjit_free_code(code);
+	}
+}
+
 static void
 test_ld_abs_k_overflow(void)
 {
@@ -446,6 +496,7 @@ test_ld(void)
 {
 
 	test_ld_abs();
+	test_ld_abs_alignment();
 	test_ld_abs_k_overflow();
 	test_ld_ind();
 	test_ld_ind_k_overflow();
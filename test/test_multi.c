@@ -0,0 +1,398 @@
+/*-
+ * Copyright (c) 2013 Alexander Nasonov.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <bpfjit.h>
+#include <sljitLir.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+#include "tests.h"
+
+#define MAXPROGS (sizeof(size_t) * CHAR_BIT)
+
+/* ip */
+static struct bpf_insn ip_insns[] = {
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 1),
+	BPF_STMT(BPF_RET+BPF_K, 96),
+	BPF_STMT(BPF_RET+BPF_K, 0)
+};
+
+/* ip src host 128.3.112.15 */
+static struct bpf_insn src_insns[] = {
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 3),
+	BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x8003700f, 0, 1),
+	BPF_STMT(BPF_RET+BPF_K, 1),
+	BPF_STMT(BPF_RET+BPF_K, 0)
+};
+
+/* Return the transport header word or 0. */
+static struct bpf_insn msh_insns[] = {
+	BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 14),
+	BPF_STMT(BPF_LD+BPF_H+BPF_IND, 14),
+	BPF_STMT(BPF_ST, 2),
+	BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+	BPF_JUMP(BPF_JMP+BPF_JGE+BPF_K, 40, 0, 1),
+	BPF_STMT(BPF_LD+BPF_MEM, 2),
+	BPF_STMT(BPF_RET+BPF_A, 0)
+};
+
+/* Return X+A, both are 0 initially. */
+static struct bpf_insn zero_insns[] = {
+	BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+	BPF_STMT(BPF_RET+BPF_A, 0)
+};
+
+/* The TCP header that follows host_pkt with a 20 byte IP header. */
+static const uint8_t tcp_hdr[] = {
+	0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0, 0x11, 0x22
+};
+
+/*
+ * Run multi code for every buflen and compare each result
+ * and the mask with bpf_filter().
+ */
+static void
+check_multi(struct bpf_insn *const *progs, const size_t *insn_counts,
+    size_t nprogs, const uint8_t *pkt, size_t pktsize)
+{
+	bpfjit_multi_t *bm;
+	bpf_args_t args;
+	size_t res[MAXPROGS + 1];
+	size_t i, j, mask, rv;
+
+	for (j = 0; j < nprogs; j++)
+		CHECK(bpf_validate(progs[j], insn_counts[j]));
+
+	bm = bpfjit_multi_create(NULL, progs, insn_counts, nprogs);
+	REQUIRE(bm != NULL);
+
+	for (i = 0; i <= pktsize; i++) {
+		args.pkt = pkt;
+		args.buflen = i;
+		args.wirelen = pktsize;
+		args.arg = NULL;
+
+		memset(res, 0xff, sizeof(res));
+		mask = bpfjit_multi_call(bm, &args, res);
+		CHECK(res[nprogs] == SIZE_MAX);
+
+		for (j = 0; j < nprogs; j++) {
+			rv = bpf_filter(progs[j], pkt, pktsize, i);
+			CHECK(res[j] == rv);
+			CHECK(((mask >> j) & 1) == (rv != 0));
+		}
+
+		if (nprogs < MAXPROGS)
+			CHECK((mask >> nprogs) == 0);
+	}
+
+	bpfjit_multi_destroy(bm);
+}
+
+static void
+test_multi_host(void)
+{
+	struct bpf_insn *progs[] = {
+		ip_insns, host_insns, src_insns, msh_insns, zero_insns
+	};
+
+	size_t insn_counts[] = {
+		sizeof(ip_insns) / sizeof(ip_insns[0]),
+		sizeof(host_insns) / sizeof(host_insns[0]),
+		sizeof(src_insns) / sizeof(src_insns[0]),
+		sizeof(msh_insns) / sizeof(msh_insns[0]),
+		sizeof(zero_insns) / sizeof(zero_insns[0])
+	};
+
+	const size_t nprogs = sizeof(progs) / sizeof(progs[0]);
+	uint8_t pkt[sizeof(host_pkt) + sizeof(tcp_hdr)];
+
+	memcpy(pkt, host_pkt, sizeof(host_pkt));
+	memcpy(pkt + sizeof(host_pkt), tcp_hdr, sizeof(tcp_hdr));
+	pkt[14] = 0x45;
+
+	check_multi(progs, insn_counts, nprogs, pkt, sizeof(pkt));
+
+	/* Programs in reverse order. */
+	check_multi(progs + 3, insn_counts + 3, 2, pkt, sizeof(pkt));
+	check_multi(progs + 1, insn_counts + 1, 1, pkt, sizeof(pkt));
+
+	pkt[12] = 0x86;
+	check_multi(progs, insn_counts, nprogs, pkt, sizeof(pkt));
+}
+
+/*
+ * A, X and M[] don't leak from one program to the next.
+ */
+static void
+test_multi_reset(void)
+{
+	static struct bpf_insn insns1[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 7),
+		BPF_STMT(BPF_ST, 5),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_IMM, 9),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static struct bpf_insn insns2[] = {
+		BPF_STMT(BPF_LD+BPF_MEM, 5),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	struct bpf_insn *progs[] = { insns1, insns2, insns1, insns2 };
+
+	size_t insn_counts[] = {
+		sizeof(insns1) / sizeof(insns1[0]),
+		sizeof(insns2) / sizeof(insns2[0]),
+		sizeof(insns1) / sizeof(insns1[0]),
+		sizeof(insns2) / sizeof(insns2[0])
+	};
+
+	bpfjit_multi_t *bm;
+	bpf_args_t args;
+	size_t res[4];
+	uint8_t pkt[1] = { 0 };
+
+	bm = bpfjit_multi_create(NULL, progs, insn_counts, 4);
+	REQUIRE(bm != NULL);
+
+	args.pkt = pkt;
+	args.buflen = args.wirelen = sizeof(pkt);
+	args.arg = NULL;
+
+	CHECK(bpfjit_multi_call(bm, &args, res) == 5);
+	CHECK(res[0] == 7);
+	CHECK(res[1] == 0);
+	CHECK(res[2] == 7);
+	CHECK(res[3] == 0);
+
+	bpfjit_multi_destroy(bm);
+}
+
+static size_t ncalls;
+
+static uint32_t
+incA(bpf_ctx_t *bc, bpf_args_t *args, bpf_state_t *state)
+{
+
+	(void)bc;
+	(void)args;
+	ncalls++;
+	return state->regA + 1;
+}
+
+static int
+emit_incA(struct sljit_compiler *compiler,
+    const struct bpfjit_cop_regs *regs)
+{
+
+	return sljit_emit_op2(compiler,
+	    SLJIT_ADD|SLJIT_INT_OP,
+	    regs->a, 0,
+	    regs->a, 0,
+	    SLJIT_IMM, 1);
+}
+
+static const bpf_copfunc_t copfuncs[] = {
+	&incA
+};
+
+static const bpfjit_copemit_t copemits[] = {
+	&emit_incA
+};
+
+static bpf_ctx_t ctx = {
+	copfuncs, sizeof(copfuncs) / sizeof(copfuncs[0]), copemits, NULL
+};
+
+/*
+ * A packet too short for program 1 fails its check but programs
+ * 0 and 2 still run in generated code, which doesn't call incA().
+ */
+static void
+test_multi_short(void)
+{
+	static struct bpf_insn insns0[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 1),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static struct bpf_insn insns1[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 40),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static struct bpf_insn insns2[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_STMT(BPF_MISC+BPF_COP, 0), // incA
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	struct bpf_insn *progs[] = { insns0, insns1, insns2 };
+
+	size_t insn_counts[] = {
+		sizeof(insns0) / sizeof(insns0[0]),
+		sizeof(insns1) / sizeof(insns1[0]),
+		sizeof(insns2) / sizeof(insns2[0])
+	};
+
+	bpfjit_multi_t *bm;
+	bpf_args_t args;
+	size_t res[3];
+	uint8_t pkt[44];
+	size_t i, mask;
+
+	for (i = 0; i < sizeof(pkt); i++)
+		pkt[i] = i + 1;
+
+	bm = bpfjit_multi_create(&ctx, progs, insn_counts, 3);
+	REQUIRE(bm != NULL);
+
+	args.pkt = pkt;
+	args.wirelen = sizeof(pkt);
+	args.arg = NULL;
+
+	ncalls = 0;
+	for (i = 0; i <= sizeof(pkt); i++) {
+		args.buflen = i;
+		memset(res, 0xff, sizeof(res));
+		mask = bpfjit_multi_call(bm, &args, res);
+
+		CHECK(res[0] == (i >= 2 ? 2 : 0));
+		CHECK(res[1] == (i >= 44 ? 0x292a2b2c : 0));
+		CHECK(res[2] == (i >= 1 ? 2 : 0));
+		CHECK(mask == ((i >= 2 ? 1 : 0) | (i >= 44 ? 2 : 0) |
+		    (i >= 1 ? 4 : 0)));
+	}
+	CHECK(ncalls == 0);
+
+	bpfjit_multi_destroy(bm);
+}
+
+/*
+ * The largest set of programs, every program tests one bit.
+ */
+static void
+test_multi_max(void)
+{
+	struct bpf_insn insns[MAXPROGS + 1][4];
+	struct bpf_insn *progs[MAXPROGS + 1];
+	size_t insn_counts[MAXPROGS + 1];
+	uint8_t pkt[MAXPROGS / 8];
+	size_t j;
+
+	for (j = 0; j <= MAXPROGS; j++) {
+		insns[j][0] = (struct bpf_insn)
+		    BPF_STMT(BPF_LD+BPF_B+BPF_ABS, (j / 8) % sizeof(pkt));
+		insns[j][1] = (struct bpf_insn)
+		    BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 1u << (j % 8), 0, 1);
+		insns[j][2] = (struct bpf_insn)
+		    BPF_STMT(BPF_RET+BPF_K, j + 1);
+		insns[j][3] = (struct bpf_insn)
+		    BPF_STMT(BPF_RET+BPF_K, 0);
+		progs[j] = insns[j];
+		insn_counts[j] = 4;
+	}
+
+	for (j = 0; j < sizeof(pkt); j++)
+		pkt[j] = 0x5a ^ (j * 17);
+
+	check_multi(progs, insn_counts, MAXPROGS, pkt, sizeof(pkt));
+
+	CHECK(bpfjit_multi_create(NULL, progs, insn_counts,
+	    MAXPROGS + 1) == NULL);
+}
+
+static void
+test_multi_invalid(void)
+{
+	static struct bpf_insn noret_insns[] = {
+		BPF_STMT(BPF_RET+BPF_K, 1),
+		BPF_STMT(BPF_LD+BPF_IMM, 1)
+	};
+
+	static struct bpf_insn ja_insns[] = {
+		BPF_STMT(BPF_JMP+BPF_JA, 1),
+		BPF_STMT(BPF_RET+BPF_K, 1)
+	};
+
+	static struct bpf_insn jeq_insns[] = {
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 1, 0),
+		BPF_STMT(BPF_RET+BPF_K, 1)
+	};
+
+	static struct bpf_insn cop_insns[] = {
+		BPF_STMT(BPF_MISC+BPF_COP, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	struct bpf_insn *progs[2];
+	size_t insn_counts[2];
+
+	progs[0] = ip_insns;
+	insn_counts[0] = sizeof(ip_insns) / sizeof(ip_insns[0]);
+
+	CHECK(bpfjit_multi_create(NULL, progs, insn_counts, 0) == NULL);
+
+	insn_counts[1] = 0;
+	progs[1] = ip_insns;
+	CHECK(bpfjit_multi_create(NULL, progs, insn_counts, 2) == NULL);
+
+	insn_counts[1] = 2;
+	progs[1] = noret_insns;
+	CHECK(bpfjit_multi_create(NULL, progs, insn_counts, 2) == NULL);
+
+	/* Jumps out of a program would land in the next one. */
+	progs[1] = ja_insns;
+	CHECK(bpfjit_multi_create(NULL, progs, insn_counts, 2) == NULL);
+	progs[1] = jeq_insns;
+	CHECK(bpfjit_multi_create(NULL, progs, insn_counts, 2) == NULL);
+
+	progs[1] = cop_insns;
+	CHECK(bpfjit_multi_create(NULL, progs, insn_counts, 2) == NULL);
+}
+
+void
+test_multi(void)
+{
+
+	test_multi_host();
+	test_multi_reset();
+	test_multi_short();
+	test_multi_max();
+	test_multi_invalid();
+}
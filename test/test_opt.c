@@ -34,6 +34,7 @@
 #include <bpfjit.h>
 
 #include <stdint.h>
+#include <string.h>
 
 #include "util.h"
 #include "tests.h"
@@ -394,6 +395,986 @@ test_opt_ld_ind_4(void)
 	bpfjit_free_code(code);
 }
 
+static void
+test_opt_ld_ind_5(void)
+{
+	/*
+	 * Loads at 2 and 4 share X and one index check. X changes
+	 * at 7 and the load at 9 needs a new index check.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 1),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 2),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 22, 7, 0),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 4),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 22, 5, 0),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_K, 40),
+		BPF_STMT(BPF_MISC+BPF_TAX, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_IND, 0),
+		BPF_STMT(BPF_LD+BPF_W+BPF_IND, 2),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_K, 0, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 1),
+		BPF_STMT(BPF_RET+BPF_K, 2)
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[48];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 16; i++) {
+		memset(pkt, 0, sizeof(pkt));
+		pkt[0] = i;
+		pkt[1] = 3 * i;
+		pkt[4 * (i & 7) + 3] = 22;
+		pkt[4 * (i & 7) + 5] = 22 * (i & 1);
+		pkt[sizeof(pkt) - 1] = 1;
+
+		for (j = 0; j <= sizeof(pkt); j++) {
+			CHECK(bpfjit_call(code, pkt, j, j) ==
+			    bpf_filter(insns, pkt, j, j));
+		}
+	}
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_ld_abs_reload_1(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_K, 0x5ff, 0, 5),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 3),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 6, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET+BPF_K, 0),
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[3][24] = {
+		{
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+			14, 15, 16, 17, 18, 19, 20, 21, 22, 6
+		},
+		{
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+			14, 15, 16, 17, 18, 19, 20, 21, 22, 17
+		},
+		{
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x86, 0xdd,
+			14, 15, 16, 17, 18, 19, 20, 21, 22, 6
+		}
+	};
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j <= sizeof(pkt[i]); j++) {
+			CHECK(bpfjit_call(code, pkt[i], j, j) ==
+			    bpf_filter(insns, pkt[i], j, j));
+		}
+	}
+
+	CHECK(bpfjit_call(code, pkt[0], 24, 24) == UINT32_MAX);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_ld_abs_reload_2(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 3),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 6, 4, 0),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x86dd, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 2),
+		BPF_STMT(BPF_RET+BPF_K, 0),
+		BPF_STMT(BPF_RET+BPF_K, 1),
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[3][24] = {
+		{
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+			14, 15, 16, 17, 18, 19, 20, 21, 22, 6
+		},
+		{
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+			14, 15, 16, 17, 18, 19, 20, 21, 22, 17
+		},
+		{
+			0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x86, 0xdd,
+			14, 15, 16, 17, 18, 19, 20, 21, 22, 6
+		}
+	};
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j <= sizeof(pkt[i]); j++) {
+			CHECK(bpfjit_call(code, pkt[i], j, j) ==
+			    bpf_filter(insns, pkt[i], j, j));
+		}
+	}
+
+	CHECK(bpfjit_call(code, pkt[0], 24, 24) == 1);
+	CHECK(bpfjit_call(code, pkt[1], 24, 24) == 0);
+	CHECK(bpfjit_call(code, pkt[2], 24, 24) == 2);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_const_1(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 5),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_K, 3),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 0),
+		BPF_STMT(BPF_MISC+BPF_TXA, 0),
+		BPF_STMT(BPF_ALU+BPF_MUL+BPF_X, 0),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_K, 63, 2, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_STMT(BPF_RET+BPF_K, 64),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	size_t i;
+	bpfjit_function_t code;
+	uint8_t pkt[1] = { 0 };
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i <= sizeof(pkt); i++)
+		CHECK(bpfjit_call(code, pkt, i, i) == 64);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_const_2(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 2),
+		BPF_STMT(BPF_LD+BPF_IMM, 7),
+		BPF_STMT(BPF_JMP+BPF_JA, 1),
+		BPF_STMT(BPF_LD+BPF_IMM, 9),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_IMM, 7),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_X, 0, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 1),
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	size_t i;
+	bpfjit_function_t code;
+	uint8_t pkt[8] = { 0 };
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(bpfjit_call(code, pkt, 1, 1) == 1);
+	for (i = 2; i <= sizeof(pkt); i++)
+		CHECK(bpfjit_call(code, pkt, i, i) == i + 7);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_thread_1(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 1, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x86dd, 0, 3),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 1),
+		BPF_STMT(BPF_RET+BPF_K, 2),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[3][14] = {
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00 },
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x86, 0xdd },
+		{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x06 }
+	};
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(bpfjit_call(code, pkt[0], 14, 14) == 1);
+	CHECK(bpfjit_call(code, pkt[1], 14, 14) == 2);
+	CHECK(bpfjit_call(code, pkt[2], 14, 14) == 0);
+	CHECK(bpfjit_call(code, pkt[0], 13, 13) == 0);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_thread_2(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_K, 10, 0, 4),
+		BPF_JUMP(BPF_JMP+BPF_JGE+BPF_K, 5, 0, 6),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x80, 0, 1),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x80, 4, 3),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x80, 2, 3),
+		BPF_JUMP(BPF_JMP+BPF_JGE+BPF_K, 11, 1, 0),
+		BPF_STMT(BPF_RET+BPF_K, 7),
+		BPF_STMT(BPF_RET+BPF_K, 8),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	size_t i;
+	bpfjit_function_t code;
+	uint8_t pkt[1];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i <= UINT8_MAX; i++) {
+		pkt[0] = i;
+		CHECK(bpfjit_call(code, pkt, 1, 1) ==
+		    bpf_filter(insns, pkt, 1, 1));
+	}
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_checks_1(void)
+{
+	/*
+	 * The read at 5 is a destination of the jump at 3 which follows
+	 * a longer read but it's also reached by falling through from 4
+	 * where nothing has been checked.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 0, 2),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 100),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 2, 1),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_IMM, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 50),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[101];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[50] = 51;
+
+	CHECK(bpfjit_call(code, pkt, 60, 60) == 51);
+	CHECK(bpfjit_call(code, pkt, 51, 51) == 51);
+	CHECK(bpfjit_call(code, pkt, 50, 50) == 0);
+	CHECK(bpfjit_call(code, pkt, 1, 1) == 0);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_checks_2(void)
+{
+	/*
+	 * Both arms of the first jump read P[20:4] or return 0, the check
+	 * is hoisted to the first load. The arm that returns non-zero
+	 * before reading P[30:1] must not see that check.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 4),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 20),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_K, 0x10000, 0, 6),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 30),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x806, 0, 3),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 22),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 2),
+		BPF_STMT(BPF_RET+BPF_K, 0),
+		BPF_STMT(BPF_RET+BPF_K, 3)
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[3][32];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	memset(pkt, 0, sizeof(pkt));
+	pkt[0][12] = 0x08; pkt[0][13] = 0x00; pkt[0][21] = 1;
+	pkt[0][30] = 7;
+	pkt[1][12] = 0x08; pkt[1][13] = 0x00;
+	pkt[2][12] = 0x08; pkt[2][13] = 0x06; pkt[2][23] = 1;
+
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j <= sizeof(pkt[i]); j++) {
+			CHECK(bpfjit_call(code, pkt[i], j, j) ==
+			    bpf_filter(insns, pkt[i], j, j));
+		}
+	}
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_dead_1(void)
+{
+	/*
+	 * Instructions 1, 2 and 5 write values that are never read.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 0),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_K, 1),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 4),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_MISC+BPF_TAX, 0),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 0),
+		BPF_STMT(BPF_ALU+BPF_SUB+BPF_X, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 0, 1),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_K, 7),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[8];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < sizeof(pkt); i++)
+		pkt[i] = 3 * i + 1;
+
+	for (j = 0; j <= sizeof(pkt); j++) {
+		CHECK(bpfjit_call(code, pkt, j, j) ==
+		    bpf_filter(insns, pkt, j, j));
+	}
+
+	CHECK(bpfjit_call(code, pkt, 8, 8) == 7);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_dead_2(void)
+{
+	/*
+	 * A / X isn't used but it still returns 0 when X is 0.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_STMT(BPF_MISC+BPF_TAX, 0),
+		BPF_STMT(BPF_LD+BPF_IMM, 1),
+		BPF_STMT(BPF_ALU+BPF_DIV+BPF_X, 0),
+		BPF_STMT(BPF_LD+BPF_IMM, 5),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_function_t code;
+	uint8_t pkt[1];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	pkt[0] = 0;
+	CHECK(bpfjit_call(code, pkt, 1, 1) == 0);
+
+	pkt[0] = 2;
+	CHECK(bpfjit_call(code, pkt, 1, 1) == 5);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_fuse_1(void)
+{
+	/*
+	 * Loads at 0, 2 and 6 are fused with BPF_JEQ, the load at 8
+	 * isn't because A is returned.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x0102, 0, 8),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 2),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x03040506, 0, 6),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x0708, 0, 4),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 8),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x090a0b0c, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 1),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[4][12];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < sizeof(pkt[0]); i++)
+		pkt[0][i] = i + 1;
+
+	memcpy(pkt[1], pkt[0], sizeof(pkt[0]));
+	memcpy(pkt[2], pkt[0], sizeof(pkt[0]));
+	memcpy(pkt[3], pkt[0], sizeof(pkt[0]));
+	pkt[1][5] = 0;
+	pkt[2][0] = 2; pkt[2][1] = 1;
+	pkt[3][11] = 0;
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j <= sizeof(pkt[i]); j++) {
+			CHECK(bpfjit_call(code, pkt[i], j, j) ==
+			    bpf_filter(insns, pkt[i], j, j));
+		}
+	}
+
+	CHECK(bpfjit_call(code, pkt[0], 12, 12) == 1);
+	CHECK(bpfjit_call(code, pkt[1], 12, 12) == 0);
+	CHECK(bpfjit_call(code, pkt[2], 12, 12) == 0);
+	CHECK(bpfjit_call(code, pkt[3], 12, 12) == 0x090a0b00);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_fuse_2(void)
+{
+	/*
+	 * Fragment offset and flag tests: BPF_AND+BPF_JEQ 0 after byte
+	 * and word loads, BPF_JSET after halfword and word loads. A is
+	 * live after the last BPF_JSET.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 1),
+		BPF_STMT(BPF_ALU+BPF_AND+BPF_K, 0x1f),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 0, 10),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 2),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x1fff, 8, 0),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 4),
+		BPF_STMT(BPF_ALU+BPF_AND+BPF_K, 0x80000001),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 0, 5),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 8),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x00ff0000, 0, 3),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 10),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x8000, 0, 1),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_STMT(BPF_RET+BPF_K, 1)
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[6][12];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	memset(pkt, 0, sizeof(pkt));
+	for (i = 0; i < 6; i++) {
+		pkt[i][1] = 0xe0;
+		pkt[i][2] = 0x40;
+		pkt[i][5] = 0x7f;
+		pkt[i][6] = 0xff;
+		pkt[i][9] = 0x01;
+		pkt[i][10] = 0x80;
+		pkt[i][11] = 0x07;
+	}
+
+	pkt[1][1] = 0xe1;
+	pkt[2][3] = 0x01;
+	pkt[3][7] = 0x01;
+	pkt[4][4] = 0x80;
+	pkt[5][9] = 0;
+
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j <= sizeof(pkt[i]); j++) {
+			CHECK(bpfjit_call(code, pkt[i], j, j) ==
+			    bpf_filter(insns, pkt[i], j, j));
+		}
+	}
+
+	CHECK(bpfjit_call(code, pkt[0], 12, 12) == 0x8007);
+	CHECK(bpfjit_call(code, pkt[1], 12, 12) == 1);
+	CHECK(bpfjit_call(code, pkt[2], 12, 12) == 1);
+	CHECK(bpfjit_call(code, pkt[3], 12, 12) == 1);
+	CHECK(bpfjit_call(code, pkt[4], 12, 12) == 1);
+	CHECK(bpfjit_call(code, pkt[5], 12, 12) == 1);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_ret_1(void)
+{
+	/*
+	 * Returns of 10, A and 0 share code. Some of them are
+	 * entered by falling through, BPF_RET+BPF_A at 13 is
+	 * folded to return 10.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 10),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 2, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 10),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 3, 0, 1),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 4, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 5, 0, 1),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 6, 0, 2),
+		BPF_STMT(BPF_LD+BPF_IMM, 10),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 7, 1, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	static const uint32_t res[] = { 10, 10, 3, 0, 5, 10, 0, 8 };
+
+	size_t i;
+	bpfjit_function_t code;
+	uint8_t pkt[1];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	CHECK(bpfjit_call(code, pkt, 0, 0) == 0);
+
+	for (i = 0; i < sizeof(res) / sizeof(res[0]); i++) {
+		pkt[0] = i + 1;
+		CHECK(bpfjit_call(code, pkt, 1, 1) == res[i]);
+		CHECK(bpfjit_call(code, pkt, 1, 1) ==
+		    bpf_filter(insns, pkt, 1, 1));
+	}
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_profile_1(void)
+{
+	/*
+	 * Filter from bpf(4), most packets aren't IPv4.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 8),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x8003700f, 0, 2),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 30),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x80037023, 3, 4),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x80037023, 0, 3),
+		BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 30),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x8003700f, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	size_t i, j;
+	bpfjit_function_t code;
+	uint8_t pkt[4][34];
+	size_t counts[2 * sizeof(insns) / sizeof(insns[0])];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	memset(counts, 0, sizeof(counts));
+	code = bpfjit_generate_profiled_code(NULL, insns, insn_count, counts);
+	REQUIRE(code != NULL);
+
+	memset(pkt, 0, sizeof(pkt));
+	for (i = 0; i < 3; i++) {
+		pkt[i][12] = 0x08;
+		pkt[i][26] = pkt[i][30] = 0x80;
+		pkt[i][27] = pkt[i][31] = 0x03;
+		pkt[i][28] = pkt[i][32] = 0x70;
+	}
+	pkt[0][29] = 0x0f; pkt[0][33] = 0x23;
+	pkt[1][29] = 0x23; pkt[1][33] = 0x0f;
+	pkt[2][29] = 0x0f; pkt[2][33] = 0x0f;
+
+	for (i = 0; i < 4; i++)
+		CHECK(bpfjit_call(code, pkt[3], 34, 34) == 0);
+	for (i = 0; i < 3; i++)
+		CHECK(bpfjit_call(code, pkt[i], 34, 34) == (i < 2 ? UINT32_MAX : 0));
+
+	CHECK(counts[2 * 1] == 3);
+	CHECK(counts[2 * 1 + 1] == 4);
+	CHECK(counts[2 * 3] == 2);
+	CHECK(counts[2 * 3 + 1] == 1);
+	CHECK(counts[2 * 5] == 1);
+	CHECK(counts[2 * 5 + 1] == 1);
+	CHECK(counts[2 * 6] == 1);
+	CHECK(counts[2 * 6 + 1] == 0);
+	CHECK(counts[2 * 8] == 1);
+
+	bpfjit_free_code(code);
+
+	code = bpfjit_recompile(NULL, insns, insn_count, counts);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 4; i++) {
+		for (j = 0; j <= sizeof(pkt[i]); j++) {
+			CHECK(bpfjit_call(code, pkt[i], j, j) ==
+			    bpf_filter(insns, pkt[i], j, j));
+		}
+	}
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_profile_2(void)
+{
+	/*
+	 * The hot jf block falls through to BPF_RET, it's moved
+	 * before the jt block and gets BPF_JA. BPF_JA of the
+	 * jt block becomes a fall-through.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 3),
+		BPF_STMT(BPF_LD+BPF_IMM, 7),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_K, 1),
+		BPF_STMT(BPF_JMP+BPF_JA, 2),
+		BPF_STMT(BPF_LD+BPF_IMM, 20),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_K, 2),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	size_t i;
+	bpfjit_function_t code;
+	uint8_t pkt[1];
+	size_t counts[2 * sizeof(insns) / sizeof(insns[0])];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	memset(counts, 0, sizeof(counts));
+	code = bpfjit_generate_profiled_code(NULL, insns, insn_count, counts);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 10; i++) {
+		pkt[0] = i;
+		CHECK(bpfjit_call(code, pkt, 1, 1) == (i == 1 ? 8 : 22));
+	}
+
+	CHECK(counts[2 * 1] == 1);
+	CHECK(counts[2 * 1 + 1] == 9);
+	CHECK(counts[2 * 4] == 1);
+
+	bpfjit_free_code(code);
+
+	code = bpfjit_recompile(NULL, insns, insn_count, counts);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 10; i++) {
+		pkt[0] = i;
+		CHECK(bpfjit_call(code, pkt, 1, 1) == (i == 1 ? 8 : 22));
+	}
+	CHECK(bpfjit_call(code, pkt, 0, 0) == 0);
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_pred_1(void)
+{
+	/*
+	 * Every jump returns on both sides: BPF_JGT+BPF_X, fused
+	 * BPF_AND+BPF_JEQ, fused BPF_LD+BPF_JSET and BPF_RET+BPF_A
+	 * with a known value of A.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LDX+BPF_W+BPF_LEN, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 1),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_X, 0, 8, 9),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 2, 0, 2),
+		BPF_STMT(BPF_ALU+BPF_AND+BPF_K, 0x10),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 6, 5),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 3, 0, 2),
+		BPF_STMT(BPF_LD+BPF_IMM, 7),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 1),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x8001, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, 5),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	size_t i, j;
+	bpfjit_predicate_t code;
+	uint8_t pkt[3];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_predicate(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 256; i++) {
+		pkt[0] = i % 5;
+		pkt[1] = i;
+		pkt[2] = i * 3;
+		for (j = 0; j <= sizeof(pkt); j++) {
+			CHECK(bpfjit_match(code, pkt, j, j) ==
+			    (bpf_filter(insns, pkt, j, j) != 0));
+		}
+
+		CHECK(bpfjit_match(code, pkt, i, sizeof(pkt)) ==
+		    (bpf_filter(insns, pkt, i, sizeof(pkt)) != 0));
+	}
+
+	bpfjit_free_predicate(code);
+}
+
+static void
+test_opt_pred_2(void)
+{
+	/* A in BPF_RET+BPF_A isn't known. */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	/* The same program with unreachable BPF_RET+BPF_A. */
+	static struct bpf_insn insns2[] = {
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 1, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET+BPF_K, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	size_t i;
+	bpfjit_predicate_t code;
+	uint8_t pkt[1];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+	size_t insn_count2 = sizeof(insns2) / sizeof(insns2[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+	CHECK(bpf_validate(insns2, insn_count2));
+
+	CHECK(bpfjit_generate_predicate(NULL, insns, insn_count) == NULL);
+
+	code = bpfjit_generate_predicate(NULL, insns2, insn_count2);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 4; i++) {
+		pkt[0] = i;
+		CHECK(bpfjit_match(code, pkt, 1, 1) == (i == 1));
+	}
+	CHECK(bpfjit_match(code, pkt, 0, 0) == 0);
+
+	bpfjit_free_predicate(code);
+}
+
+static void
+test_opt_msh_1(void)
+{
+	/*
+	 * tcpdump -d "tcp dst port 80 or tcp src port 80" for IPv4.
+	 * The second pair of BPF_IND loads is reached from BPF_LDX+BPF_MSH
+	 * and from BPF_LDX+BPF_IMM, it can't read at buf+X.
+	 */
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 15),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 23),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 6, 0, 13),
+		BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 20),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x1fff, 11, 0),
+		BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 14),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 16),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 80, 7, 0),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 14),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 80, 5, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 15),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0, 1, 0),
+		BPF_STMT(BPF_LDX+BPF_IMM, 20),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 18),
+		BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 80, 0, 1),
+		BPF_STMT(BPF_RET+BPF_K, UINT32_MAX),
+		BPF_STMT(BPF_RET+BPF_K, 0)
+	};
+
+	size_t i, j, len;
+	bpfjit_function_t code;
+	uint8_t pkt[80];
+
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	code = bpfjit_generate_code(NULL, insns, insn_count);
+	REQUIRE(code != NULL);
+
+	for (i = 0; i < 64; i++) {
+		memset(pkt, 0, sizeof(pkt));
+		pkt[12] = 0x08;
+		pkt[14] = 0x40 | (i % 16);
+		pkt[15] = i / 32;
+		pkt[23] = 6;
+
+		/* Port 80 at different offsets. */
+		j = 14 + 4 * ((i + 7) % 16) + 2 * (i / 16 % 2) + 1;
+		if (j < sizeof(pkt))
+			pkt[j] = 80;
+		pkt[14 + 20 + 5] = 80;
+
+		for (len = 0; len <= sizeof(pkt); len++) {
+			CHECK(bpfjit_call(code, pkt, len, len) ==
+			    bpf_filter(insns, pkt, len, len));
+		}
+	}
+
+	bpfjit_free_code(code);
+}
+
+static void
+test_opt_leaf_1(void)
+{
+	/*
+	 * M[0] fits in a register, the first program runs without
+	 * locals. The second one doesn't read the packet either.
+	 */
+	static struct bpf_insn insns1[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_STMT(BPF_ST, 0),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 1),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 0),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	static struct bpf_insn insns2[] = {
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_K, 10, 0, 1),
+		BPF_STMT(BPF_RET+BPF_A, 0),
+		BPF_STMT(BPF_RET+BPF_K, 1)
+	};
+
+	size_t len;
+	bpfjit_function_t code1, code2;
+	uint8_t pkt[16];
+
+	size_t insn_count1 = sizeof(insns1) / sizeof(insns1[0]);
+	size_t insn_count2 = sizeof(insns2) / sizeof(insns2[0]);
+
+	CHECK(bpf_validate(insns1, insn_count1));
+	CHECK(bpf_validate(insns2, insn_count2));
+
+	code1 = bpfjit_generate_code(NULL, insns1, insn_count1);
+	REQUIRE(code1 != NULL);
+
+	code2 = bpfjit_generate_code(NULL, insns2, insn_count2);
+	REQUIRE(code2 != NULL);
+
+	for (len = 0; len < sizeof(pkt); len++)
+		pkt[len] = 3 * len + 1;
+
+	for (len = 0; len <= sizeof(pkt); len++) {
+		CHECK(bpfjit_call(code1, pkt, len + 5, len) ==
+		    bpf_filter(insns1, pkt, len + 5, len));
+		CHECK(bpfjit_call(code2, pkt, len, 0) ==
+		    bpf_filter(insns2, pkt, len, 0));
+	}
+
+	bpfjit_free_code(code1);
+	bpfjit_free_code(code2);
+}
+
 void
 test_opt(void)
 {
@@ -405,5 +1386,25 @@ test_opt(void)
 	test_opt_ld_ind_2();
 	test_opt_ld_ind_3();
 	test_opt_ld_ind_4();
+	test_opt_ld_ind_5();
+	test_opt_ld_abs_reload_1();
+	test_opt_ld_abs_reload_2();
+	test_opt_const_1();
+	test_opt_const_2();
+	test_opt_thread_1();
+	test_opt_thread_2();
+	test_opt_checks_1();
+	test_opt_checks_2();
+	test_opt_dead_1();
+	test_opt_dead_2();
+	test_opt_fuse_1();
+	test_opt_fuse_2();
+	test_opt_ret_1();
+	test_opt_profile_1();
+	test_opt_profile_2();
+	test_opt_pred_1();
+	test_opt_pred_2();
+	test_opt_msh_1();
+	test_opt_leaf_1();
 	/* test BPF_MSH */
 }
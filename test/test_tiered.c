@@ -0,0 +1,245 @@
+/*-
+ * Copyright (c) 2013 Alexander Nasonov.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT
+ * OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <bpfjit.h>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+#include "tests.h"
+
+static size_t hook_calls;
+
+static void
+count_hook(bpfjit_tiered_t *bt, void *arg)
+{
+
+	hook_calls++;
+	*(bpfjit_tiered_t **)arg = bt;
+}
+
+static uint32_t
+retWL(bpf_ctx_t *bc, bpf_args_t *args, bpf_state_t *state)
+{
+
+	return args->wirelen;
+}
+
+static uint32_t
+retM1(bpf_ctx_t *bc, bpf_args_t *args, bpf_state_t *state)
+{
+
+	return state->mem[1] + state->regA;
+}
+
+static const bpf_copfunc_t copfuncs[] = {
+	&retWL,
+	&retM1
+};
+
+static bpf_ctx_t ctx = {
+	copfuncs, sizeof(copfuncs) / sizeof(copfuncs[0]), NULL, NULL
+};
+
+/*
+ * Compare bpfjit_tiered_call() with bpf_filter() for every
+ * buflen, the interpreter first, then generated code.
+ */
+static void
+check_tiered(struct bpf_insn *insns, size_t insn_count,
+    uint8_t *pkt, size_t pktsize)
+{
+	bpfjit_tiered_t *bt;
+	bpf_args_t args;
+	unsigned int i;
+
+	CHECK(bpf_validate(insns, insn_count));
+
+	bt = bpfjit_tiered_create(NULL, insns, insn_count,
+	    pktsize + 1, NULL, NULL);
+	REQUIRE(bt != NULL);
+
+	args.pkt = pkt;
+	args.wirelen = pktsize;
+
+	for (i = 0; i <= pktsize; i++) {
+		args.buflen = i;
+		CHECK(bpfjit_tiered_call(bt, &args) ==
+		    bpf_filter(insns, pkt, pktsize, i));
+	}
+
+	/* The next call crosses the threshold. */
+	for (i = 0; i <= pktsize; i++) {
+		args.buflen = i;
+		CHECK(bpfjit_tiered_call(bt, &args) ==
+		    bpf_filter(insns, pkt, pktsize, i));
+	}
+
+	CHECK(bpfjit_tiered_compile(bt) != NULL);
+
+	bpfjit_tiered_destroy(bt);
+}
+
+static void
+test_tiered_host(void)
+{
+	uint8_t pkt[sizeof(host_pkt)];
+	size_t insn_count = sizeof(host_insns) / sizeof(host_insns[0]);
+
+	memcpy(pkt, host_pkt, sizeof(pkt));
+	check_tiered(host_insns, insn_count, pkt, sizeof(pkt));
+
+	/* Swap the hosts. */
+	memcpy(pkt + 26, host_pkt + 30, 4);
+	memcpy(pkt + 30, host_pkt + 26, 4);
+	check_tiered(host_insns, insn_count, pkt, sizeof(pkt));
+
+	pkt[12] = 0x86;
+	check_tiered(host_insns, insn_count, pkt, sizeof(pkt));
+}
+
+static void
+test_tiered_insns(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LDX+BPF_B+BPF_MSH, 1),
+		BPF_STMT(BPF_LD+BPF_H+BPF_IND, 2),
+		BPF_STMT(BPF_ST, 3),
+		BPF_STMT(BPF_ALU+BPF_MUL+BPF_K, 3),
+		BPF_STMT(BPF_ALU+BPF_DIV+BPF_K, 7),
+		BPF_STMT(BPF_ALU+BPF_NEG, 0),
+		BPF_STMT(BPF_ALU+BPF_LSH+BPF_K, 3),
+		BPF_STMT(BPF_ALU+BPF_OR+BPF_X, 0),
+		BPF_STMT(BPF_MISC+BPF_TAX, 0),
+		BPF_STMT(BPF_LD+BPF_W+BPF_LEN, 0),
+		BPF_STMT(BPF_ALU+BPF_SUB+BPF_X, 0),
+		BPF_JUMP(BPF_JMP+BPF_JSET+BPF_K, 0x10, 0, 2),
+		BPF_STMT(BPF_LDX+BPF_W+BPF_MEM, 3),
+		BPF_STMT(BPF_ALU+BPF_DIV+BPF_X, 0),
+		BPF_JUMP(BPF_JMP+BPF_JGT+BPF_X, 0, 1, 0),
+		BPF_STMT(BPF_ALU+BPF_RSH+BPF_K, 5),
+		BPF_STMT(BPF_ALU+BPF_AND+BPF_K, 0xfff),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	uint8_t pkt[8] = { 0, 0xf1, 5, 6, 7, 8, 9, 10 };
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+	unsigned int i;
+
+	for (i = 0; i < 16; i++) {
+		pkt[1] = 0xf0 + i;
+		pkt[i % sizeof(pkt)] ^= 0x5a;
+		check_tiered(insns, insn_count, pkt, sizeof(pkt));
+	}
+}
+
+static void
+test_tiered_hook(void)
+{
+	bpfjit_tiered_t *bt, *queued;
+	uint8_t pkt[sizeof(host_pkt)];
+	bpf_args_t args = { pkt, sizeof(pkt), sizeof(pkt) };
+	size_t insn_count = sizeof(host_insns) / sizeof(host_insns[0]);
+	unsigned int i;
+
+	memcpy(pkt, host_pkt, sizeof(pkt));
+
+	hook_calls = 0;
+	queued = NULL;
+	bt = bpfjit_tiered_create(NULL, host_insns, insn_count,
+	    3, &count_hook, &queued);
+	REQUIRE(bt != NULL);
+
+	for (i = 0; i < 10; i++)
+		CHECK(bpfjit_tiered_call(bt, &args) == UINT32_MAX);
+
+	CHECK(hook_calls == 1);
+	CHECK(queued == bt);
+
+	CHECK(bpfjit_tiered_compile(bt) != NULL);
+
+	for (i = 0; i < 10; i++)
+		CHECK(bpfjit_tiered_call(bt, &args) == UINT32_MAX);
+
+	CHECK(hook_calls == 1);
+
+	bpfjit_tiered_destroy(bt);
+}
+
+static void
+test_tiered_cop(void)
+{
+	static struct bpf_insn insns[] = {
+		BPF_STMT(BPF_LD+BPF_IMM, 13),
+		BPF_STMT(BPF_ST, 1),
+		BPF_STMT(BPF_LD+BPF_B+BPF_ABS, 0),
+		BPF_STMT(BPF_MISC+BPF_COP, 1),
+		BPF_STMT(BPF_MISC+BPF_TAX, 0),
+		BPF_STMT(BPF_LDX+BPF_IMM, 0),
+		BPF_STMT(BPF_MISC+BPF_COPX, 0),
+		BPF_STMT(BPF_ALU+BPF_ADD+BPF_X, 0),
+		BPF_STMT(BPF_RET+BPF_A, 0)
+	};
+
+	bpfjit_tiered_t *bt;
+	uint8_t pkt[1] = { 7 };
+	bpf_args_t args = { pkt, 100, sizeof(pkt) };
+	size_t insn_count = sizeof(insns) / sizeof(insns[0]);
+	unsigned int i;
+
+	bt = bpfjit_tiered_create(&ctx, insns, insn_count, 2, NULL, NULL);
+	REQUIRE(bt != NULL);
+
+	for (i = 0; i < 5; i++)
+		CHECK(bpfjit_tiered_call(bt, &args) == 100);
+
+	CHECK(bpfjit_tiered_compile(bt) != NULL);
+
+	bpfjit_tiered_destroy(bt);
+
+	/* No context, COP returns 0. */
+	bt = bpfjit_tiered_create(NULL, insns, insn_count, 2, NULL, NULL);
+	REQUIRE(bt != NULL);
+
+	for (i = 0; i < 5; i++)
+		CHECK(bpfjit_tiered_call(bt, &args) == 0);
+
+	bpfjit_tiered_destroy(bt);
+}
+
+void
+test_tiered(void)
+{
+
+	test_tiered_host();
+	test_tiered_insns();
+	test_tiered_hook();
+	test_tiered_cop();
+}
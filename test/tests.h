@@ -9,3 +9,8 @@ void test_stx(void);
 void test_opt(void);
 void test_cop(void);
 void test_copx(void);
+void test_tiered(void);
+void test_direct(void);
+void test_batch(void);
+void test_multi(void);
+void test_fset(void);
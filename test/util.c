@@ -1,3 +1,24 @@
 #include "util.h"
 
 int exit_status = EXIT_SUCCESS;
+
+struct bpf_insn host_insns[11] = {
+	BPF_STMT(BPF_LD+BPF_H+BPF_ABS, 12),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x800, 0, 8),
+	BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 26),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x8003700f, 0, 2),
+	BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 30),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x80037023, 3, 4),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x80037023, 0, 3),
+	BPF_STMT(BPF_LD+BPF_W+BPF_ABS, 30),
+	BPF_JUMP(BPF_JMP+BPF_JEQ+BPF_K, 0x8003700f, 0, 1),
+	BPF_STMT(BPF_RET+BPF_K, UINT32_MAX),
+	BPF_STMT(BPF_RET+BPF_K, 0)
+};
+
+const uint8_t host_pkt[34] = {
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 0x08, 0x00,
+	14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,
+	0x80, 0x03, 0x70, 0x0f,
+	0x80, 0x03, 0x70, 0x23
+};
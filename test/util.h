@@ -33,10 +33,20 @@
 #include "bpfjit.h"
 
 #include <err.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 extern int exit_status;
 
+/*
+ * From bpf(4): accept only IP packets between host 128.3.112.15
+ * and 128.3.112.35. Instructions 3 and 8 compare the first host,
+ * instructions 5 and 6 compare the second one.
+ * Copy host_pkt before changing it.
+ */
+extern struct bpf_insn host_insns[11];
+extern const uint8_t host_pkt[34];
+
 #define REQUIRE(x) if (!(x)) { \
 	errx(EXIT_FAILURE, "%s:%u (in %s): %s\nAborted",  \
 	    __FILE__, __LINE__, __func__, #x); }